@@ -12,7 +12,21 @@
 #include "Phits.h"
 #include "PIUI.h"
 #include "PhitsLogger.h"
+#include "PhitsFitsHeader.h"
+#include "PhitsGzip.h"
+#include "PhitsHeaderCache.h"
+#include "PhitsHistogram.h"
+#include "PhitsKernels.h"
 #include "PhitsMetadata.h"
+#include "PhitsMetadataStore.h"
+#include "PhitsReader.h"
+#include "PhitsSettings.h"
+#include "PhitsStretch.h"
+#include "PhitsThreadPool.h"
+#include "PhitsTiledReader.h"
+#include "PhitsTiledWriter.h"
+#include "PhitsWorkQueue.h"
+#include "PhitsWriter.h"
 #include "Timer.h"
 
 #ifdef _WIN32
@@ -72,16 +86,43 @@ public:
 private:
     void setErrorString(const string& str);
     string getFormatName(int fmt);
+    uint32_t getBandRows(uint32_t rowBytes, uint32_t buffers = 1) const;
+    vector<int> selectImageHdus(const PhitsSettings& settings);
+    bool openFits(int fd);
+    unique_ptr<PhitsImageReader> createExtensionReader(int fd, const vector<int>& imageHdus, uint32_t depth);
+    void addMetadata(shared_ptr<const PhitsMetadata> pMeta);
+    shared_ptr<const PhitsMetadata> getMetadata();
 
     unique_ptr<FITS> m_pFits;
     PHDU* m_pPHDU = nullptr;            // Stashed pointer to PHDU; invalidated when m_pFits is destoyed
+    int m_imageHduIndex = 0;            // Index of the HDU holding the image; 0 for the PHDU
+    vector<int> m_imageHdus;            // Indexes of all HDUs the image is read from, if not just the PHDU
+    vector<string> m_imageCards;        // Raw header cards of the image's HDU
+    int m_imageBitpix = 0;              // As stored in the file, before any conversion
+    double m_imageScale = 1.;
+    double m_imageZero = 0.;
+    bool m_isGzipped = false;
+    shared_ptr<const PhitsHduIndex> m_pHduIndex; // Layout of the file's HDUs, if it isn't gzipped
+    unique_ptr<PhitsImageReader> m_pReader; // Pixel source for readContinue; may refer to m_pFits
     FormatRecordPtr m_formatRecord = nullptr;
     SPPluginRef m_pluginRef = nullptr;
     int16* m_result = nullptr;
+    int32 m_hostMaxData = 0;            // Buffer space offered by the host in the prepare phase
 };
 
 static PhitsPlugin* gPlugin;
 
+// Number of samples per parallel task. Large enough that scheduling overhead is negligible next to the
+// work, small enough that a single band is spread over all workers.
+static const size_t kParallelGrain = 64 * 1024;
+
+// Default amount of pixel data moved per band. This bounds the plugin's own memory use independent of the
+// image size, while keeping the number of host round-trips low.
+static const uint32_t kBandBytes = 16 * 1024 * 1024;
+
+// Most of the header that filterFile() will read. Only the mandatory cards at the start of the header are needed.
+static const size_t kSniffBytes = 4 * PhitsFitsHeader::kBlockSize;
+
 void PhitsPlugin::setErrorString(const string& str)
 {
     if (m_formatRecord->errorString == nullptr || str.size() > 255)
@@ -116,10 +157,84 @@ string PhitsPlugin::getFormatName(int fmt)
     }
 }
 
+// Range of the data values given by the DATAMIN and DATAMAX cards, if it's to be trusted: by default, only if
+// we wrote it, as marked by PHTRANGE. Other software may give a nominal range rather than the actual one.
+static bool getHeaderDataRange(const vector<string>& cards, const PhitsSettings& settings, float& minVal, float& maxVal)
+{
+    if (settings.dataRange == "none")
+    {
+        return false;
+    }
+    string data;
+    data.reserve((cards.size() + 1) * PhitsFitsHeader::kCardSize);
+    for (const string& card : cards)
+    {
+        data += card.substr(0, PhitsFitsHeader::kCardSize);
+        data.resize(data.size() + PhitsFitsHeader::kCardSize - min(card.size(), PhitsFitsHeader::kCardSize), ' ');
+    }
+    data += "END";
+    data.resize((data.size() + PhitsFitsHeader::kBlockSize - 1) / PhitsFitsHeader::kBlockSize * PhitsFitsHeader::kBlockSize, ' ');
+    PhitsFitsHeader header;
+    double lo = 0., hi = 0.;
+    bool isExact = false;
+    if (header.parse(reinterpret_cast<const uint8_t*>(data.data()), data.size()) == PhitsFitsHeader::Status::Invalid ||
+        !header.getDouble("DATAMIN", lo) || !header.getDouble("DATAMAX", hi) ||
+        (settings.dataRange != "any" && !(header.getBool("PHTRANGE", isExact) && isExact)))
+    {
+        return false;
+    }
+    // The readers deliver single-precision values.
+    const double limit = numeric_limits<float>::max();
+    if (!(lo <= hi && lo >= -limit && hi <= limit))
+    {
+        return false;
+    }
+    minVal = (float)lo;
+    maxVal = (float)hi;
+    return true;
+}
+
+// Run a min/max reduction over the worker pool, combining the per-chunk results.
+static void parallelMinMax(const PhitsKernels& kernels, const float* src, size_t count, float& minVal, float& maxVal)
+{
+    const size_t chunkCount = (count + kParallelGrain - 1) / kParallelGrain;
+    vector<float> mins(chunkCount, minVal);
+    vector<float> maxs(chunkCount, maxVal);
+    PhitsThreadPool::get().parallelFor(count, kParallelGrain, [&](size_t begin, size_t end)
+    {
+        const size_t chunk = begin / kParallelGrain;
+        kernels.minMax(src + begin, end - begin, mins[chunk], maxs[chunk]);
+    });
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        minVal = min(minVal, mins[i]);
+        maxVal = max(maxVal, maxs[i]);
+    }
+}
+
+uint32_t PhitsPlugin::getBandRows(uint32_t rowBytes, uint32_t buffers) const
+{
+    const uint32_t imageRows = max<int32>(1, m_formatRecord->imageSize32.v);
+    const PhitsSettings settings;
+    if (settings.bandRows > 0)
+    {
+        return min(settings.bandRows, imageRows);
+    }
+
+    // Stay within the buffer space the host offered, if any, so that our band buffers don't force it to swap.
+    uint32_t budget = kBandBytes;
+    if (m_hostMaxData > 0)
+    {
+        budget = min(budget, (uint32_t)m_hostMaxData / 2 / max<uint32_t>(1, buffers));
+    }
+    return min(imageRows, max<uint32_t>(1, budget / max<uint32_t>(1, rowBytes)));
+}
+
 // Reading
 
 void PhitsPlugin::readPrepare(void)
 {
+    m_hostMaxData = m_formatRecord->maxData;
     m_formatRecord->maxData = 0;
 
 #if __PIMac__
@@ -128,43 +243,155 @@ void PhitsPlugin::readPrepare(void)
 }
 
 
-void PhitsPlugin::readStart(void)
+// Index of the HDU given by EXTNAME or by number, or -1 if there is none.
+static int findHdu(const PhitsHduIndex& index, const string& spec)
 {
-    m_formatRecord->imageRsrcSize = 0;
-    m_formatRecord->imageRsrcData = sPSHandle->New(0);
+    if (!spec.empty() && spec.find_first_not_of("0123456789") == string::npos)
+    {
+        const unsigned long i = strtoul(spec.c_str(), nullptr, 10);
+        return i < index.getHduCount() ? (int)i : -1;
+    }
+    return index.find(spec);
+}
 
-    *m_result = PSSDKSetFPos (m_formatRecord->dataFork,
-                             m_formatRecord->posixFileDescriptor,
-                             m_formatRecord->pluginUsingPOSIXIO,
-                             fsFromStart, 0);
+static bool isReadableImage(const PhitsHduIndex::Hdu& hdu)
+{
+    return (hdu.type == PhitsHduIndex::Type::Image || hdu.type == PhitsHduIndex::Type::CompressedImage) &&
+           (hdu.axes.size() == 2 || hdu.axes.size() == 3);
+}
 
-#ifdef _WIN32
-    const int fd = _open_osfhandle(m_formatRecord->dataFork, 0);
-    if (fd < 0)
+// Channels assembled into one image must be uncompressed single-plane images of the same shape and type.
+static bool isChannelOf(const PhitsHduIndex::Hdu& hdu, const PhitsHduIndex::Hdu& first)
+{
+    return hdu.type == PhitsHduIndex::Type::Image && hdu.axes.size() == 2 && hdu.axes == first.axes && hdu.bitpix == first.bitpix;
+}
+
+// Index of the first image extension we can read, or -1 if there is none.
+static int findImageExtension(const PhitsHduIndex& index)
+{
+    for (size_t i = 1; i < index.getHduCount(); ++i)
     {
-        setErrorString("Could not open FITS file: Failed to convert file handle to file descriptor.");
-        *m_result = errReportString;
-        m_pFits.reset();
-        return;
+        if (isReadableImage(index.getHdu(i)))
+        {
+            return (int)i;
+        }
     }
-#else
-    const int fd = m_formatRecord->posixFileDescriptor;
-#endif
-    log("readStart");
+    return -1;
+}
+
+// Raw header cards of an HDU, read through cfitsio. Used only when the file can't be indexed natively.
+static vector<string> readCards(HDU& hdu)
+{
+    vector<string> cards;
+    fitsfile* fptr = hdu.fitsPointer();
+    int status = 0;
+    int count = 0;
+    fits_movabs_hdu(fptr, hdu.index() + 1, nullptr, &status);
+    fits_get_hdrspace(fptr, &count, nullptr, &status);
+    cards.reserve(count);
+    for (int i = 1; status == 0 && i <= count; ++i)
+    {
+        char card[FLEN_CARD];
+        if (fits_read_record(fptr, i, card, &status) == 0)
+        {
+            cards.push_back(card);
+        }
+    }
+    return cards;
+}
+
+// Choose the HDUs to read the image from, as the settings ask. An empty result selects the primary image, or
+// a tile-compressed image following an empty primary HDU, as found by openFits().
+vector<int> PhitsPlugin::selectImageHdus(const PhitsSettings& settings)
+{
+    vector<int> hdus;
+    if (!m_pHduIndex || !settings.nativeRead)
+    {
+        if (!settings.hdu.empty() || !settings.channelHdus.empty())
+        {
+            log("Image extensions can only be read natively; reading the primary image.");
+        }
+        return hdus;
+    }
+    const PhitsHduIndex& index = *m_pHduIndex;
+
+    if (!settings.channelHdus.empty())
+    {
+        if (settings.channelHdus == "auto")
+        {
+            for (size_t i = 1; i < index.getHduCount() && hdus.size() < 3; ++i)
+            {
+                if (isChannelOf(index.getHdu(i), index.getHdu(hdus.empty() ? i : hdus[0])))
+                {
+                    hdus.push_back((int)i);
+                }
+            }
+        }
+        else
+        {
+            istringstream stream(settings.channelHdus);
+            string spec;
+            while (getline(stream, spec, ','))
+            {
+                spec.erase(0, spec.find_first_not_of(' '));
+                spec.erase(spec.find_last_not_of(' ') + 1);
+                hdus.push_back(findHdu(index, spec));
+            }
+        }
+        bool isValid = hdus.size() == 3 || hdus.size() == 4;
+        for (size_t i = 0; isValid && i < hdus.size(); ++i)
+        {
+            isValid = hdus[i] >= 0 && isChannelOf(index.getHdu(hdus[i]), index.getHdu(hdus[0]));
+        }
+        if (isValid)
+        {
+            return hdus;
+        }
+        log("PHITS_CHANNEL_HDUS doesn't give three or four single-plane images of the same shape and type; ignoring it.");
+        hdus.clear();
+    }
+
+    if (!settings.hdu.empty())
+    {
+        const int i = findHdu(index, settings.hdu);
+        if (i > 0 && isReadableImage(index.getHdu(i)))
+        {
+            hdus.push_back(i);
+        }
+        else if (i != 0)
+        {
+            log("PHITS_HDU doesn't give an image HDU; ignoring it.");
+        }
+        return hdus;
+    }
+
+    // Many pipelines leave the primary HDU empty, and put the image in an extension.
+    const int i = index.getHdu(0).axes.empty() ? findImageExtension(index) : -1;
+    if (i > 0)
+    {
+        hdus.push_back(i);
+    }
+    return hdus;
+}
+
+// Open the file through CCfits, for a primary image the native readers don't handle; PhitsCCfitsReader reads
+// nothing else. Only the primary HDU is read, since constructing the extensions would walk all their headers.
+bool PhitsPlugin::openFits(int fd)
+{
     // FIXME: Extract filename from metadata for better error reporting?
     string name("PhotoshopFile");
     vector<string> keys;
 
     try
     {
-        m_pFits = make_unique<FITS>(name, RWmode::Read, false, keys, fd);
+        m_pFits = make_unique<FITS>(name, RWmode::Read, vector<string>(), false, keys, keys, vector<int>(), fd);
     }
     catch (const exception& e)
     {
         setErrorString("could not open FITS file : " + string(e.what()));
         *m_result = errReportString;
         m_pFits.reset();
-        return;
+        return false;
     }
     catch (const FitsException& e)
     {
@@ -184,24 +411,226 @@ void PhitsPlugin::readStart(void)
         log("---");
         *m_result = errReportString;
         m_pFits.reset();
+        return false;
+    }
+
+    m_pPHDU = &m_pFits->pHDU();
+    return true;
+}
+
+// Native reader for uncompressed image extensions. Several HDUs are read as the planes of one image.
+unique_ptr<PhitsImageReader> PhitsPlugin::createExtensionReader(int fd, const vector<int>& imageHdus, uint32_t depth)
+{
+    vector<unique_ptr<PhitsImageReader>> channels;
+    for (int i : imageHdus)
+    {
+        shared_ptr<PhitsFitsHeader> pHeader = make_shared<PhitsFitsHeader>();
+        if (!m_pHduIndex->readHeader(fd, i, *pHeader))
+        {
+            return nullptr;
+        }
+        unique_ptr<PhitsMappedReader> pMapped = PhitsMappedReader::create(fd, depth, pHeader, m_pHduIndex->getHdu(i).headerOffset);
+        if (!pMapped)
+        {
+            return nullptr;
+        }
+        channels.push_back(move(pMapped));
+    }
+    if (channels.size() == 1)
+    {
+        return move(channels[0]);
+    }
+    return make_unique<PhitsChannelReader>(move(channels));
+}
+
+void PhitsPlugin::readStart(void)
+{
+    m_formatRecord->imageRsrcSize = 0;
+    m_formatRecord->imageRsrcData = sPSHandle->New(0);
+
+    *m_result = PSSDKSetFPos (m_formatRecord->dataFork,
+                             m_formatRecord->posixFileDescriptor,
+                             m_formatRecord->pluginUsingPOSIXIO,
+                             fsFromStart, 0);
+
+#ifdef _WIN32
+    const int fd = _open_osfhandle(m_formatRecord->dataFork, 0);
+    if (fd < 0)
+    {
+        setErrorString("Could not open FITS file: Failed to convert file handle to file descriptor.");
+        *m_result = errReportString;
+        m_pFits.reset();
         return;
     }
+#else
+    const int fd = m_formatRecord->posixFileDescriptor;
+#endif
+    log("readStart");
+    m_pFits.reset();
+    m_pPHDU = nullptr;
+    m_imageHduIndex = 0;
+    m_imageHdus.clear();
+    m_imageCards.clear();
+
+    // When opening a gzipped file, cfitsio inflates all of it into memory, so we stream those ourselves.
+    unique_ptr<PhitsGzipReader> pGzip;
+    m_isGzipped = PhitsGzipReader::isGzipped(fd);
+    m_pHduIndex = m_isGzipped ? nullptr : PhitsHeaderCache::get().getHduIndex(fd);
+    if (m_isGzipped && PhitsSettings().nativeRead)
+    {
+        pGzip = PhitsGzipReader::create(fd);
+        if (!pGzip)
+        {
+            log("Gzipped file can't be streamed; falling back to cfitsio.");
+        }
+    }
+
+    const vector<int> imageHdus = pGzip ? vector<int>() : selectImageHdus(PhitsSettings());
+    unique_ptr<PhitsTiledReader> pTiled;
+    int naxis = 0;
+    int xres = 0;
+    int yres = 0;
+    int planes = 1;
+    int fmt = 0;
+    bool isScaled = false;
+    bool isUnitScale = true;
+    if (pGzip)
+    {
+        const PhitsFitsHeader& header = pGzip->getHeader();
+        m_imageCards = header.getCards();
+        naxis = header.getNaxis();
+        xres = (int)header.getAxis(0);
+        yres = (int)header.getAxis(1);
+        planes = naxis > 2 ? (int)header.getAxis(2) : 1;
+        fmt = header.getBitpix();
+        m_imageScale = header.getDoubleValue("BSCALE", 1.);
+        m_imageZero = header.getDoubleValue("BZERO", 0.);
+        isScaled = m_imageZero != 0. || m_imageScale != 1.;
+    }
+    else if (m_pHduIndex && PhitsSettings().nativeRead)
+    {
+        // The index has the layout of every HDU, so the file is only opened through CCfits if no native reader
+        // takes the image.
+        if (!imageHdus.empty())
+        {
+            m_imageHduIndex = imageHdus[0];
+            if (m_pHduIndex->getHdu(m_imageHduIndex).type == PhitsHduIndex::Type::CompressedImage)
+            {
+                pTiled = PhitsTiledReader::create(fd, m_imageHduIndex);
+                if (!pTiled)
+                {
+                    setErrorString("the tile-compressed image in HDU " + to_string(m_imageHduIndex) + " is not supported");
+                    *m_result = errReportString;
+                    return;
+                }
+            }
+            m_imageHdus = imageHdus;
+            string hduList;
+            for (int i : imageHdus)
+            {
+                hduList += " " + to_string(i);
+            }
+            log("Reading image from HDU" + string(imageHdus.size() > 1 ? "s" : "") + hduList);
+        }
+        // Tile-compressed images (e.g. from fpack) live in a binary table extension following an empty primary HDU.
+        else if (m_pHduIndex->getHdu(0).axes.empty())
+        {
+            pTiled = PhitsTiledReader::create(fd);
+            if (pTiled)
+            {
+                m_imageHduIndex = pTiled->getHduIndex();
+                m_imageHdus = { m_imageHduIndex };
+                log("Found " + pTiled->getCompressionType() + " tile-compressed image in HDU " + to_string(m_imageHduIndex));
+            }
+        }
 
-    PHDU& pHDU = m_pFits->pHDU();
-    m_pPHDU = &pHDU;
-    m_pPHDU->readAllKeys();
+        PhitsFitsHeader header;
+        if (!m_pHduIndex->readHeader(fd, m_imageHduIndex, header))
+        {
+            setErrorString("could not read the header of HDU " + to_string(m_imageHduIndex));
+            *m_result = errReportString;
+            return;
+        }
+        m_imageCards = header.getCards();
+        if (pTiled)
+        {
+            naxis = pTiled->getNaxis();
+            xres = (int)pTiled->getWidth();
+            yres = (int)pTiled->getHeight();
+            planes = (int)pTiled->getPlanes();
+            fmt = pTiled->getBitpix();
+            m_imageScale = pTiled->getScale();
+            m_imageZero = pTiled->getZero();
+            isScaled = pTiled->isScaled();
+        }
+        else
+        {
+            naxis = header.getNaxis();
+            xres = (int)header.getAxis(0);
+            yres = (int)header.getAxis(1);
+            planes = naxis > 2 ? (int)header.getAxis(2) : 1;
+            fmt = header.getBitpix();
+            m_imageScale = header.getDoubleValue("BSCALE", 1.);
+            m_imageZero = header.getDoubleValue("BZERO", 0.);
+            isScaled = m_imageZero != 0. || m_imageScale != 1.;
+        }
 
-    if (pHDU.axes() != 2 && pHDU.axes() != 3)
+        // Each channel HDU becomes a plane; selectImageHdus() made sure they're alike, but each has its own scaling.
+        if (imageHdus.size() > 1)
+        {
+            naxis = 3;
+            planes = (int)imageHdus.size();
+            for (int i : imageHdus)
+            {
+                PhitsFitsHeader channel;
+                if (!m_pHduIndex->readHeader(fd, i, channel))
+                {
+                    setErrorString("could not read the header of HDU " + to_string(i));
+                    *m_result = errReportString;
+                    return;
+                }
+                const double scale = channel.getDoubleValue("BSCALE", 1.);
+                isScaled = isScaled || channel.getDoubleValue("BZERO", 0.) != 0. || scale != 1.;
+                isUnitScale = isUnitScale && scale == 1.;
+            }
+        }
+    }
+    else
+    {
+        if (!openFits(fd))
+        {
+            return;
+        }
+        PHDU& hdu = *m_pPHDU;
+        // The index lets us take the header cards straight from the file, rather than through cfitsio.
+        PhitsFitsHeader header;
+        m_imageCards = m_pHduIndex && m_pHduIndex->readHeader(fd, 0, header) ? header.getCards() : readCards(hdu);
+        naxis = hdu.axes();
+        if (naxis >= 2)
+        {
+            xres = hdu.axis(0);
+            yres = hdu.axis(1);
+            planes = naxis > 2 ? hdu.axis(2) : 1;
+        }
+        fmt = hdu.bitpix();
+        m_imageScale = hdu.scale();
+        m_imageZero = hdu.zero();
+        isScaled = m_imageZero != 0. || m_imageScale != 1.;
+    }
+    m_imageBitpix = fmt;
+    isUnitScale = isUnitScale && m_imageScale == 1.;
+
+    if (naxis != 2 && naxis != 3)
     {
         // FIXME: Should this happen in the filter phase instead?
         string errorStr;
-        if (pHDU.axes() == 0)
+        if (naxis == 0)
         {
             errorStr = "the FITS file does not contain a primary image";
         }
         else
         {
-            errorStr = "the primary FITS image has " + to_string(pHDU.axes()) + " axes, which is not supported";
+            errorStr = "the primary FITS image has " + to_string(naxis) + " axes, which is not supported";
         }
         setErrorString(errorStr);
         *m_result = errReportString;
@@ -209,13 +638,8 @@ void PhitsPlugin::readStart(void)
         return;
     }
 
-    const int xres = pHDU.axis(0);
-    const int yres = pHDU.axis(1);
-    const int planes = pHDU.axes() > 2 ? pHDU.axis(2) : 1;
-    const bool isScaled = pHDU.zero() != 0. || pHDU.scale() != 1.;
-
     string message("Resolution: ");
-    message += to_string(xres) + "x" + to_string(yres) + "x" + to_string(planes) + ", " + to_string(pHDU.axes()) + " axes";
+    message += to_string(xres) + "x" + to_string(yres) + "x" + to_string(planes) + ", " + to_string(naxis) + " axes";
     log(message);
 
     VPoint imageSize;
@@ -223,8 +647,6 @@ void PhitsPlugin::readStart(void)
     imageSize.v = yres;
     m_formatRecord->imageSize32 = imageSize;
 
-    const int fmt = pHDU.bitpix();
-
     int depth = 0;
     int inDepth = 0;
     switch (fmt)
@@ -235,7 +657,8 @@ void PhitsPlugin::readStart(void)
             break;
         case SHORT_IMG:
             inDepth = 16;
-            depth = 32;
+            // BZERO only offsets the stored values, so 16-bit mode can hold them all; BSCALE would need floats.
+            depth = PhitsSettings().native16 && isUnitScale ? 16 : 32;
             break;
         case FLOAT_IMG:
         case LONG_IMG:
@@ -285,54 +708,134 @@ void PhitsPlugin::readStart(void)
     m_formatRecord->loPlane = 0;
     m_formatRecord->hiPlane = planes - 1;
 
+    // Prefer decoding pixels straight from a mapping of the file, and fall back to cfitsio for anything
+    // the native readers don't handle (e.g. gzipped files).
+    if (pGzip)
+    {
+        pGzip->setDepth(depth);
+        m_pReader = move(pGzip);
+    }
+    else if (pTiled)
+    {
+        pTiled->setDepth(depth);
+        m_pReader = move(pTiled);
+    }
+    else if (!imageHdus.empty())
+    {
+        m_pReader = createExtensionReader(fd, imageHdus, depth);
+        if (!m_pReader)
+        {
+            setErrorString("the image in HDU " + to_string(imageHdus[0]) + " is not supported");
+            *m_result = errReportString;
+            m_pFits.reset();
+            return;
+        }
+    }
+    else if (PhitsSettings().nativeRead)
+    {
+        // The header is usually still cached from filterFile().
+        unique_ptr<PhitsMappedReader> pMapped = PhitsMappedReader::create(fd, depth, PhitsHeaderCache::get().getPrimaryHeader(fd));
+        if (pMapped)
+        {
+            const PhitsFitsHeader& header = pMapped->getHeader();
+            const int nativePlanes = header.getNaxis() > 2 ? (int)header.getAxis(2) : 1;
+            if (header.getAxis(0) == xres && header.getAxis(1) == yres && nativePlanes == planes && header.getBitpix() == fmt)
+            {
+                m_pReader = move(pMapped);
+            }
+            else
+            {
+                log("Native header disagrees with cfitsio; not using native reader.");
+            }
+        }
+    }
+    if (!m_pReader)
+    {
+        if (!m_pFits && !openFits(fd))
+        {
+            return;
+        }
+        m_pReader = make_unique<PhitsCCfitsReader>(*m_pPHDU, xres, yres, depth);
+    }
+    log("Using " + string(m_pReader->getName()) + " reader.");
+
     log("readStart end.");
 }
 
 void PhitsPlugin::readContinue(void)
 {
-    // FIXME: Use other read methods to read one line at at time?
     log("readContinue");
     const VPoint imageSize = m_formatRecord->imageSize32;
-    const uint32_t total = 2 * imageSize.v * m_formatRecord->planes;
+    const uint32_t planes = m_formatRecord->planes;
+    const bool isFloat = m_formatRecord->depth == 32;
+    const PhitsSettings settings;
+    const bool useHistogram = isFloat && PhitsStretch::needsHistogram(settings.normalization);
+    // The header may already tell us the range of a single HDU's data.
+    float headerMinVal = 0.f;
+    float headerMaxVal = 0.f;
+    const bool hasHeaderRange = isFloat && m_imageHdus.size() <= 1 && getHeaderDataRange(m_imageCards, settings, headerMinVal, headerMaxVal);
+    // Float data is read twice (three times, if we need its histogram): once to gather normalization
+    // statistics, and once to transfer the pixels. The range pass is skipped if the header gives the range.
+    const uint32_t passes = isFloat ? 1 + (hasHeaderRange ? 0 : 1) + (useHistogram ? 1 : 0) : 1;
+    const uint32_t total = passes * imageSize.v * planes;
     uint32_t done = 0;
 
-    uint32_t bufferSize = (imageSize.h * m_formatRecord->depth + 7) >> 3;
-
-    Ptr pixelData = sPSBuffer->New(&bufferSize, bufferSize);
-    if (pixelData == nullptr)
+    // Rows are transferred to the host a band at a time, using the same band size for reading the file.
+    // Unless disabled, each band carries all planes, stored one after another in the buffer. While the host
+    // takes one band, the next ones are read into the other buffers on a background thread.
+    // A sequential reader must be fed rows in file order, that is, a plane at a time.
+    const uint32_t passPlanes = settings.allPlanes && !m_pReader->isSequential() ? planes : 1;
+    const uint32_t rowBytes = (imageSize.h * m_formatRecord->depth + 7) >> 3;
+    const uint32_t bandRows = getBandRows(max(rowBytes, imageSize.h * (uint32_t)sizeof(float)) * passPlanes, settings.ioBuffers);
+    const uint32_t planeBytes = rowBytes * bandRows;
+
+    vector<Ptr> buffers;
+    for (uint32_t i = 0; i < settings.ioBuffers; ++i)
     {
-        log("Failed to allocate scanline buffer of " + to_string(bufferSize) + " bytes.");
-        *m_result = memFullErr;
-        return;
+        uint32_t bufferSize = planeBytes * passPlanes;
+        Ptr pixelData = sPSBuffer->New(&bufferSize, bufferSize);
+        if (pixelData == nullptr)
+        {
+            if (buffers.empty())
+            {
+                log("Failed to allocate band buffer of " + to_string(bufferSize) + " bytes.");
+                *m_result = memFullErr;
+                return;
+            }
+            // Make do with fewer buffers.
+            break;
+        }
+        buffers.push_back(pixelData);
     }
 
     m_formatRecord->colBytes = (m_formatRecord->depth + 7) >> 3;
-    m_formatRecord->rowBytes = bufferSize;
-    m_formatRecord->planeBytes = 0;
-    m_formatRecord->data = pixelData;
+    m_formatRecord->rowBytes = rowBytes;
+    m_formatRecord->planeBytes = planeBytes;
 
-    // FIXME: Currently, we leak the metadata. How can we tell when an image is closed, and the metadata can be freed?
-    PhitsMetadata* pMeta = new PhitsMetadata;
+    // Attached to the document once the image has been read; see addMetadata().
+    shared_ptr<PhitsMetadata> pMeta = make_shared<PhitsMetadata>();
 
     {
         Timer timeIt;
 
-        // Initialize our stashed metadata for this file
-        map<String, Keyword*> keywordMap = m_pPHDU->keyWord();
-        log("Read keyword map of size " + to_string(keywordMap.size()));
-
-        // Create new map with reallocated Keyword pointers. We do so because the original Keyword pointers will
-        // be freed when the PHDU is freed, and we still need to use the map after that point (i.e., when writing the file).
-        for (const auto& entry : keywordMap)
+        // Initialize our stashed metadata for this file. The header is kept as raw cards, in order; a compressed
+        // image's table keywords don't describe the image we'll write, so they're dropped.
+        pMeta->cards.reserve(m_imageCards.size());
+        for (string& card : m_imageCards)
         {
-            const Keyword* pKW = entry.second;
-            pMeta->keywordMap.insert({ entry.first, pKW->clone() });
+            if (m_imageHduIndex == 0 || !PhitsTiledReader::isCompressionKey(PhitsFitsHeader::getCardKey(card)))
+            {
+                pMeta->cards.push_back(move(card));
+            }
         }
+        m_imageCards.clear();
+        log("Read " + to_string(pMeta->cards.size()) + " header cards");
 
         // Store original bitpix, bscale, bzero.
-        pMeta->bitpix = m_pPHDU->bitpix();
-        pMeta->bscale = m_pPHDU->scale();
-        pMeta->bzero = m_pPHDU->zero();
+        pMeta->bitpix = m_imageBitpix;
+        pMeta->bscale = m_imageScale;
+        pMeta->bzero = m_imageZero;
+        pMeta->isGzipped = m_isGzipped;
 
         // FIXME: This relies on the low-level details of the FITS standard.
         pMeta->inputDepth = (uint32_t)abs((float)pMeta->bitpix);
@@ -343,39 +846,35 @@ void PhitsPlugin::readContinue(void)
 
         log("Zero, scale = " + to_string(pMeta->bzero) + " " + to_string(pMeta->bscale));
 
-        const int extensionCount = m_pFits->extensionCount();
-        log("FITS file has extension count of " + to_string(extensionCount));
-        for (int32_t i = 0; i < extensionCount; ++i)
+        // The extension names come from the HDU index, so that the extension headers needn't be read through
+        // CCfits. The extensions of a streamed file lie beyond the image, so we don't list them.
+        if (m_pHduIndex)
         {
-            const auto& ext = m_pFits->extension(i + 1);
-            pMeta->extensionNames.push_back(ext.name());
+            log("FITS file has extension count of " + to_string(m_pHduIndex->getHduCount() - 1));
+            for (size_t i = 1; i < m_pHduIndex->getHduCount(); ++i)
+            {
+                if (find(m_imageHdus.begin(), m_imageHdus.end(), (int)i) == m_imageHdus.end())
+                {
+                    pMeta->extensionNames.push_back(m_pHduIndex->getHdu(i).name);
+                }
+            }
         }
     }
 
-    // Stash the metadata so that we can read it on file write.
-    Handle h = sPSHandle->New(sizeof(PhitsMetadata));
-    Boolean oldLock = FALSE;
-    Ptr p = nullptr;
-    sPSHandle->SetLock(h, true, &p, &oldLock);
-    *(PhitsMetadata**)p = pMeta;
-    sPSHandle->SetLock(h, false, &p, &oldLock);
-    const OSErr tErr = m_formatRecord->resourceProcs->addProc(fitsResource, h);
-    if (tErr != noErr)
-    {
-        log("Error adding resource: " + to_string(tErr));
-    }
-    // FIXME?
-    //sPSHandle->Dispose(h);
+    // Read the image data one band of rows at a time, so that the memory we hold is bounded by the band
+    // size rather than by the image size.
+    log("Copying FITS image data, using " + to_string(rowBytes) + " bytes per row, " + to_string(planes) + " planes, " +
+        to_string(bandRows) + " rows per band, " + to_string(passPlanes) + " planes per band, " + to_string(buffers.size()) + " buffers.");
+    log("Depth is " + to_string(m_formatRecord->depth) + ", using " + getPhitsKernels().name + " kernels on " +
+        to_string(PhitsThreadPool::get().getThreadCount()) + " threads.");
 
-    // Read the image data
-    log("Copying FITS image data, using " + to_string(bufferSize) + " bytes per row, " + to_string(m_formatRecord->planes) + " planes.");
-    log("Depth is " + to_string(m_formatRecord->depth));
+    pMeta->isNormalized = false;
+    pMeta->stretch = PhitsStretch();
+    pMeta->isConverted = isFloat && pMeta->bitpix != FLOAT_IMG;
 
-    valarray<float> float_contents;
-    valarray<uint8_t> byte_contents;
+    vector<float> floatBand;
 
-    float normScale = 1.f;
-    float normOffset = 0.f;
+    const PhitsKernels& kernels = getPhitsKernels();
     float minFloatVal = std::numeric_limits<float>::max();
     float maxFloatVal = std::numeric_limits<float>::lowest();
 
@@ -383,43 +882,176 @@ void PhitsPlugin::readContinue(void)
 
     try
     {
-        Timer timeIt;
+        if (isFloat)
+        {
+            // Gather statistics for normalization. Only one band of pixels is held at a time.
+            Timer timeIt;
+            log("Reading float data.");
+            auto analyze = [&](const function<void(const float*, size_t)>& func)
+            {
+                for (uint32_t plane = 0; *m_result == noErr && plane < planes; ++plane)
+                {
+                    for (uint32_t row = 0; *m_result == noErr && row < imageSize.v; row += bandRows)
+                    {
+                        const uint32_t rows = min(bandRows, imageSize.v - row);
+                        const size_t count = (size_t)rows * imageSize.h;
+                        // Let the next band page in while we work on this one.
+                        if (row + rows < imageSize.v)
+                        {
+                            m_pReader->prefetchRows(plane, row + rows, min(bandRows, imageSize.v - row - rows));
+                        }
+                        else if (plane + 1 < planes)
+                        {
+                            m_pReader->prefetchRows(plane + 1, 0, min<uint32_t>(bandRows, imageSize.v));
+                        }
+                        floatBand.resize(count);
+                        m_pReader->readRows(plane, row, rows, &floatBand[0]);
+                        func(&floatBand[0], count);
+                        done += rows;
+                        m_formatRecord->progressProc(done, total);
+                        if (m_formatRecord->abortProc())
+                        {
+                            *m_result = userCanceledErr;
+                        }
+                    }
+                }
+            };
+            // Undefined pixels (NaN, infinities and BLANK, which the readers deliver as NaN) are left out.
+            if (hasHeaderRange)
+            {
+                log("Using data range from the header.");
+                minFloatVal = headerMinVal;
+                maxFloatVal = headerMaxVal;
+            }
+            else
+            {
+                analyze([&](const float* src, size_t count) { parallelMinMax(kernels, src, count, minFloatVal, maxFloatVal); });
+            }
+            if (minFloatVal > maxFloatVal)
+            {
+                log("No defined pixels.");
+                minFloatVal = maxFloatVal = 0.f;
+            }
+            log("Min float val: " + to_string(minFloatVal));
+            log("Max float val: " + to_string(maxFloatVal));
+
+            // The robust normalizations take their statistics from a histogram of the data, which costs a
+            // second pass over it.
+            unique_ptr<PhitsHistogram> pHistogram;
+            if (useHistogram && minFloatVal < maxFloatVal)
+            {
+                pHistogram = make_unique<PhitsHistogram>(minFloatVal, maxFloatVal);
+                analyze([&](const float* src, size_t count) { pHistogram->add(src, count); });
+            }
 
-        if (m_formatRecord->depth == 8)
+            // Unless asked for another normalization, only data values outside of [0,1] are normalized.
+            if (useHistogram || minFloatVal < 0.f || maxFloatVal > 1.f)
+            {
+                pMeta->isNormalized = true;
+                pMeta->stretch = PhitsStretch::create(settings.normalization, pHistogram.get(), minFloatVal, maxFloatVal, settings);
+                const PhitsStretch& stretch = pMeta->stretch;
+                log("Normalizing float data (" + settings.normalization + "), " + to_string(stretch.low) + " to " + to_string(stretch.high) +
+                    (stretch.isClipped ? ", clipped" : "") + ", " + PhitsStretch::getModeName(stretch.mode) + " curve " + to_string(stretch.param));
+            }
+            log("Analysis time: " + to_string(timeIt.GetElapsed()));
+        }
+
+        m_formatRecord->theRect32.left = 0;
+        m_formatRecord->theRect32.right = imageSize.h;
+
+        // Copy the values into place, performing any necessary normalization as we do so.
+        struct Band
+        {
+            uint32_t loPlane;
+            uint32_t row;
+            uint32_t rows;
+        };
+        vector<Band> bands;
+        for (uint32_t loPlane = 0; loPlane < planes; loPlane += passPlanes)
         {
-            log("Reading byte data.");
-            pMeta->isNormalized = false;
-            pMeta->isConverted = false;
-            m_pPHDU->read(byte_contents);
+            for (uint32_t row = 0; row < imageSize.v; row += bandRows)
+            {
+                bands.push_back({ loPlane, row, min(bandRows, imageSize.v - row) });
+            }
         }
-        else
+
+        // Read the slice of each plane that falls within a band directly into a host buffer, and normalize it
+        // in place. Float data always makes that pass, even if it isn't normalized, to give undefined pixels the
+        // blank value; the identity stretch leaves the others as they are.
+        PhitsImageReader* pReader = m_pReader.get();
+        const PhitsStretch stretch = pMeta->stretch;
+        const float blankValue = settings.blankValue;
+        auto readBand = [=, &kernels](const Band& band, Ptr pixelData)
         {
-            log("Reading float data.");
-            pMeta->isConverted = pMeta->bitpix != FLOAT_IMG;
-            // Read a scanline at a time to improve progress reporting.
-            // We have to allocate an extra scanline and copy the data into place thanks to PHDU::read() taking a valarray.
-            float_contents.resize(m_formatRecord->planes * imageSize.h * imageSize.v);
-            valarray<float> floatScanline(imageSize.h);
-            uint32_t fcIdx = 0;
-            for (uint32_t plane = 0; plane < m_formatRecord->planes; ++plane)
+            const size_t count = (size_t)band.rows * imageSize.h;
+            auto readPlane = [&](uint32_t plane)
+            {
+                void* dstPlane = pixelData + (plane - band.loPlane) * planeBytes;
+                pReader->readRows(plane, band.row, band.rows, dstPlane);
+                if (isFloat)
+                {
+                    float* fp = static_cast<float*>(dstPlane);
+                    stretch.apply(kernels, fp, fp, count, blankValue);
+                }
+            };
+            if (pReader->isPlaneParallel())
+            {
+                // One task per plane; each one's decoding is spread over the pool in turn.
+                PhitsThreadPool::get().parallelFor(passPlanes, 1, [&](size_t begin, size_t end)
+                {
+                    for (size_t plane = begin; plane < end; ++plane)
+                    {
+                        readPlane(band.loPlane + (uint32_t)plane);
+                    }
+                });
+            }
+            else
             {
-                for (uint32_t v = 0; v < imageSize.v; ++v, fcIdx += imageSize.h)
+                for (uint32_t plane = band.loPlane; plane < band.loPlane + passPlanes; ++plane)
                 {
-                    m_pPHDU->read(floatScanline, fcIdx + 1, imageSize.h);
-                    memcpy(&float_contents[fcIdx], &floatScanline[0], bufferSize);
-                    m_formatRecord->progressProc(++done, total);
-                    *m_result = m_formatRecord->advanceState();
+                    readPlane(plane);
                 }
             }
+        };
+
+        // Band k goes in buffer k % n. With n buffers, bands k + 1 ... k + n - 1 are read ahead while the host
+        // takes band k; a buffer is only refilled once the host is done with it.
+        Timer timeIt;
+        const size_t bufferCount = buffers.size();
+        PhitsWorkQueue queue(bufferCount - 1);
+        vector<uint64_t> tickets(bands.size());
+        for (size_t k = 0; k + 1 < bufferCount && k < bands.size(); ++k)
+        {
+            tickets[k] = queue.submit([&, k]() { readBand(bands[k], buffers[k % bufferCount]); });
+        }
+        for (size_t k = 0; *m_result == noErr && k < bands.size(); ++k)
+        {
+            // With a single buffer, this reads band k itself, synchronously.
+            const size_t next = k + bufferCount - 1;
+            if (next < bands.size())
+            {
+                tickets[next] = queue.submit([&, next]() { readBand(bands[next], buffers[next % bufferCount]); });
+            }
+            queue.waitFor(tickets[k]);
+
+            const Band& band = bands[k];
+            m_formatRecord->loPlane = band.loPlane;
+            m_formatRecord->hiPlane = band.loPlane + passPlanes - 1;
+            m_formatRecord->theRect32.top = band.row;
+            m_formatRecord->theRect32.bottom = band.row + band.rows;
+            m_formatRecord->data = buffers[k % bufferCount];
+            *m_result = m_formatRecord->advanceState();
+            done += band.rows * passPlanes;
+            m_formatRecord->progressProc(done, total);
         }
-        log("Pre-read time: " + to_string(timeIt.GetElapsed()));
+        // Don't leave reads running into buffers we're about to free.
+        queue.cancel();
+        log("Processing time: " + to_string(timeIt.GetElapsed()));
     }
     catch (const exception& e)
     {
         setErrorString("could not open FITS file : " + string(e.what()));
         *m_result = errReportString;
-        m_pFits.reset();
-        return;
     }
     catch (const FitsException& e)
     {
@@ -446,99 +1078,25 @@ void PhitsPlugin::readContinue(void)
             log("---");
         }
         *m_result = errReportString;
-        m_pFits.reset();
-        return;
     }
 
-    if (m_formatRecord->depth == 32)
+    if (*m_result == noErr)
     {
-        Timer timeIt;
-        uint32_t idx = 0;
-        // Find min/max for normalization
-        for (uint32_t plane = 0; plane < m_formatRecord->planes; ++plane)
-        {
-            for (uint32_t row = 0; row < imageSize.v; ++row)
-            {
-                for (uint32_t col = 0; col < imageSize.h; ++col, ++idx)
-                {
-                    minFloatVal = min(minFloatVal, float_contents[idx]);
-                    maxFloatVal = max(maxFloatVal, float_contents[idx]);
-                }
-            }
-        }
-        log("Min float val: " + to_string(minFloatVal));
-        log("Max float val: " + to_string(maxFloatVal));
-
-        // If the data values fall outside of [0,1], normalize them.
-        if (minFloatVal < 0.f || maxFloatVal > 1.f)
-        {
-            pMeta->isNormalized = true;
-            normOffset = -minFloatVal;
-            normScale = (maxFloatVal - minFloatVal);
-            log("Normalizing float data, offset: " + to_string(normOffset) + ", divisor: " + to_string(normScale));
-            normScale = 1.f / normScale;
-        }
-        log("Analysis time: " + to_string(timeIt.GetElapsed()));
+        log("Done copying FITS image data.");
+        // Stash the metadata so that we can read it on file write.
+        addMetadata(pMeta);
     }
-
-    uint32_t scanlineSize = imageSize.h * m_formatRecord->depth / 8;
-    void* sourceData = (m_formatRecord->depth == 8 ? static_cast<void*>(&byte_contents[0]) : static_cast<void*>(&float_contents[0]));
-    std::vector<float> floatScanline(imageSize.h);
-
-    m_formatRecord->theRect32.left = 0;
-    m_formatRecord->theRect32.right = imageSize.h;
-
-    // Copy the values into place, performing any necessary normalization as we do so.
+    else
     {
-        Timer timeIt;
-        for (uint32_t plane = 0; plane < m_formatRecord->planes; ++plane)
-        {
-            if (*m_result != noErr) break;
-            m_formatRecord->loPlane = m_formatRecord->hiPlane = plane;
-
-            for (uint32_t row = 0; *m_result == noErr && row < imageSize.v; ++row)
-            {
-                m_formatRecord->theRect32.top = row;
-                m_formatRecord->theRect32.bottom = row + 1;
-
-                switch (m_formatRecord->depth)
-                {
-                case 8:
-                    memcpy(pixelData, sourceData, bufferSize);
-                    break;
-                case 32:
-                    if (pMeta->isNormalized)
-                    {
-                        float* fp = static_cast<float*>(sourceData);
-                        for (uint32_t i = 0; i < imageSize.h; ++i)
-                        {
-                            floatScanline[i] = (normOffset + fp[i]) * normScale;
-                        }
-                        memcpy(pixelData, &floatScanline[0], bufferSize);
-                    }
-                    else
-                    {
-                        memcpy(pixelData, sourceData, bufferSize);
-                    }
-                    break;
-                default:
-                    assert(false);
-                    break;
-                }
-
-                *m_result = m_formatRecord->advanceState();
-                if (*m_result != noErr) break;
-                m_formatRecord->progressProc(++done, total);
-                sourceData = ((uint8_t*)sourceData) + scanlineSize;
-            }
-        }
-        log("Processing time: " + to_string(timeIt.GetElapsed()));
+        m_pReader.reset();
+        m_pFits.reset();
     }
 
-    log("Done copying FITS image data.");
-
     m_formatRecord->data = nullptr;
-    sPSBuffer->Dispose(&pixelData);
+    for (Ptr pixelData : buffers)
+    {
+        sPSBuffer->Dispose(&pixelData);
+    }
 }
 
 void PhitsPlugin::readFinish(void)
@@ -560,23 +1118,99 @@ void PhitsPlugin::optionsPrepare(void)
     }
 }
 
+// Attach metadata to the document being read, as an image resource. The resource holds a serialized copy,
+// which the host disposes of with the document; PhitsMetadataStore keeps the parsed metadata for a while.
+void PhitsPlugin::addMetadata(shared_ptr<const PhitsMetadata> pMeta)
+{
+    const vector<uint8_t> data = PhitsMetadataStore::get().add(move(pMeta));
+    Handle h = sPSHandle->New((int32)data.size());
+    if (h == nullptr)
+    {
+        log("Failed to allocate metadata resource of " + to_string(data.size()) + " bytes.");
+        return;
+    }
+    Boolean oldLock = FALSE;
+    Ptr p = nullptr;
+    sPSHandle->SetLock(h, true, &p, &oldLock);
+    memcpy(p, data.data(), data.size());
+    sPSHandle->SetLock(h, false, &p, &oldLock);
+    const OSErr tErr = m_formatRecord->resourceProcs->addProc(fitsResource, h);
+    if (tErr != noErr)
+    {
+        log("Error adding resource: " + to_string(tErr));
+    }
+    // The host copies the resource data, so the handle is ours to free; kept, it would leak a copy of the
+    // metadata for every document opened.
+    const int32 handleBytes = sPSHandle->GetSize(h);
+    sPSHandle->Dispose(h);
+    log("Metadata store holds " + to_string(PhitsMetadataStore::get().getLiveBytes()) + " bytes for " +
+        to_string(PhitsMetadataStore::get().getCount()) + " documents; disposed of a " + to_string(handleBytes) +
+        "-byte resource handle.");
+}
+
+// Metadata attached to the document by addMetadata(), or nullptr if it wasn't read by us.
+shared_ptr<const PhitsMetadata> PhitsPlugin::getMetadata()
+{
+    if (m_formatRecord->resourceProcs->countProc(fitsResource) == 0)
+    {
+        return nullptr;
+    }
+    Handle h = m_formatRecord->resourceProcs->getProc(fitsResource, 1);
+    const int32 size = sPSHandle->GetSize(h);
+    Ptr p = nullptr;
+    sPSHandle->SetLock(h, true, &p, nullptr);
+    shared_ptr<const PhitsMetadata> pMeta = p != nullptr ? PhitsMetadataStore::get().find(reinterpret_cast<const uint8_t*>(p), size) : nullptr;
+    sPSHandle->SetLock(h, false, &p, nullptr);
+    if (!pMeta)
+    {
+        log("Document resource doesn't hold metadata we recognize.");
+    }
+    return pMeta;
+}
+
+// The integer format to save a document of the given depth in, if it's to be stored as it was read rather
+// than in the default format for its depth.
+static bool getRestoredFormat(const PhitsMetadata& meta, int depth, const PhitsSettings& settings, PhitsIntegerFormat& format)
+{
+    format.bitpix = meta.bitpix;
+    format.bzero = meta.bzero;
+    format.bscale = meta.bscale;
+    // A document opened in 16-bit mode holds the stored values, whatever BZERO was; it always needs its BZERO
+    // back, however it's saved, or signed data would come back offset by 32768.
+    if (depth == 16)
+    {
+        return !meta.isConverted && meta.bitpix == SHORT_IMG;
+    }
+    if (!settings.restoreBitpix || !settings.compression.empty())
+    {
+        return false;
+    }
+    if (depth == 32 && meta.isConverted && (meta.bitpix == BYTE_IMG || meta.bitpix == SHORT_IMG || meta.bitpix == LONG_IMG))
+    {
+        // Undo the normalization: the curve, if any, and then the linear mapping.
+        const PhitsStretch stretch = meta.stretch;
+        format.zeroValue = stretch.low;
+        format.oneValue = stretch.high;
+        if (stretch.mode != PhitsStretch::Mode::Linear)
+        {
+            format.transform = [stretch](const float* src, float* dst, size_t count) { stretch.uncurve(src, dst, count); };
+        }
+        return true;
+    }
+    return false;
+}
+
 void PhitsPlugin::optionsStart(void)
 {
     log("optionsStart");
     m_formatRecord->data = nullptr;
 
-    const uint32_t cnt = m_formatRecord->resourceProcs->countProc(fitsResource);
-    PhitsMetadata* pMeta = nullptr;
-    if (cnt == 0)
+    const shared_ptr<const PhitsMetadata> pMeta = getMetadata();
+    if (!pMeta)
     {
         log("No metadata for FITS file found in DoOptionsStart.");
         return;
     }
-    Handle h = m_formatRecord->resourceProcs->getProc(fitsResource, 1);
-    Ptr p;
-    sPSHandle->SetLock(h, true, &p, nullptr);
-    pMeta = *(PhitsMetadata**)p;
-    sPSHandle->SetLock(h, false, &p, nullptr);
 
     if (pMeta->extensionNames.size() == 0 && !pMeta->isNormalized && !pMeta->isConverted)
     {
@@ -589,7 +1223,15 @@ void PhitsPlugin::optionsStart(void)
         std::string formatStr = (pMeta->bitpix < 0 ? "floating-point" : "integer");
         warnString += "The " + to_string(pMeta->inputDepth) + "-bit " + formatStr;
         warnString += " data from the original FITS file has been converted to 32-bit floating-point";
-        warnString += " data in the [0,1] range, and will be saved as a FITS FLOAT_IMG.\n\r";
+        PhitsIntegerFormat format;
+        if (getRestoredFormat(*pMeta, m_formatRecord->depth, PhitsSettings(), format))
+        {
+            warnString += " data in the [0,1] range, and will be saved as a FITS " + getFormatName(pMeta->bitpix) + ", as it was read.\n\r";
+        }
+        else
+        {
+            warnString += " data in the [0,1] range, and will be saved as a FITS FLOAT_IMG.\n\r";
+        }
     }
     else if (pMeta->isNormalized)
     {
@@ -671,6 +1313,7 @@ void PhitsPlugin::estimateFinish(void)
 
 void PhitsPlugin::writePrepare(void)
 {
+    m_hostMaxData = m_formatRecord->maxData;
     m_formatRecord->maxData = 0;
 
 #if __PIMac__
@@ -687,44 +1330,16 @@ void PhitsPlugin::writeStart(void)
 
     VPoint imageSize = m_formatRecord->imageSize32;
 
-    int naxis = 3;
-    long naxes[3] = { imageSize.h, imageSize.v, m_formatRecord->planes };
-
-    valarray<unsigned char> char_data;
-    valarray<unsigned short> short_data;
-    valarray<float> float_data;
-
-    unsigned char* fitsData = nullptr;
-    int dataSize = 0;
-    int fitsFormat = 0;
-    switch (m_formatRecord->depth)
+    const int depth = m_formatRecord->depth;
+    if (depth != 8 && depth != 16 && depth != 32)
     {
-        case 8:
-            fitsFormat = BYTE_IMG;
-            char_data.resize(imageSize.h);
-            fitsData = reinterpret_cast<unsigned char *>(&char_data[0]);
-            dataSize = 1;
-            break;
-        case 16:
-            fitsFormat = USHORT_IMG;
-            short_data.resize(imageSize.h);
-            fitsData = reinterpret_cast<unsigned char *>(&short_data[0]);
-            dataSize = 2;
-            break;
-        case 32:
-            fitsFormat = FLOAT_IMG;
-            float_data.resize(imageSize.h);
-            fitsData = reinterpret_cast<unsigned char *>(&float_data[0]);
-            dataSize = 4;
-            break;
-        default:
-            // FIXME error
-            log("Unsupported depth " + to_string(m_formatRecord->depth));
-            *m_result = writErr;
-            return;
+        // FIXME error
+        log("Unsupported depth " + to_string(depth));
+        *m_result = writErr;
+        return;
     }
 
-    log("Write start, " + to_string(imageSize.h) + "x" + to_string(imageSize.v) + "x" + to_string(m_formatRecord->planes) + ", " + to_string(dataSize*8) + " bits per plane.");
+    log("Write start, " + to_string(imageSize.h) + "x" + to_string(imageSize.v) + "x" + to_string(m_formatRecord->planes) + ", " + to_string(depth) + " bits per plane.");
 
 #ifdef _WIN32
     const int fd = _open_osfhandle(m_formatRecord->dataFork, 0);
@@ -743,141 +1358,181 @@ void PhitsPlugin::writeStart(void)
         return;
     }
 #endif
-    log("Creating FITS object.");
-    // FIXME: Extract actual filename from metadata for improved error reporting?
-    string name("PhotoshopFile");
-    unique_ptr<FITS> pFitsFile;
-    try
+    // Read our stashed metadata, if any, so that we can copy any keyword to the output file.
+    const shared_ptr<const PhitsMetadata> pMeta = getMetadata();
+    if (!pMeta)
     {
-        pFitsFile = make_unique<FITS>(name, fitsFormat, naxis, naxes, fd);
+        log("No metadata for previous FITS read found.");
     }
-    catch (const FitsException& e)
+
+    // The image is written natively, rather than through CCfits: host bands are encoded to big-endian FITS
+    // (or compressed, a tile per row) in bulk, and each plane's slice of a band goes out in a single write.
+    // A plain image is gzipped if the file it came from was, unless the settings say otherwise.
+    const PhitsSettings settings;
+    const bool isGzipped = settings.gzip >= 0 ? settings.gzip != 0 : pMeta != nullptr && pMeta->isGzipped;
+    unique_ptr<PhitsImageWriter> pWriter;
+    if (settings.compression.empty())
     {
-        string msg("Failed to create FITS object: ");
-        log(msg + ": " + e.message());
-        *m_result = writErr;
-        return;
+        unique_ptr<PhitsFitsWriter> pFitsWriter;
+        if (isGzipped)
+        {
+            log("Writing gzipped image.");
+            pFitsWriter = make_unique<PhitsGzipWriter>(fd, imageSize.h, imageSize.v, m_formatRecord->planes, depth);
+        }
+        else
+        {
+            pFitsWriter = make_unique<PhitsFitsWriter>(fd, imageSize.h, imageSize.v, m_formatRecord->planes, depth);
+        }
+        // An image converted to floats when read goes back to the integer type it was stored as.
+        PhitsIntegerFormat format;
+        if (pMeta != nullptr && getRestoredFormat(*pMeta, depth, settings, format))
+        {
+            log("Restoring " + getFormatName(format.bitpix) + ", zero " + to_string(format.bzero) + ", scale " + to_string(format.bscale) +
+                ", data values " + to_string(format.zeroValue) + " to " + to_string(format.oneValue) + ".");
+            pFitsWriter->setIntegerFormat(format);
+        }
+        pFitsWriter->setDataRangeCards(settings.dataRange != "none");
+        pWriter = move(pFitsWriter);
     }
-    catch (const exception& e)
+    else
     {
-        string msg("Failed to create FITS object: ");
-        log((msg + ": " + e.what()).c_str());
-        *m_result = writErr;
-        return;
+        log("Writing " + settings.compression + " tile-compressed image, quantize level " + to_string(settings.quantizeLevel) + ".");
+        unique_ptr<PhitsTiledWriter> pTiledWriter = make_unique<PhitsTiledWriter>(fd, imageSize.h, imageSize.v, m_formatRecord->planes, depth,
+                                                                                  settings.compression, settings.quantizeLevel);
+        // Only a document opened in 16-bit mode has a format to restore when compressing: its BZERO.
+        PhitsIntegerFormat format;
+        if (pMeta != nullptr && getRestoredFormat(*pMeta, depth, settings, format))
+        {
+            log("Restoring zero " + to_string(format.bzero) + ".");
+            pTiledWriter->setZero(format.bzero);
+        }
+        pWriter = move(pTiledWriter);
     }
-    catch (...)
+    PhitsImageWriter& writer = *pWriter;
+
+    if (pMeta != nullptr)
     {
-        log("Failed to create FITS object.");
-        *m_result = writErr;
-        return;
+        // Copy the original header cards, in their original order, to the output file.
+        writer.addCards(pMeta->cards);
     }
 
-    log("Created FITS object.");
-    PHDU& pHDU = pFitsFile->pHDU();
-
-    // Read our stashed metadata, if any, so that we can copy any keyword to the output file.
-    const uint32_t cnt = m_formatRecord->resourceProcs->countProc(fitsResource);
-    PhitsMetadata* pMeta = nullptr;
-    if (cnt > 0)
+    try
     {
-        Handle h = m_formatRecord->resourceProcs->getProc(fitsResource, 1);
-        Ptr p;
-        sPSHandle->SetLock(h, true, &p, nullptr);
-        pMeta = *(PhitsMetadata**)p;
-        sPSHandle->SetLock(h, false, &p, nullptr);
+        writer.writeHeader();
     }
-    else
+    catch (const exception& e)
     {
-        log("No metadata for previous FITS read found.");
+        log(string("Failed to write FITS header: ") + e.what());
+        *m_result = writErr;
+        return;
     }
 
-    if (pMeta != nullptr)
+    // Allocate band buffers. Unless disabled, each band carries all planes, stored one after another. While
+    // the host fills one buffer, the bands in the others are encoded and written on a background thread.
+    // A sequential writer must be given rows in file order, that is, a plane at a time.
+    const int passPlanes = settings.allPlanes && !writer.isSequential() ? m_formatRecord->planes : 1;
+    const uint32_t rowBytes = (imageSize.h * m_formatRecord->depth + 7) >> 3;
+    const uint32_t bandRows = getBandRows(rowBytes * passPlanes, settings.ioBuffers);
+    const uint32_t planeBytes = rowBytes * bandRows;
+    vector<Ptr> buffers;
+    for (uint32_t i = 0; i < settings.ioBuffers; ++i)
     {
-        // Add all of the keywords to the output file.
-        // FIXME: Preserve order in original file, rather than map order (alphabetical)
-        for (const auto& entry : pMeta->keywordMap)
+        uint32_t bufferSize = planeBytes * passPlanes;
+        Ptr pixelData = sPSBuffer->New(&bufferSize, bufferSize);
+        if (pixelData == nullptr)
         {
-            const Keyword* pKW = entry.second;
-            string valString;
-            if (pKW->keytype() == Tlogical)
-            {
-                // Workaround for CCfits bug
-                bool boolVal;
-                pKW->value(boolVal);
-                valString = boolVal ? "T" : "F";
-            }
-            else
-            {
-                pKW->value(valString);
-            }
-            pHDU.addKey(pKW->name(), valString.c_str(), pKW->comment());
+            // Make do with fewer buffers, if we have at least one.
+            break;
         }
+        buffers.push_back(pixelData);
     }
-
-    // Allocate scanline buffer
-    uint32_t bufferSize = (imageSize.h * m_formatRecord->depth + 7) >> 3;
-    Ptr pixelData = sPSBuffer->New(&bufferSize, bufferSize);
-    if (pixelData == nullptr)
+    if (buffers.empty())
     {
         *m_result = memFullErr;
         return;
     }
 
     m_formatRecord->colBytes = (m_formatRecord->depth + 7) >> 3;
-    m_formatRecord->rowBytes = bufferSize;
-    m_formatRecord->planeBytes = 0;
-    m_formatRecord->data = pixelData;
+    m_formatRecord->rowBytes = rowBytes;
+    m_formatRecord->planeBytes = planeBytes;
     m_formatRecord->transparencyMatting = 0;
 
-    log("Writing FITS data.");
-    const int total = imageSize.h * imageSize.v;
-    int curStart = 1;
+    log("Writing FITS data, " + to_string(bandRows) + " rows per band, " + to_string(passPlanes) + " planes per band, " + to_string(buffers.size()) + " buffers.");
+    const int total = imageSize.v * m_formatRecord->planes;
     int done = 0;
 
     m_formatRecord->theRect32.left = 0;
     m_formatRecord->theRect32.right = imageSize.h;
 
-    for (int plane = 0; *m_result == noErr && plane < m_formatRecord->planes; ++plane)
+    // With n buffers, up to n - 1 bands may be waiting to be written while the host fills the next one.
+    PhitsWorkQueue queue(buffers.size() - 1);
+    size_t band = 0;
+    for (int loPlane = 0; *m_result == noErr && loPlane < m_formatRecord->planes; loPlane += passPlanes)
     {
-        m_formatRecord->loPlane = m_formatRecord->hiPlane = plane;
-        for (int row = 0; *m_result == noErr && row < imageSize.v; ++row)
+        m_formatRecord->loPlane = loPlane;
+        m_formatRecord->hiPlane = loPlane + passPlanes - 1;
+        for (int row = 0; *m_result == noErr && row < imageSize.v; row += bandRows)
         {
+            const int rows = min<int>(bandRows, imageSize.v - row);
+            Ptr pixelData = buffers[band++ % buffers.size()];
             m_formatRecord->theRect32.top = row;
-            m_formatRecord->theRect32.bottom = row + 1;
+            m_formatRecord->theRect32.bottom = row + rows;
+            m_formatRecord->data = pixelData;
 
             if (*m_result == noErr)
             {
                 *m_result = m_formatRecord->advanceState();
             }
 
+            // Write the slice of each plane that falls within this band.
             if (*m_result == noErr)
             {
-                memcpy(fitsData, pixelData, bufferSize);
-                switch (m_formatRecord->depth)
+                try
                 {
-                    case 8:
-                        pHDU.write(curStart, imageSize.h, char_data);
-                        break;
-                    case 16:
-                        pHDU.write(curStart, imageSize.h, short_data);
-                        break;
-                    case 32:
-                        pHDU.write(curStart, imageSize.h, float_data);
-                        break;
-                    default:
-                        assert(false);
-                        break;
+                    queue.submit([&writer, pixelData, planeBytes, loPlane, passPlanes, row, rows]()
+                    {
+                        for (int plane = loPlane; plane < loPlane + passPlanes; ++plane)
+                        {
+                            writer.writeRows(plane, row, rows, pixelData + (plane - loPlane) * planeBytes);
+                        }
+                    });
+                }
+                catch (const exception& e)
+                {
+                    log(string("Failed to write FITS data: ") + e.what());
+                    *m_result = writErr;
                 }
             }
-            curStart += imageSize.h;
-            m_formatRecord->progressProc (++done, total);
+            done += rows * passPlanes;
+            m_formatRecord->progressProc(done, total);
+        }
+    }
+    if (*m_result == noErr)
+    {
+        try
+        {
+            queue.wait();
+            writer.finish();
+        }
+        catch (const exception& e)
+        {
+            log(string("Failed to write FITS data: ") + e.what());
+            *m_result = writErr;
         }
     }
+    else
+    {
+        // Cancelled, or failed; don't bother writing what's left.
+        queue.cancel();
+    }
     log("Done writing FITS data.");
 
     m_formatRecord->data = nullptr;
 
-    sPSBuffer->Dispose(&pixelData);
+    for (Ptr pixelData : buffers)
+    {
+        sPSBuffer->Dispose(&pixelData);
+    }
 }
 
 void PhitsPlugin::writeContinue(void)
@@ -903,58 +1558,108 @@ void PhitsPlugin::filterFile(void)
     if (fd < 0)
     {
         *m_result = formatCannotRead;
+        return;
     }
 #else
     const int fd = m_formatRecord->posixFileDescriptor;
 #endif
-    // FIXME: Extract filename from metadata for better error reporting?
-    string name("PhotoshopFile");
-    vector<string> keys;
-    unique_ptr<FITS> pFitsFile;
-    try
+    int naxis = 0;
+    int planes = 1;
+    int bitpix = 0;
+    Timer timeIt;
+    if (PhitsSettings().nativeRead)
     {
-        pFitsFile = make_unique<FITS>(name, RWmode::Read, false, keys, fd);
-    }
-    catch (const FitsException& e)
-    {
-        string msg("Failed to create FITS object: ");
-        log(msg + ": " + e.message());
-        *m_result = formatCannotRead;
-        return;
-    }
-    catch (const exception& e)
-    {
-        string msg("Failed to create FITS object: ");
-        log((msg + ": " + e.what()).c_str());
-        *m_result = formatCannotRead;
-        return;
+        // The mandatory cards come first, so a few header blocks are all we need; the rest of the header,
+        // and the data unit, are left alone. If the whole header fits, it's cached for readStart(). A gzipped
+        // file is inflated just far enough to parse those blocks.
+        shared_ptr<const PhitsFitsHeader> pHeader;
+        if (PhitsGzipReader::isGzipped(fd))
+        {
+            auto pGzipHeader = make_shared<PhitsFitsHeader>();
+            if (PhitsGzipReader::readHeader(fd, kSniffBytes, *pGzipHeader) != PhitsFitsHeader::Status::Invalid)
+            {
+                pHeader = pGzipHeader;
+            }
+        }
+        else
+        {
+            pHeader = PhitsHeaderCache::get().getPrimaryHeader(fd, kSniffBytes);
+        }
+        if (!pHeader || pHeader->getBitpix() == 0)
+        {
+            log("File does not have a valid FITS primary header.");
+            *m_result = formatCannotRead;
+            return;
+        }
+        naxis = pHeader->getNaxis();
+        planes = naxis > 2 ? (int)pHeader->getAxis(2) : 1;
+        bitpix = pHeader->getBitpix();
+
+        // An empty primary HDU may be followed by image extensions, tile-compressed or not. Finding them means
+        // walking the extension headers, but not reading any data.
+        const shared_ptr<const PhitsHduIndex> pIndex = naxis == 0 ? PhitsHeaderCache::get().getHduIndex(fd) : nullptr;
+        const int hduIndex = pIndex ? findImageExtension(*pIndex) : -1;
+        if (hduIndex > 0)
+        {
+            const PhitsHduIndex::Hdu& hdu = pIndex->getHdu(hduIndex);
+            naxis = (int)hdu.axes.size();
+            planes = naxis > 2 ? (int)hdu.axes[2] : 1;
+            bitpix = hdu.bitpix;
+        }
     }
-    catch (...)
+    else
     {
-        string msg("Failed to create FITS object.");
-        *m_result = formatCannotRead;
-        return;
+        // FIXME: Extract filename from metadata for better error reporting?
+        string name("PhotoshopFile");
+        vector<string> keys;
+        unique_ptr<FITS> pFitsFile;
+        try
+        {
+            // Only the primary HDU, which is all we check.
+            pFitsFile = make_unique<FITS>(name, RWmode::Read, vector<string>(), false, keys, keys, vector<int>(), fd);
+        }
+        catch (const FitsException& e)
+        {
+            string msg("Failed to create FITS object: ");
+            log(msg + ": " + e.message());
+            *m_result = formatCannotRead;
+            return;
+        }
+        catch (const exception& e)
+        {
+            string msg("Failed to create FITS object: ");
+            log((msg + ": " + e.what()).c_str());
+            *m_result = formatCannotRead;
+            return;
+        }
+        catch (...)
+        {
+            string msg("Failed to create FITS object.");
+            *m_result = formatCannotRead;
+            return;
+        }
+
+        PHDU& pHDU = pFitsFile->pHDU();
+        naxis = pHDU.axes();
+        planes = naxis > 2 ? pHDU.axis(2) : 1;
+        bitpix = pHDU.bitpix();
     }
+    log("Header check time: " + to_string(timeIt.GetElapsed()));
 
     // FIXME: Failing the following checks doesn't prevent photoshop from
     // trying to subsequently try to read the file...?
-    PHDU& pHDU = pFitsFile->pHDU();
-    pHDU.readAllKeys();
-
-    if (pHDU.axes() != 2 && pHDU.axes() != 3)
+    if (naxis != 2 && naxis != 3)
     {
-        log("FITS file has unsupported axis count of " + to_string(pHDU.axes()));
+        log("FITS file has unsupported axis count of " + to_string(naxis));
         *m_result = formatCannotRead;
         return;
     }
-    const int planes = pHDU.axes() > 2 ? pHDU.axis(2) : 1;
     if (planes == 2)
     {
         log("FITS image has 2 planes, which is not supported.");
         *m_result = formatCannotRead;
         return;
     }
-    const int bitpix = pHDU.bitpix();
     if (bitpix != BYTE_IMG && bitpix != SHORT_IMG && bitpix != FLOAT_IMG)
     {
         log("FITS image is of unsupported type " + to_string(bitpix));
@@ -1104,6 +1809,7 @@ DLLExport MACPASCAL void PluginMain(const int16 selector, FormatRecordPtr format
         log("Elapsed time: " + to_string(timeIt.GetElapsed()));
 
         // If we are done with a given phase, or we encountered an error, delete temporary data.
+        // The worker pool is not part of this; it persists across phases.
         if (selector == formatSelectorAbout ||
             selector == formatSelectorWriteFinish ||
             selector == formatSelectorReadFinish ||
@@ -75,9 +75,9 @@ resource 'PiPL' (ResourceID, plugInName " PiPL", purgeable)
         FmtFileType { 'FITS', '8BIM' },
         //ReadTypes { { '8B1F', '    ' } },
         FilteredTypes { { '8B1F', '    ' } },
-        ReadExtensions { { 'FITS', 'FIT ' } },
+        ReadExtensions { { 'FITS', 'FIT ', 'GZ  ' } },
         WriteExtensions { { 'FITS', 'FIT ' } },
-        FilteredExtensions { { 'FITS', 'FIT ' } },
+        FilteredExtensions { { 'FITS', 'FIT ', 'GZ  ' } },
         FormatFlags { fmtSavesImageResources,
                       fmtCanRead,
                       fmtCanWrite,
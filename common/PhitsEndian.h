@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSENDIAN_H_
+#define _PHITSENDIAN_H_
+
+#include <stdint.h>
+
+// Unaligned big-endian loads and stores, as used throughout FITS files. Compilers turn these into a load
+// or store and a byte swap.
+
+static inline uint16_t loadBE16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t loadBE32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t loadBE64(const uint8_t* p)
+{
+    return ((uint64_t)loadBE32(p) << 32) | loadBE32(p + 4);
+}
+
+static inline void storeBE16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void storeBE32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline void storeBE64(uint8_t* p, uint64_t v)
+{
+    storeBE32(p, (uint32_t)(v >> 32));
+    storeBE32(p + 4, (uint32_t)v);
+}
+
+#endif // _PHITSENDIAN_H_
@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsFitsHeader.h"
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+size_t PhitsFitsHeader::readAt(int fd, uint64_t offset, uint8_t* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = (DWORD)(offset + done);
+        overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD got = 0;
+        if (!ReadFile(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), data + done, (DWORD)(size - done), &got, &overlapped) || got == 0)
+        {
+            break;
+        }
+#else
+        const ssize_t got = pread(fd, data + done, size - done, (off_t)(offset + done));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+#endif
+        done += (size_t)got;
+    }
+    return done;
+}
+
+static string trimRight(const string& str)
+{
+    const size_t end = str.find_last_not_of(' ');
+    return end == string::npos ? string() : str.substr(0, end + 1);
+}
+
+static string trim(const string& str)
+{
+    const size_t begin = str.find_first_not_of(' ');
+    return begin == string::npos ? string() : trimRight(str.substr(begin));
+}
+
+string PhitsFitsHeader::getCardKey(const string& card)
+{
+    return trimRight(card.substr(0, min<size_t>(8, card.size())));
+}
+
+bool PhitsFitsHeader::splitCard(const string& card, string& key, string& value, string& comment)
+{
+    key = getCardKey(card);
+    value.clear();
+    comment.clear();
+    if (card.size() < 10 || card[8] != '=' || card[9] != ' ')
+    {
+        return false;
+    }
+
+    size_t pos = card.find_first_not_of(' ', 10);
+    if (pos == string::npos)
+    {
+        return true;
+    }
+    if (card[pos] == '\'')
+    {
+        // Quoted string; a doubled quote is an escaped quote.
+        size_t end = pos + 1;
+        while (end < card.size())
+        {
+            if (card[end] == '\'')
+            {
+                if (end + 1 < card.size() && card[end + 1] == '\'')
+                {
+                    end += 2;
+                    continue;
+                }
+                break;
+            }
+            ++end;
+        }
+        value = card.substr(pos, min(end + 1, card.size()) - pos);
+        pos = card.find('/', end);
+    }
+    else
+    {
+        const size_t slash = card.find('/', pos);
+        value = trim(card.substr(pos, slash == string::npos ? string::npos : slash - pos));
+        pos = slash;
+    }
+    if (pos != string::npos)
+    {
+        comment = trim(card.substr(pos + 1));
+    }
+    return true;
+}
+
+string PhitsFitsHeader::makeCard(const string& key, const string& value, const string& comment, bool isString)
+{
+    string card = key.substr(0, 8);
+    card.resize(8, ' ');
+    card += "= ";
+    if (isString)
+    {
+        string quoted = "'";
+        for (char c : value)
+        {
+            quoted += c;
+            if (c == '\'')
+            {
+                quoted += c;
+            }
+        }
+        // Strings shorter than eight characters are padded, per the standard.
+        if (quoted.size() < 9)
+        {
+            quoted.resize(9, ' ');
+        }
+        if (quoted.size() > kCardSize - 11)
+        {
+            // Truncate, without splitting an escaped quote.
+            quoted.resize(kCardSize - 11);
+            size_t quotes = 0;
+            for (size_t i = quoted.size() - 1; i > 0 && quoted[i] == '\''; --i)
+            {
+                ++quotes;
+            }
+            if (quotes % 2 != 0)
+            {
+                quoted.pop_back();
+            }
+        }
+        card += quoted + "'";
+    }
+    else
+    {
+        card += string(value.size() < 20 ? 20 - value.size() : 0, ' ') + value;
+    }
+    if (!comment.empty() && card.size() + 3 < kCardSize)
+    {
+        card += " / " + comment;
+    }
+    card.resize(kCardSize, ' ');
+    return card;
+}
+
+string PhitsFitsHeader::formatReal(double value)
+{
+    char buffer[32];
+    for (int digits = 15; digits <= 17; ++digits)
+    {
+        snprintf(buffer, sizeof(buffer), "%.*G", digits, value);
+        if (strtod(buffer, nullptr) == value)
+        {
+            break;
+        }
+    }
+    return buffer;
+}
+
+PhitsFitsHeader::Status PhitsFitsHeader::parse(const uint8_t* data, size_t size)
+{
+    m_cards.clear();
+    m_values.clear();
+    m_index.clear();
+    m_naxes.clear();
+    m_headerSize = 0;
+    m_bitpix = 0;
+
+    bool foundEnd = false;
+    size_t offset = 0;
+    for (; !foundEnd && offset + kBlockSize <= size; offset += kBlockSize)
+    {
+        for (size_t c = 0; c < kBlockSize && !foundEnd; c += kCardSize)
+        {
+            const char* cardData = reinterpret_cast<const char*>(data + offset + c);
+            for (size_t i = 0; i < kCardSize; ++i)
+            {
+                if (cardData[i] < 0x20 || cardData[i] > 0x7e)
+                {
+                    return Status::Invalid;
+                }
+            }
+            string card(cardData, kCardSize);
+            string key, value, comment;
+            splitCard(card, key, value, comment);
+
+            if (m_cards.empty())
+            {
+                if (key != "SIMPLE" && key != "XTENSION")
+                {
+                    return Status::Invalid;
+                }
+                m_isPrimary = key == "SIMPLE";
+            }
+            if (key == "END")
+            {
+                foundEnd = true;
+                break;
+            }
+            m_index.insert({ key, m_cards.size() });
+            m_cards.push_back(trimRight(card));
+            m_values.push_back(value);
+        }
+    }
+
+    if (!foundEnd)
+    {
+        // The caller decides whether more data is available.
+        parseImageKeys();
+        return Status::Incomplete;
+    }
+    m_headerSize = offset;
+    return parseImageKeys() ? Status::Complete : Status::Invalid;
+}
+
+bool PhitsFitsHeader::parseImageKeys()
+{
+    m_bitpix = 0;
+    m_naxes.clear();
+    int64_t bitpix = 0;
+    int64_t naxis = 0;
+    if (!getInt("BITPIX", bitpix) || !getInt("NAXIS", naxis) || naxis < 0 || naxis > 999)
+    {
+        return false;
+    }
+    if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != 64 && bitpix != -32 && bitpix != -64)
+    {
+        return false;
+    }
+    vector<int64_t> naxes;
+    for (int64_t i = 1; i <= naxis; ++i)
+    {
+        int64_t len = 0;
+        if (!getInt("NAXIS" + to_string(i), len) || len < 0)
+        {
+            return false;
+        }
+        naxes.push_back(len);
+    }
+    m_bitpix = (int)bitpix;
+    m_naxes = naxes;
+    return true;
+}
+
+PhitsFitsHeader::Status PhitsFitsHeader::read(int fd, uint64_t offset, size_t maxSize)
+{
+    // Most headers fit in a few blocks; read more only if END hasn't turned up.
+    vector<uint8_t> buffer;
+    size_t readSize = min(4 * kBlockSize, maxSize);
+    for (;;)
+    {
+        const size_t oldSize = buffer.size();
+        buffer.resize(readSize);
+        const size_t got = readAt(fd, offset + oldSize, buffer.data() + oldSize, readSize - oldSize);
+        buffer.resize(oldSize + got);
+        const Status status = parse(buffer.data(), buffer.size());
+        if (status != Status::Incomplete || oldSize + got < readSize || readSize >= maxSize)
+        {
+            return status;
+        }
+        readSize = min(readSize * 2, maxSize);
+    }
+}
+
+uint64_t PhitsFitsHeader::getDataSize() const
+{
+    if (m_naxes.empty())
+    {
+        return 0;
+    }
+    uint64_t count = 1;
+    for (int64_t len : m_naxes)
+    {
+        count *= (uint64_t)len;
+    }
+    const uint64_t pcount = (uint64_t)max<int64_t>(0, getIntValue("PCOUNT", 0));
+    const uint64_t gcount = (uint64_t)max<int64_t>(1, getIntValue("GCOUNT", 1));
+    return (uint64_t)(abs(m_bitpix) / 8) * gcount * (pcount + count);
+}
+
+const string* PhitsFitsHeader::findValue(const string& key) const
+{
+    const auto it = m_index.find(key);
+    if (it == m_index.end() || m_values[it->second].empty())
+    {
+        return nullptr;
+    }
+    return &m_values[it->second];
+}
+
+bool PhitsFitsHeader::getString(const string& key, string& value) const
+{
+    const string* pValue = findValue(key);
+    if (pValue == nullptr || (*pValue)[0] != '\'')
+    {
+        return false;
+    }
+    value.clear();
+    for (size_t i = 1; i < pValue->size(); ++i)
+    {
+        if ((*pValue)[i] == '\'')
+        {
+            if (i + 1 < pValue->size() && (*pValue)[i + 1] == '\'')
+            {
+                value += '\'';
+                ++i;
+                continue;
+            }
+            break;
+        }
+        value += (*pValue)[i];
+    }
+    // Trailing blanks in FITS strings are not significant.
+    value = trimRight(value);
+    return true;
+}
+
+bool PhitsFitsHeader::getInt(const string& key, int64_t& value) const
+{
+    const string* pValue = findValue(key);
+    if (pValue == nullptr)
+    {
+        return false;
+    }
+    char* end = nullptr;
+    const long long val = strtoll(pValue->c_str(), &end, 10);
+    if (end == pValue->c_str() || *end != '\0')
+    {
+        return false;
+    }
+    value = val;
+    return true;
+}
+
+bool PhitsFitsHeader::getDouble(const string& key, double& value) const
+{
+    const string* pValue = findValue(key);
+    if (pValue == nullptr || (*pValue)[0] == '\'')
+    {
+        return false;
+    }
+    // FITS allows Fortran-style 'D' exponents.
+    string str = *pValue;
+    replace(str.begin(), str.end(), 'D', 'E');
+    replace(str.begin(), str.end(), 'd', 'e');
+    char* end = nullptr;
+    const double val = strtod(str.c_str(), &end);
+    if (end == str.c_str() || *end != '\0')
+    {
+        return false;
+    }
+    value = val;
+    return true;
+}
+
+bool PhitsFitsHeader::getBool(const string& key, bool& value) const
+{
+    const string* pValue = findValue(key);
+    if (pValue == nullptr || (*pValue != "T" && *pValue != "F"))
+    {
+        return false;
+    }
+    value = *pValue == "T";
+    return true;
+}
+
+int64_t PhitsFitsHeader::getIntValue(const string& key, int64_t defaultValue) const
+{
+    int64_t value = defaultValue;
+    return getInt(key, value) ? value : defaultValue;
+}
+
+double PhitsFitsHeader::getDoubleValue(const string& key, double defaultValue) const
+{
+    double value = defaultValue;
+    return getDouble(key, value) ? value : defaultValue;
+}
+
+bool PhitsFitsHeader::getBlank(int64_t& blank) const
+{
+    int64_t value = 0;
+    if (m_bitpix <= 0 || !getInt("BLANK", value))
+    {
+        return false;
+    }
+    // Byte samples are unsigned; the others are two's complement.
+    const int64_t lo = m_bitpix == 8 ? 0 : m_bitpix == 64 ? INT64_MIN : -((int64_t)1 << (m_bitpix - 1));
+    const int64_t hi = m_bitpix == 8 ? 255 : m_bitpix == 64 ? INT64_MAX : ((int64_t)1 << (m_bitpix - 1)) - 1;
+    if (value < lo || value > hi)
+    {
+        return false;
+    }
+    blank = value;
+    return true;
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSFITSHEADER_H_
+#define _PHITSFITSHEADER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Minimal FITS header parser, independent of cfitsio. Used where we only need the structure of an HDU
+// (image geometry, data offset and size), and don't want the overhead of building CCfits objects.
+class PhitsFitsHeader
+{
+public:
+    static const size_t kBlockSize = 2880;
+    static const size_t kCardSize = 80;
+
+    enum class Status
+    {
+        Complete,       // END card found
+        Incomplete,     // Ran out of data before the END card
+        Invalid         // Not a FITS header
+    };
+
+    // Parse the header at data, which holds size bytes. The first card must be SIMPLE (primary HDU) or
+    // XTENSION (extension HDU). If the header is Incomplete, the image keywords below are still available
+    // if they were found, as they must come first in the header.
+    Status parse(const uint8_t* data, size_t size);
+
+    // Read and parse the header at the given file offset, reading no more than maxSize bytes, without
+    // touching the data unit. fd is as for PhitsMappedFile. Returns Invalid if the read fails.
+    Status read(int fd, uint64_t offset, size_t maxSize);
+
+    // Read up to size bytes at the given file offset, without moving the file pointer. Returns the number
+    // of bytes read, which is short at end of file or on error.
+    static size_t readAt(int fd, uint64_t offset, uint8_t* data, size_t size);
+
+    // Cards in file order, without trailing padding, up to but not including END.
+    const std::vector<std::string>& getCards() const { return m_cards; }
+
+    // Size of the header, including padding to a whole number of blocks.
+    uint64_t getHeaderSize() const { return m_headerSize; }
+
+    // Size of the data unit, excluding padding, as given by BITPIX, NAXISn, PCOUNT and GCOUNT.
+    uint64_t getDataSize() const;
+
+    // Size of the data unit, including padding to a whole number of blocks.
+    uint64_t getPaddedDataSize() const { return (getDataSize() + kBlockSize - 1) / kBlockSize * kBlockSize; }
+
+    bool isPrimary() const { return m_isPrimary; }
+    bool hasKey(const std::string& key) const { return m_index.count(key) != 0; }
+
+    // Typed accessors for the first card with the given keyword. Return false if the keyword is absent,
+    // or its value cannot be interpreted as the requested type.
+    bool getString(const std::string& key, std::string& value) const;
+    bool getInt(const std::string& key, int64_t& value) const;
+    bool getDouble(const std::string& key, double& value) const;
+    bool getBool(const std::string& key, bool& value) const;
+
+    int64_t getIntValue(const std::string& key, int64_t defaultValue) const;
+    double getDoubleValue(const std::string& key, double defaultValue) const;
+
+    // Stored value of undefined pixels (BLANK) in an integer image. Returns false if there is none, or it
+    // lies outside the range of BITPIX.
+    bool getBlank(int64_t& blank) const;
+
+    // Mandatory image keywords. Axis lengths are stored in FITS order (NAXIS1 first). BITPIX is zero if
+    // the keywords weren't found.
+    int getBitpix() const { return m_bitpix; }
+    int getNaxis() const { return (int)m_naxes.size(); }
+    int64_t getAxis(int i) const { return m_naxes[i]; }
+
+    // Keyword of a card: its first 8 columns, without trailing blanks.
+    static std::string getCardKey(const std::string& card);
+
+    // Split a card into keyword, value and comment strings. value is left as written (e.g. still quoted);
+    // returns false for cards without a value indicator (COMMENT, HISTORY, blank, ...).
+    static bool splitCard(const std::string& card, std::string& key, std::string& value, std::string& comment);
+
+    // Format a fixed-format card, blank-padded to kCardSize. String values are quoted and escaped; other
+    // values (numbers, T/F) are right-justified in columns 11-30. Overlong comments are truncated.
+    static std::string makeCard(const std::string& key, const std::string& value, const std::string& comment, bool isString);
+
+    // Format a real value for makeCard(), with no more digits than it takes to read back the same double.
+    static std::string formatReal(double value);
+
+private:
+    const std::string* findValue(const std::string& key) const;
+    bool parseImageKeys();
+
+    std::vector<std::string> m_cards;
+    std::map<std::string, size_t> m_index;     // Keyword -> index of its first card
+    std::vector<std::string> m_values;         // Raw value field of each card, parallel to m_cards
+    uint64_t m_headerSize = 0;
+    bool m_isPrimary = false;
+    int m_bitpix = 0;
+    std::vector<int64_t> m_naxes;
+};
+
+#endif // _PHITSFITSHEADER_H_
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsGzip.h"
+#include "PhitsKernels.h"
+#include "PhitsThreadPool.h"
+#include <stdexcept>
+#include <string.h>
+#include <zlib.h>
+
+using namespace std;
+
+// Compressed bytes read from the file at a time.
+static const size_t kInputSize = 1 << 20;
+
+// Uncompressed bytes per parallel deflate task; the chunk size pigz uses.
+static const size_t kChunkSize = 128 * 1024;
+
+// Deflate's window, and hence the most dictionary a chunk can use.
+static const size_t kWindowSize = 32 * 1024;
+
+// Samples per parallel decode task.
+static const size_t kDecodeGrain = 64 * 1024;
+
+PhitsGzipReader::PhitsGzipReader()
+{
+}
+
+PhitsGzipReader::~PhitsGzipReader()
+{
+    if (m_pStream)
+    {
+        inflateEnd(m_pStream.get());
+    }
+}
+
+bool PhitsGzipReader::isGzipped(int fd)
+{
+    uint8_t magic[2] = {};
+    return PhitsFitsHeader::readAt(fd, 0, magic, sizeof(magic)) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+void PhitsGzipReader::restart()
+{
+    if (m_pStream)
+    {
+        inflateEnd(m_pStream.get());
+    }
+    m_pStream.reset(new z_stream_s());
+    // Accept gzip (or zlib) framing.
+    if (inflateInit2(m_pStream.get(), 15 + 32) != Z_OK)
+    {
+        m_pStream.reset();
+        throw runtime_error("Could not initialize zlib");
+    }
+    m_input.resize(kInputSize);
+    m_inputOffset = 0;
+    m_isInputDone = false;
+    m_position = 0;
+}
+
+// Inflate up to size bytes to dst, or discard them if dst is null. Returns fewer bytes only at the end of
+// the stream.
+size_t PhitsGzipReader::inflateTo(uint8_t* dst, size_t size)
+{
+    z_stream_s& stream = *m_pStream;
+    vector<uint8_t> scratch(dst == nullptr ? min(size, kInputSize) : 0);
+    size_t done = 0;
+    while (done < size)
+    {
+        if (stream.avail_in == 0 && !m_isInputDone)
+        {
+            const size_t got = PhitsFitsHeader::readAt(m_fd, m_inputOffset, m_input.data(), m_input.size());
+            m_inputOffset += got;
+            m_isInputDone = got == 0;
+            stream.next_in = m_input.data();
+            stream.avail_in = (uInt)got;
+        }
+        const size_t chunk = min<size_t>(size - done, dst == nullptr ? scratch.size() : (1u << 30));
+        stream.next_out = dst == nullptr ? scratch.data() : dst + done;
+        stream.avail_out = (uInt)chunk;
+        const int result = inflate(&stream, Z_NO_FLUSH);
+        done += chunk - stream.avail_out;
+        if (result == Z_STREAM_END)
+        {
+            // A file may hold several gzip members, one after another.
+            if (stream.avail_in == 0 && m_isInputDone)
+            {
+                break;
+            }
+            inflateReset(&stream);
+        }
+        else if (result == Z_BUF_ERROR && m_isInputDone && stream.avail_in == 0)
+        {
+            break;
+        }
+        else if (result != Z_OK && result != Z_BUF_ERROR)
+        {
+            throw runtime_error("Corrupt gzip data");
+        }
+    }
+    m_position += done;
+    return done;
+}
+
+void PhitsGzipReader::skipTo(uint64_t position)
+{
+    if (position < m_position)
+    {
+        restart();
+    }
+    const uint64_t skip = position - m_position;
+    if (skip > 0 && inflateTo(nullptr, (size_t)skip) != skip)
+    {
+        throw runtime_error("Unexpected end of gzip data");
+    }
+}
+
+PhitsFitsHeader::Status PhitsGzipReader::readHeader(int fd, size_t maxSize, PhitsFitsHeader& header)
+{
+    if (!isGzipped(fd))
+    {
+        return PhitsFitsHeader::Status::Invalid;
+    }
+    try
+    {
+        PhitsGzipReader reader;
+        reader.m_fd = fd;
+        reader.restart();
+        // Headers are a whole number of blocks, so inflate a block at a time until the END card turns up.
+        vector<uint8_t> data;
+        PhitsFitsHeader::Status status = PhitsFitsHeader::Status::Incomplete;
+        while (status == PhitsFitsHeader::Status::Incomplete && data.size() + PhitsFitsHeader::kBlockSize <= maxSize)
+        {
+            const size_t oldSize = data.size();
+            data.resize(oldSize + PhitsFitsHeader::kBlockSize);
+            if (reader.inflateTo(data.data() + oldSize, PhitsFitsHeader::kBlockSize) != PhitsFitsHeader::kBlockSize)
+            {
+                return PhitsFitsHeader::Status::Invalid;
+            }
+            status = header.parse(data.data(), data.size());
+        }
+        return status;
+    }
+    catch (const exception&)
+    {
+        return PhitsFitsHeader::Status::Invalid;
+    }
+}
+
+unique_ptr<PhitsGzipReader> PhitsGzipReader::create(int fd)
+{
+    unique_ptr<PhitsGzipReader> pReader(new PhitsGzipReader);
+    PhitsFitsHeader& header = pReader->m_header;
+    if (readHeader(fd, SIZE_MAX, header) != PhitsFitsHeader::Status::Complete || !header.isPrimary() ||
+        (header.getNaxis() != 2 && header.getNaxis() != 3))
+    {
+        return nullptr;
+    }
+    // As for PhitsMappedReader, leave anything with an unusual data layout to cfitsio.
+    bool isSimple = false;
+    if (!header.getBool("SIMPLE", isSimple) || !isSimple || header.hasKey("GROUPS") ||
+        header.getIntValue("PCOUNT", 0) != 0 || header.getIntValue("GCOUNT", 1) != 1)
+    {
+        return nullptr;
+    }
+    pReader->m_fd = fd;
+    pReader->m_width = (uint32_t)header.getAxis(0);
+    pReader->m_height = (uint32_t)header.getAxis(1);
+    pReader->m_bscale = header.getDoubleValue("BSCALE", 1.);
+    pReader->m_bzero = header.getDoubleValue("BZERO", 0.);
+    pReader->m_hasBlank = header.getBlank(pReader->m_blank);
+    pReader->restart();
+    return pReader;
+}
+
+void PhitsGzipReader::readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst)
+{
+    const int bitpix = m_header.getBitpix();
+    const size_t sampleBytes = abs(bitpix) / 8;
+    const uint64_t firstSample = (uint64_t)plane * m_width * m_height + (uint64_t)row * m_width;
+    const size_t count = (size_t)rows * m_width;
+    skipTo(m_header.getHeaderSize() + firstSample * sampleBytes);
+
+    if (m_depth == 8)
+    {
+        if (inflateTo(static_cast<uint8_t*>(dst), count) != count)
+        {
+            throw runtime_error("Unexpected end of gzip data");
+        }
+        return;
+    }
+
+    m_raw.resize(count * sampleBytes);
+    if (inflateTo(m_raw.data(), m_raw.size()) != m_raw.size())
+    {
+        throw runtime_error("Unexpected end of gzip data");
+    }
+    if (m_depth == 16)
+    {
+        const PhitsKernels& kernels = getPhitsKernels();
+        const uint8_t* src = m_raw.data();
+        uint16_t* sp = static_cast<uint16_t*>(dst);
+        PhitsThreadPool::get().parallelFor(count, kDecodeGrain, [&](size_t begin, size_t end)
+        {
+            kernels.decodeShort16(src + begin * 2, sp + begin, end - begin);
+        });
+        return;
+    }
+    const PhitsDecodeKernel decode = getDecodeKernel(getPhitsKernels(), bitpix);
+    const PhitsMaskKernel mask = m_hasBlank ? getMaskKernel(getPhitsKernels(), bitpix) : nullptr;
+    const uint8_t* src = m_raw.data();
+    float* fp = static_cast<float*>(dst);
+    const double bscale = m_bscale;
+    const double bzero = m_bzero;
+    const int64_t blank = m_blank;
+    PhitsThreadPool::get().parallelFor(count, kDecodeGrain, [&](size_t begin, size_t end)
+    {
+        decode(src + begin * sampleBytes, fp + begin, end - begin, bscale, bzero);
+        if (mask != nullptr)
+        {
+            mask(src + begin * sampleBytes, fp + begin, end - begin, blank);
+        }
+    });
+}
+
+PhitsGzipWriter::PhitsGzipWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth)
+    : PhitsFitsWriter(fd, width, height, planes, depth)
+    , m_crc((uint32_t)crc32(0, Z_NULL, 0))
+{
+}
+
+void PhitsGzipWriter::writeHeader()
+{
+    // Deflate, no flags or timestamp, unknown OS.
+    static const uint8_t kGzipHeader[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+    PhitsImageWriter::writeAt(0, kGzipHeader, sizeof(kGzipHeader));
+    m_fileOffset = sizeof(kGzipHeader);
+    PhitsFitsWriter::writeHeader();
+}
+
+void PhitsGzipWriter::writeAt(uint64_t offset, const void* data, size_t size)
+{
+    if (offset != m_position)
+    {
+        throw runtime_error("Out of order write to gzip stream");
+    }
+    compress(static_cast<const uint8_t*>(data), size, false);
+}
+
+void PhitsGzipWriter::finish()
+{
+    PhitsFitsWriter::finish();
+    compress(nullptr, 0, true);
+
+    uint8_t trailer[8];
+    const uint32_t size = (uint32_t)m_position;
+    for (int i = 0; i < 4; ++i)
+    {
+        trailer[i] = (uint8_t)(m_crc >> (8 * i));
+        trailer[4 + i] = (uint8_t)(size >> (8 * i));
+    }
+    PhitsImageWriter::writeAt(m_fileOffset, trailer, sizeof(trailer));
+    m_fileOffset += sizeof(trailer);
+}
+
+void PhitsGzipWriter::compress(const uint8_t* data, size_t size, bool isLast)
+{
+    struct Chunk
+    {
+        const uint8_t* data;
+        size_t size;
+        const uint8_t* dictionary;
+        size_t dictionarySize;
+        vector<uint8_t> output;
+        uint32_t crc;
+    };
+
+    // Every chunk but the first is primed with the data before it; the first uses the previous call's tail.
+    const size_t chunkCount = max<size_t>(isLast ? 1 : 0, (size + kChunkSize - 1) / kChunkSize);
+    vector<Chunk> chunks(chunkCount);
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        Chunk& chunk = chunks[i];
+        chunk.data = data + i * kChunkSize;
+        chunk.size = min(kChunkSize, size - i * kChunkSize);
+        if (i == 0)
+        {
+            chunk.dictionary = m_window.data();
+            chunk.dictionarySize = m_window.size();
+        }
+        else
+        {
+            chunk.dictionarySize = min(kWindowSize, i * kChunkSize);
+            chunk.dictionary = chunk.data - chunk.dictionarySize;
+        }
+    }
+
+    PhitsThreadPool::get().parallelFor(chunkCount, 1, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            Chunk& chunk = chunks[i];
+            z_stream stream = {};
+            if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                throw runtime_error("Could not initialize zlib");
+            }
+            if (chunk.dictionarySize > 0)
+            {
+                deflateSetDictionary(&stream, chunk.dictionary, (uInt)chunk.dictionarySize);
+            }
+            // Room for the worst case, plus the empty stored block that ends a sync flush.
+            chunk.output.resize(deflateBound(&stream, (uLong)chunk.size) + 16);
+            stream.next_in = const_cast<Bytef*>(chunk.data);
+            stream.avail_in = (uInt)chunk.size;
+            stream.next_out = chunk.output.data();
+            stream.avail_out = (uInt)chunk.output.size();
+            // Sync flushes end each chunk on a byte boundary, so the chunks can simply be concatenated.
+            const bool isFinal = isLast && i + 1 == chunkCount;
+            const int result = deflate(&stream, isFinal ? Z_FINISH : Z_SYNC_FLUSH);
+            const bool isComplete = isFinal ? result == Z_STREAM_END : result == Z_OK && stream.avail_out > 0;
+            chunk.output.resize(stream.total_out);
+            deflateEnd(&stream);
+            if (!isComplete || stream.avail_in != 0)
+            {
+                throw runtime_error("gzip compression failed");
+            }
+            chunk.crc = (uint32_t)crc32(0, chunk.data, (uInt)chunk.size);
+        }
+    });
+
+    vector<uint8_t> output;
+    for (const Chunk& chunk : chunks)
+    {
+        output.insert(output.end(), chunk.output.begin(), chunk.output.end());
+        m_crc = (uint32_t)crc32_combine(m_crc, chunk.crc, (z_off_t)chunk.size);
+    }
+    PhitsImageWriter::writeAt(m_fileOffset, output.data(), output.size());
+    m_fileOffset += output.size();
+    m_position += size;
+
+    // Keep the tail of the data to prime the next call's first chunk.
+    if (size >= kWindowSize)
+    {
+        m_window.assign(data + size - kWindowSize, data + size);
+    }
+    else if (size > 0)
+    {
+        m_window.insert(m_window.end(), data, data + size);
+        if (m_window.size() > kWindowSize)
+        {
+            m_window.erase(m_window.begin(), m_window.end() - kWindowSize);
+        }
+    }
+}
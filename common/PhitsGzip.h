@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSGZIP_H_
+#define _PHITSGZIP_H_
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "PhitsFitsHeader.h"
+#include "PhitsReader.h"
+#include "PhitsWriter.h"
+
+struct z_stream_s;
+
+// Reads the primary image of a gzip-compressed file (.fits.gz) as a stream. The file is inflated as rows
+// are requested, so neither the compressed nor the uncompressed image is ever held in memory, as it is
+// when cfitsio opens a compressed file. Rows should be read in file order; reading rows that precede the
+// last ones read restarts the stream from the beginning of the file.
+class PhitsGzipReader : public PhitsImageReader
+{
+public:
+    ~PhitsGzipReader();
+
+    // True if the file starts with the gzip magic number. fd is as for PhitsMappedFile.
+    static bool isGzipped(int fd);
+
+    // Parse the primary header of a gzipped file, inflating no more than maxSize bytes of it.
+    static PhitsFitsHeader::Status readHeader(int fd, size_t maxSize, PhitsFitsHeader& header);
+
+    // Returns nullptr if the file isn't gzipped, or its primary HDU isn't a plain image we can decode.
+    static std::unique_ptr<PhitsGzipReader> create(int fd);
+
+    // Editing depth of the rows passed to readRows(), as for the other readers. Must be set before reading.
+    void setDepth(uint32_t depth) { m_depth = depth; }
+
+    void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) override;
+    bool isSequential() const override { return true; }
+    const char* getName() const override { return "gzip"; }
+
+    const PhitsFitsHeader& getHeader() const { return m_header; }
+
+private:
+    PhitsGzipReader();
+
+    void restart();
+    size_t inflateTo(uint8_t* dst, size_t size);
+    void skipTo(uint64_t position);
+
+    int m_fd = -1;
+    std::unique_ptr<z_stream_s> m_pStream;
+    std::vector<uint8_t> m_input;
+    uint64_t m_inputOffset = 0;     // File offset of the next compressed bytes to read
+    bool m_isInputDone = false;
+    uint64_t m_position = 0;        // Uncompressed bytes delivered so far
+    PhitsFitsHeader m_header;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_depth = 0;
+    double m_bscale = 1.;
+    double m_bzero = 0.;
+    bool m_hasBlank = false;
+    int64_t m_blank = 0;
+    std::vector<uint8_t> m_raw;
+};
+
+// Writes an uncompressed primary image through gzip. As pigz does, the stream is cut into chunks that are
+// deflated in parallel, each primed with the 32 KB of data preceding it, and the results are concatenated
+// into a single gzip member that any gzip reader (including cfitsio) accepts.
+class PhitsGzipWriter : public PhitsFitsWriter
+{
+public:
+    PhitsGzipWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth);
+
+    bool isSequential() const override { return true; }
+    void writeHeader() override;
+    void finish() override;
+
+protected:
+    // Data must arrive in file order.
+    void writeAt(uint64_t offset, const void* data, size_t size) override;
+
+    // The compressed size isn't known up front.
+    void reserve(uint64_t size) override {}
+
+private:
+    void compress(const uint8_t* data, size_t size, bool isLast);
+
+    uint64_t m_position = 0;        // Uncompressed bytes written
+    uint64_t m_fileOffset = 0;      // Compressed bytes written
+    uint32_t m_crc = 0;
+    std::vector<uint8_t> m_window;  // The last 32 KB of uncompressed data, to prime the next chunk
+};
+
+#endif // _PHITSGZIP_H_
@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsHduIndex.h"
+#include "PhitsHeaderCache.h"
+#include <algorithm>
+#include <ctype.h>
+
+using namespace std;
+
+static string toUpper(string str)
+{
+    transform(str.begin(), str.end(), str.begin(), ::toupper);
+    return str;
+}
+
+// Fill in everything but the offsets from the HDU's header.
+static void describeHdu(const PhitsFitsHeader& header, PhitsHduIndex::Hdu& hdu)
+{
+    if (!header.getString("EXTNAME", hdu.name))
+    {
+        header.getString("HDUNAME", hdu.name);
+    }
+    hdu.dataSize = header.getDataSize();
+
+    string xtension;
+    bool flag = false;
+    if (header.isPrimary())
+    {
+        hdu.type = header.getBool("GROUPS", flag) && flag ? PhitsHduIndex::Type::Other : PhitsHduIndex::Type::Image;
+    }
+    else if (!header.getString("XTENSION", xtension))
+    {
+        hdu.type = PhitsHduIndex::Type::Other;
+    }
+    else if (xtension == "IMAGE")
+    {
+        hdu.type = PhitsHduIndex::Type::Image;
+    }
+    else if (xtension == "TABLE")
+    {
+        hdu.type = PhitsHduIndex::Type::Table;
+    }
+    else if (xtension == "BINTABLE")
+    {
+        hdu.type = header.getBool("ZIMAGE", flag) && flag ? PhitsHduIndex::Type::CompressedImage : PhitsHduIndex::Type::BinTable;
+    }
+    else
+    {
+        hdu.type = PhitsHduIndex::Type::Other;
+    }
+
+    if (hdu.type == PhitsHduIndex::Type::Image)
+    {
+        hdu.bitpix = header.getBitpix();
+        for (int i = 0; i < header.getNaxis(); ++i)
+        {
+            hdu.axes.push_back(header.getAxis(i));
+        }
+    }
+    else if (hdu.type == PhitsHduIndex::Type::CompressedImage)
+    {
+        hdu.bitpix = (int)header.getIntValue("ZBITPIX", 0);
+        const int naxis = (int)header.getIntValue("ZNAXIS", 0);
+        for (int i = 0; i < naxis; ++i)
+        {
+            hdu.axes.push_back(header.getIntValue("ZNAXIS" + to_string(i + 1), 0));
+        }
+    }
+}
+
+bool PhitsHduIndex::build(int fd)
+{
+    m_hdus.clear();
+    PhitsFileId id;
+    const uint64_t fileSize = id.get(fd) ? id.size : UINT64_MAX;
+
+    PhitsFitsHeader header;
+    uint64_t offset = 0;
+    while (offset < fileSize && header.read(fd, offset, SIZE_MAX) == PhitsFitsHeader::Status::Complete)
+    {
+        // Only the primary header may be SIMPLE, and only the first header may be primary.
+        if (header.isPrimary() != m_hdus.empty())
+        {
+            break;
+        }
+        Hdu hdu;
+        hdu.headerOffset = offset;
+        hdu.dataOffset = offset + header.getHeaderSize();
+        describeHdu(header, hdu);
+        if (hdu.dataOffset + hdu.dataSize > fileSize)
+        {
+            break;
+        }
+        m_hdus.push_back(move(hdu));
+        offset = m_hdus.back().dataOffset + header.getPaddedDataSize();
+    }
+    return !m_hdus.empty();
+}
+
+int PhitsHduIndex::find(const string& name) const
+{
+    const string upperName = toUpper(name);
+    for (size_t i = 0; i < m_hdus.size(); ++i)
+    {
+        if (toUpper(m_hdus[i].name) == upperName)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+int PhitsHduIndex::findCompressedImage() const
+{
+    for (size_t i = 1; i < m_hdus.size(); ++i)
+    {
+        if (m_hdus[i].type == Type::CompressedImage)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+bool PhitsHduIndex::readHeader(int fd, size_t i, PhitsFitsHeader& header) const
+{
+    return i < m_hdus.size() && header.read(fd, m_hdus[i].headerOffset, SIZE_MAX) == PhitsFitsHeader::Status::Complete;
+}
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSHDUINDEX_H_
+#define _PHITSHDUINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "PhitsFitsHeader.h"
+
+// Layout of every HDU in a file, found by a single pass over the headers that skips over the data units.
+// Lets us list the extensions of a file, and seek to any of them, without building CCfits objects (which
+// read and parse each extension's header as it's visited, and hold on to all of them).
+class PhitsHduIndex
+{
+public:
+    enum class Type
+    {
+        Image,              // Primary image, or IMAGE extension
+        Table,              // ASCII TABLE extension
+        BinTable,           // BINTABLE extension
+        CompressedImage,    // BINTABLE extension holding a tile-compressed image (ZIMAGE = T)
+        Other               // Random groups, or an extension type we don't know
+    };
+
+    struct Hdu
+    {
+        Type type = Type::Other;
+        std::string name;           // EXTNAME (HDUNAME if absent); empty if neither is given
+        uint64_t headerOffset = 0;
+        uint64_t dataOffset = 0;
+        uint64_t dataSize = 0;      // Excluding padding
+        // Image geometry; that of the uncompressed image for a CompressedImage. Empty for tables.
+        int bitpix = 0;
+        std::vector<int64_t> axes;
+    };
+
+    // Scan the file open on fd, which is as for PhitsMappedFile. The scan stops at end of file, or at the
+    // first HDU that is incomplete or isn't valid FITS, as cfitsio does. Returns false if not even the
+    // primary header can be read.
+    bool build(int fd);
+
+    // HDUs in file order; index 0 is the primary HDU.
+    const std::vector<Hdu>& getHdus() const { return m_hdus; }
+    size_t getHduCount() const { return m_hdus.size(); }
+    const Hdu& getHdu(size_t i) const { return m_hdus[i]; }
+
+    // Index of the first HDU with the given name (compared without regard to case), or -1 if there is none.
+    int find(const std::string& name) const;
+
+    // Index of the first CompressedImage HDU, or -1 if there is none.
+    int findCompressedImage() const;
+
+    // Read the complete header of HDU i, seeking straight to it.
+    bool readHeader(int fd, size_t i, PhitsFitsHeader& header) const;
+
+private:
+    std::vector<Hdu> m_hdus;
+};
+
+#endif // _PHITSHDUINDEX_H_
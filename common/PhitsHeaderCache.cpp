@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsHeaderCache.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// Headers and indexes are small, but there's no point in remembering more than the files being opened right now.
+static const size_t kMaxEntries = 8;
+
+#ifdef _WIN32
+
+bool PhitsFileId::get(int fd)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), &info))
+    {
+        return false;
+    }
+    device = info.dwVolumeSerialNumber;
+    inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    mtime = (int64_t)(((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime);
+    return true;
+}
+
+#else
+
+bool PhitsFileId::get(int fd)
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        return false;
+    }
+    device = (uint64_t)st.st_dev;
+    inode = (uint64_t)st.st_ino;
+    size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+    mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+#endif
+
+PhitsHeaderCache& PhitsHeaderCache::get()
+{
+    // Never destroyed, for the same reason as the thread pool: nothing here needs to run at unload.
+    static PhitsHeaderCache* pCache = new PhitsHeaderCache;
+    return *pCache;
+}
+
+PhitsHeaderCache::Entry* PhitsHeaderCache::find(const PhitsFileId& id)
+{
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return &m_entries.front();
+        }
+    }
+    return nullptr;
+}
+
+PhitsHeaderCache::Entry& PhitsHeaderCache::insert(const PhitsFileId& id)
+{
+    Entry* pEntry = find(id);
+    if (pEntry != nullptr)
+    {
+        return *pEntry;
+    }
+    m_entries.push_front({ id, nullptr, nullptr });
+    if (m_entries.size() > kMaxEntries)
+    {
+        m_entries.pop_back();
+    }
+    return m_entries.front();
+}
+
+shared_ptr<const PhitsFitsHeader> PhitsHeaderCache::getPrimaryHeader(int fd, size_t maxSize)
+{
+    PhitsFileId id;
+    const bool hasId = id.get(fd);
+    if (hasId)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        const Entry* pEntry = find(id);
+        if (pEntry != nullptr && pEntry->header)
+        {
+            return pEntry->header;
+        }
+    }
+
+    shared_ptr<PhitsFitsHeader> pHeader = make_shared<PhitsFitsHeader>();
+    const PhitsFitsHeader::Status status = pHeader->read(fd, 0, maxSize);
+    if (status == PhitsFitsHeader::Status::Invalid || !pHeader->isPrimary())
+    {
+        return nullptr;
+    }
+    if (status == PhitsFitsHeader::Status::Complete && hasId)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        insert(id).header = pHeader;
+    }
+    return pHeader;
+}
+
+shared_ptr<const PhitsHduIndex> PhitsHeaderCache::getHduIndex(int fd)
+{
+    PhitsFileId id;
+    const bool hasId = id.get(fd);
+    if (hasId)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        const Entry* pEntry = find(id);
+        if (pEntry != nullptr && pEntry->index)
+        {
+            return pEntry->index;
+        }
+    }
+
+    shared_ptr<PhitsHduIndex> pIndex = make_shared<PhitsHduIndex>();
+    if (!pIndex->build(fd))
+    {
+        return nullptr;
+    }
+    if (hasId)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        insert(id).index = pIndex;
+    }
+    return pIndex;
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSHEADERCACHE_H_
+#define _PHITSHEADERCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "PhitsFitsHeader.h"
+#include "PhitsHduIndex.h"
+
+// Identity of the file open on a descriptor. A file that is modified or replaced gets a new identity.
+struct PhitsFileId
+{
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;      // Platform-specific units
+
+    // Returns false if the descriptor can't be queried. fd is as for PhitsMappedFile.
+    bool get(int fd);
+
+    bool operator==(const PhitsFileId& other) const
+    {
+        return device == other.device && inode == other.inode && size == other.size && mtime == other.mtime;
+    }
+};
+
+// Parsed primary headers, and HDU indexes, of recently seen files. Like the thread pool, the cache outlives PhitsPlugin, which
+// is deleted at the end of every phase, so a header parsed by filterFile() is reused by readStart() for the
+// same open, and a file is only parsed again if it changes.
+class PhitsHeaderCache
+{
+public:
+    static PhitsHeaderCache& get();
+
+    // Primary header of the file open on fd, reading at most maxSize bytes of it if it isn't cached. Only
+    // complete headers are cached; an Incomplete header (see PhitsFitsHeader::parse()) is returned, but
+    // not kept. Returns nullptr if the header is invalid or can't be read.
+    std::shared_ptr<const PhitsFitsHeader> getPrimaryHeader(int fd, size_t maxSize = SIZE_MAX);
+
+    // Index of the HDUs of the file open on fd, built if it isn't cached. Returns nullptr if the file
+    // has no valid primary header.
+    std::shared_ptr<const PhitsHduIndex> getHduIndex(int fd);
+
+private:
+    struct Entry
+    {
+        PhitsFileId id;
+        std::shared_ptr<const PhitsFitsHeader> header;  // Either of these may be null
+        std::shared_ptr<const PhitsHduIndex> index;
+    };
+
+    PhitsHeaderCache() {}
+
+    // Both must be called with m_mutex held. find() returns nullptr for an unknown file; insert() adds
+    // an empty entry for one. Either moves the file's entry to the front.
+    Entry* find(const PhitsFileId& id);
+    Entry& insert(const PhitsFileId& id);
+
+    std::mutex m_mutex;
+    std::list<Entry> m_entries;     // Most recently used first
+};
+
+#endif // _PHITSHEADERCACHE_H_
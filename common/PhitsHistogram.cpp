@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsHistogram.h"
+#include "PhitsThreadPool.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+// Fewest values binned by one task; a per-task histogram isn't worth clearing and merging for less.
+static const size_t kMinGrain = 256 * 1024;
+
+// Value at the given fraction of the way through a histogram, spreading each bin's values evenly across it,
+// in units of bins.
+static double findQuantile(const vector<uint64_t>& bins, uint64_t count, double fraction)
+{
+    const double target = fraction * count;
+    uint64_t below = 0;
+    for (size_t b = 0; b < bins.size(); ++b)
+    {
+        if (bins[b] != 0 && below + bins[b] >= target)
+        {
+            return b + max(0., target - below) / bins[b];
+        }
+        below += bins[b];
+    }
+    return (double)bins.size();
+}
+
+PhitsHistogram::PhitsHistogram(float minVal, float maxVal)
+    : m_minVal(minVal)
+    , m_binWidth(maxVal > minVal ? ((double)maxVal - minVal) / kBinCount : 1.)
+    , m_bins(kBinCount, 0)
+{
+}
+
+void PhitsHistogram::add(const float* src, size_t count)
+{
+    // One chunk per thread, rather than the usual small ones, so that there are few histograms to merge.
+    PhitsThreadPool& pool = PhitsThreadPool::get();
+    const size_t grain = max(kMinGrain, (count + pool.getThreadCount() - 1) / pool.getThreadCount());
+    const float minVal = (float)m_minVal;
+    const float scale = (float)(1. / m_binWidth);
+    pool.parallelFor(count, grain, [&](size_t begin, size_t end)
+    {
+        vector<uint32_t> bins(kBinCount, 0);
+        uint64_t counted = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            // The maximum may land just past the last bin. The comparisons are false for NaN.
+            const float pos = (src[i] - minVal) * scale;
+            if (pos >= 0.f && pos < (float)(kBinCount + 1))
+            {
+                ++bins[min((size_t)pos, kBinCount - 1)];
+                ++counted;
+            }
+        }
+        lock_guard<mutex> lock(m_mutex);
+        for (size_t b = 0; b < kBinCount; ++b)
+        {
+            m_bins[b] += bins[b];
+        }
+        m_count += counted;
+    });
+}
+
+double PhitsHistogram::getQuantile(double fraction) const
+{
+    if (m_count == 0)
+    {
+        return m_minVal;
+    }
+    return m_minVal + findQuantile(m_bins, m_count, fraction) * m_binWidth;
+}
+
+double PhitsHistogram::getMad(double median) const
+{
+    if (m_count == 0)
+    {
+        return 0.;
+    }
+    // Histogram of the distances of the bins from the median, with bins of the same width.
+    const double center = (median - m_minVal) / m_binWidth;
+    vector<uint64_t> distances(kBinCount, 0);
+    for (size_t b = 0; b < kBinCount; ++b)
+    {
+        const size_t d = min((size_t)fabs(b + .5 - center), kBinCount - 1);
+        distances[d] += m_bins[b];
+    }
+    return findQuantile(distances, m_count, .5) * m_binWidth;
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSHISTOGRAM_H_
+#define _PHITSHISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+// Fixed-size histogram of float values over a known range, for order statistics (percentiles, median, MAD)
+// without sorting or holding the image. Values are added a band at a time; each band is binned in parallel
+// into per-thread histograms, which are merged into this one. Statistics are interpolated within a bin, so
+// they're accurate to a small fraction of (maxVal - minVal) / kBinCount.
+class PhitsHistogram
+{
+public:
+    static const size_t kBinCount = 65536;
+
+    // Values outside [minVal, maxVal], and NaNs, are not counted.
+    PhitsHistogram(float minVal, float maxVal);
+
+    // Count the values at src. May be called from several threads at once.
+    void add(const float* src, size_t count);
+
+    uint64_t getCount() const { return m_count; }
+
+    // Value below which the given fraction (0 to 1) of the counted values lie.
+    double getQuantile(double fraction) const;
+    double getMedian() const { return getQuantile(.5); }
+
+    // Median absolute deviation from the given median.
+    double getMad(double median) const;
+
+private:
+    double m_minVal;
+    double m_binWidth;
+    std::mutex m_mutex;
+    std::vector<uint64_t> m_bins;
+    uint64_t m_count = 0;
+};
+
+#endif // _PHITSHISTOGRAM_H_
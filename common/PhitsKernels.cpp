@@ -0,0 +1,1483 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsKernels.h"
+#include "PhitsEndian.h"
+#include "PhitsSettings.h"
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PHITS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC makes all intrinsics available without per-function target attributes.
+#define PHITS_TARGET(x)
+#else
+#define PHITS_TARGET(x) __attribute__((target(x)))
+#endif
+// The AVX-512 decoders need BW for byte shuffles and DQ for int64 to double conversion.
+#define PHITS_AVX512 "avx512f,avx512bw,avx512dq"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define PHITS_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// Scalar reference kernels
+
+// The statistics and normalization kernels tell finite values from NaN and the infinities without branching:
+// x - x is zero for finite x, and NaN otherwise. The min/max kernels add it to each value, which makes every
+// non-finite value NaN; comparisons with NaN are false, and the vector min and max instructions return their
+// second operand when the first is NaN, so those values are passed over. The selections below are done on
+// the bits, as the vector kernels do, since compilers turn a conditional on floats into a branch.
+
+// a if condition is true, b otherwise.
+static inline float selectFloat(bool condition, float a, float b)
+{
+    uint32_t aBits, bBits;
+    memcpy(&aBits, &a, sizeof(aBits));
+    memcpy(&bBits, &b, sizeof(bBits));
+    const uint32_t mask = 0u - (uint32_t)condition;
+    const uint32_t bits = (aBits & mask) | (bBits & ~mask);
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Set all bits of v, which makes it a NaN, if condition is true.
+static inline float maskFloat(bool condition, float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits |= 0u - (uint32_t)condition;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static void minMaxScalar(const float* src, size_t count, float& minVal, float& maxVal)
+{
+    float lo = minVal;
+    float hi = maxVal;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float v = src[i] + (src[i] - src[i]);
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+    }
+    minVal = lo;
+    maxVal = hi;
+}
+
+static void normalizeScalar(const float* src, float* dst, size_t count, float offset, float scale, float blank)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float v = src[i];
+        dst[i] = selectFloat(v - v == 0.f, (v + offset) * scale, blank);
+    }
+}
+
+// Scaling is done in double precision, as cfitsio does, so that we produce the same values it would. The
+// vector decoders do the same, with a separate multiply and add; keep the compiler from fusing them here,
+// so that every kernel set produces the same results as this reference.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+static void decodeByteScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (float)(p[i] * bscale + bzero);
+    }
+}
+
+static void decodeShortScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (float)((int16_t)loadBE16(p + 2 * i) * bscale + bzero);
+    }
+}
+
+static void decodeShort16Scalar(const void* src, uint16_t* dst, size_t count)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = toPhotoshop16(loadBE16(p + 2 * i) ^ 0x8000u);
+    }
+}
+
+static void decodeLongScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (float)((int32_t)loadBE32(p + 4 * i) * bscale + bzero);
+    }
+}
+
+static void decodeLongLongScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (float)((double)(int64_t)loadBE64(p + 8 * i) * bscale + bzero);
+    }
+}
+
+static void decodeFloatScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint32_t bits = loadBE32(p + 4 * i);
+        float val;
+        memcpy(&val, &bits, sizeof(val));
+        dst[i] = isScaled ? (float)(val * bscale + bzero) : val;
+    }
+}
+
+static void decodeDoubleScalar(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint64_t bits = loadBE64(p + 8 * i);
+        double val;
+        memcpy(&val, &bits, sizeof(val));
+        dst[i] = (float)(val * bscale + bzero);
+    }
+}
+
+// BLANK samples are flagged by setting all bits of the decoded value. The vector kernels compare samples in
+// file byte order, against the byte-swapped BLANK value.
+
+static void maskByteScalar(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint8_t b = (uint8_t)blank;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = maskFloat(p[i] == b, dst[i]);
+    }
+}
+
+static void maskShortScalar(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint16_t b = (uint16_t)blank;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = maskFloat(loadBE16(p + 2 * i) == b, dst[i]);
+    }
+}
+
+static void maskLongScalar(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint32_t b = (uint32_t)blank;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = maskFloat(loadBE32(p + 4 * i) == b, dst[i]);
+    }
+}
+
+static void maskLongLongScalar(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint64_t b = (uint64_t)blank;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = maskFloat(loadBE64(p + 8 * i) == b, dst[i]);
+    }
+}
+
+// Sample value as it's stored in the file, loaded as a native integer.
+static inline uint16_t getRaw16(int64_t value)
+{
+    uint8_t bytes[2];
+    storeBE16(bytes, (uint16_t)value);
+    uint16_t raw;
+    memcpy(&raw, bytes, sizeof(raw));
+    return raw;
+}
+
+static inline uint32_t getRaw32(int64_t value)
+{
+    uint8_t bytes[4];
+    storeBE32(bytes, (uint32_t)value);
+    uint32_t raw;
+    memcpy(&raw, bytes, sizeof(raw));
+    return raw;
+}
+
+// The vector encoders clamp with max then min, which take the bound when the value is NaN; so does this.
+static inline float clampFloat(float v, float lo, float hi)
+{
+    v = v > lo ? v : lo;
+    return v < hi ? v : hi;
+}
+
+static inline double clampDouble(double v, double lo, double hi)
+{
+    v = v > lo ? v : lo;
+    return v < hi ? v : hi;
+}
+
+// lrint() rounds as the vector conversions do, to nearest even in the default rounding mode.
+static void encodeByteScalar(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const float s = (float)scale;
+    const float o = (float)offset;
+    for (size_t i = 0; i < count; ++i)
+    {
+        dst[i] = (uint8_t)lrintf(clampFloat(src[i] * s + o, 0.f, 255.f));
+    }
+}
+
+static void encodeShortScalar(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const float s = (float)scale;
+    const float o = (float)offset;
+    for (size_t i = 0; i < count; ++i)
+    {
+        storeBE16(dst + 2 * i, (uint16_t)(int16_t)lrintf(clampFloat(src[i] * s + o, -32768.f, 32767.f)));
+    }
+}
+
+static void encodeLongScalar(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        storeBE32(dst + 4 * i, (uint32_t)(int32_t)lrint(clampDouble(src[i] * scale + offset, -2147483648., 2147483647.)));
+    }
+}
+
+// The vector kernels below round each operation as the scalar versions do (no FMA), so that they produce
+// bit-identical output: normalization adds then multiplies, and the decoders and encoders multiply then add.
+
+#ifdef PHITS_X86
+
+PHITS_TARGET("sse2")
+static void minMaxSSE2(const float* src, size_t count, float& minVal, float& maxVal)
+{
+    __m128 lo0 = _mm_set1_ps(minVal), lo1 = lo0;
+    __m128 hi0 = _mm_set1_ps(maxVal), hi1 = hi0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 a = _mm_loadu_ps(src + i);
+        __m128 b = _mm_loadu_ps(src + i + 4);
+        a = _mm_add_ps(a, _mm_sub_ps(a, a));
+        b = _mm_add_ps(b, _mm_sub_ps(b, b));
+        lo0 = _mm_min_ps(a, lo0);
+        hi0 = _mm_max_ps(a, hi0);
+        lo1 = _mm_min_ps(b, lo1);
+        hi1 = _mm_max_ps(b, hi1);
+    }
+    float lo[4], hi[4];
+    _mm_storeu_ps(lo, _mm_min_ps(lo0, lo1));
+    _mm_storeu_ps(hi, _mm_max_ps(hi0, hi1));
+    for (int j = 0; j < 4; ++j)
+    {
+        minVal = min(minVal, lo[j]);
+        maxVal = max(maxVal, hi[j]);
+    }
+    minMaxScalar(src + i, count - i, minVal, maxVal);
+}
+
+// (v + offset) * scale where v is finite, and blank elsewhere.
+PHITS_TARGET("sse2")
+static inline __m128 blankOrNormalizeSSE2(__m128 v, __m128 vOffset, __m128 vScale, __m128 vBlank)
+{
+    const __m128 isFinite = _mm_cmpeq_ps(_mm_sub_ps(v, v), _mm_setzero_ps());
+    const __m128 n = _mm_mul_ps(_mm_add_ps(v, vOffset), vScale);
+    return _mm_or_ps(_mm_and_ps(isFinite, n), _mm_andnot_ps(isFinite, vBlank));
+}
+
+PHITS_TARGET("sse2")
+static void normalizeSSE2(const float* src, float* dst, size_t count, float offset, float scale, float blank)
+{
+    const __m128 vOffset = _mm_set1_ps(offset);
+    const __m128 vScale = _mm_set1_ps(scale);
+    const __m128 vBlank = _mm_set1_ps(blank);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128 a = _mm_loadu_ps(src + i);
+        const __m128 b = _mm_loadu_ps(src + i + 4);
+        _mm_storeu_ps(dst + i, blankOrNormalizeSSE2(a, vOffset, vScale, vBlank));
+        _mm_storeu_ps(dst + i + 4, blankOrNormalizeSSE2(b, vOffset, vScale, vBlank));
+    }
+    normalizeScalar(src + i, dst + i, count - i, offset, scale, blank);
+}
+
+PHITS_TARGET("avx2")
+static void minMaxAVX2(const float* src, size_t count, float& minVal, float& maxVal)
+{
+    __m256 lo0 = _mm256_set1_ps(minVal), lo1 = lo0;
+    __m256 hi0 = _mm256_set1_ps(maxVal), hi1 = hi0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256 a = _mm256_loadu_ps(src + i);
+        __m256 b = _mm256_loadu_ps(src + i + 8);
+        a = _mm256_add_ps(a, _mm256_sub_ps(a, a));
+        b = _mm256_add_ps(b, _mm256_sub_ps(b, b));
+        lo0 = _mm256_min_ps(a, lo0);
+        hi0 = _mm256_max_ps(a, hi0);
+        lo1 = _mm256_min_ps(b, lo1);
+        hi1 = _mm256_max_ps(b, hi1);
+    }
+    float lo[8], hi[8];
+    _mm256_storeu_ps(lo, _mm256_min_ps(lo0, lo1));
+    _mm256_storeu_ps(hi, _mm256_max_ps(hi0, hi1));
+    for (int j = 0; j < 8; ++j)
+    {
+        minVal = min(minVal, lo[j]);
+        maxVal = max(maxVal, hi[j]);
+    }
+    minMaxScalar(src + i, count - i, minVal, maxVal);
+}
+
+PHITS_TARGET("avx2")
+static inline __m256 blankOrNormalizeAVX2(__m256 v, __m256 vOffset, __m256 vScale, __m256 vBlank)
+{
+    const __m256 isFinite = _mm256_cmp_ps(_mm256_sub_ps(v, v), _mm256_setzero_ps(), _CMP_EQ_OQ);
+    return _mm256_blendv_ps(vBlank, _mm256_mul_ps(_mm256_add_ps(v, vOffset), vScale), isFinite);
+}
+
+PHITS_TARGET("avx2")
+static void normalizeAVX2(const float* src, float* dst, size_t count, float offset, float scale, float blank)
+{
+    const __m256 vOffset = _mm256_set1_ps(offset);
+    const __m256 vScale = _mm256_set1_ps(scale);
+    const __m256 vBlank = _mm256_set1_ps(blank);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256 a = _mm256_loadu_ps(src + i);
+        const __m256 b = _mm256_loadu_ps(src + i + 8);
+        _mm256_storeu_ps(dst + i, blankOrNormalizeAVX2(a, vOffset, vScale, vBlank));
+        _mm256_storeu_ps(dst + i + 8, blankOrNormalizeAVX2(b, vOffset, vScale, vBlank));
+    }
+    normalizeScalar(src + i, dst + i, count - i, offset, scale, blank);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void minMaxAVX512(const float* src, size_t count, float& minVal, float& maxVal)
+{
+    __m512 lo0 = _mm512_set1_ps(minVal), lo1 = lo0;
+    __m512 hi0 = _mm512_set1_ps(maxVal), hi1 = hi0;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512 a = _mm512_loadu_ps(src + i);
+        __m512 b = _mm512_loadu_ps(src + i + 16);
+        a = _mm512_add_ps(a, _mm512_sub_ps(a, a));
+        b = _mm512_add_ps(b, _mm512_sub_ps(b, b));
+        lo0 = _mm512_min_ps(a, lo0);
+        hi0 = _mm512_max_ps(a, hi0);
+        lo1 = _mm512_min_ps(b, lo1);
+        hi1 = _mm512_max_ps(b, hi1);
+    }
+    float lo[16], hi[16];
+    _mm512_storeu_ps(lo, _mm512_min_ps(lo0, lo1));
+    _mm512_storeu_ps(hi, _mm512_max_ps(hi0, hi1));
+    for (int j = 0; j < 16; ++j)
+    {
+        minVal = min(minVal, lo[j]);
+        maxVal = max(maxVal, hi[j]);
+    }
+    minMaxScalar(src + i, count - i, minVal, maxVal);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static inline __m512 blankOrNormalizeAVX512(__m512 v, __m512 vOffset, __m512 vScale, __m512 vBlank)
+{
+    const __mmask16 isFinite = _mm512_cmp_ps_mask(_mm512_sub_ps(v, v), _mm512_setzero_ps(), _CMP_EQ_OQ);
+    return _mm512_mask_blend_ps(isFinite, vBlank, _mm512_mul_ps(_mm512_add_ps(v, vOffset), vScale));
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void normalizeAVX512(const float* src, float* dst, size_t count, float offset, float scale, float blank)
+{
+    const __m512 vOffset = _mm512_set1_ps(offset);
+    const __m512 vScale = _mm512_set1_ps(scale);
+    const __m512 vBlank = _mm512_set1_ps(blank);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        const __m512 a = _mm512_loadu_ps(src + i);
+        const __m512 b = _mm512_loadu_ps(src + i + 16);
+        _mm512_storeu_ps(dst + i, blankOrNormalizeAVX512(a, vOffset, vScale, vBlank));
+        _mm512_storeu_ps(dst + i + 16, blankOrNormalizeAVX512(b, vOffset, vScale, vBlank));
+    }
+    normalizeScalar(src + i, dst + i, count - i, offset, scale, blank);
+}
+
+// SSE2 decoders. SSE2 has no byte shuffle, so byte swaps are built from shifts and word shuffles.
+
+PHITS_TARGET("sse2")
+static inline __m128i swap16SSE2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+PHITS_TARGET("sse2")
+static inline __m128i swap32SSE2(__m128i v)
+{
+    v = swap16SSE2(v);
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+}
+
+PHITS_TARGET("sse2")
+static inline __m128i swap64SSE2(__m128i v)
+{
+    return _mm_shuffle_epi32(swap32SSE2(v), 0xb1);
+}
+
+// Store four int32 as float, scaling in double precision if needed.
+PHITS_TARGET("sse2")
+static inline void storeInt32SSE2(float* dst, __m128i v, bool isScaled, __m128d vScale, __m128d vZero)
+{
+    if (!isScaled)
+    {
+        _mm_storeu_ps(dst, _mm_cvtepi32_ps(v));
+        return;
+    }
+    const __m128d lo = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(v), vScale), vZero);
+    const __m128d hi = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xee)), vScale), vZero);
+    _mm_storeu_ps(dst, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+}
+
+PHITS_TARGET("sse2")
+static void decodeByteSSE2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m128d vScale = _mm_set1_pd(bscale);
+    const __m128d vZero = _mm_set1_pd(bzero);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        storeInt32SSE2(dst + i, _mm_unpacklo_epi16(lo, zero), isScaled, vScale, vZero);
+        storeInt32SSE2(dst + i + 4, _mm_unpackhi_epi16(lo, zero), isScaled, vScale, vZero);
+        storeInt32SSE2(dst + i + 8, _mm_unpacklo_epi16(hi, zero), isScaled, vScale, vZero);
+        storeInt32SSE2(dst + i + 12, _mm_unpackhi_epi16(hi, zero), isScaled, vScale, vZero);
+    }
+    decodeByteScalar(p + i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("sse2")
+static void decodeShortSSE2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m128d vScale = _mm_set1_pd(bscale);
+    const __m128d vZero = _mm_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i v = swap16SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * i)));
+        // Sign-extend by placing each word in the top half of a dword and shifting it back down.
+        storeInt32SSE2(dst + i, _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16), isScaled, vScale, vZero);
+        storeInt32SSE2(dst + i + 4, _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16), isScaled, vScale, vZero);
+    }
+    decodeShortScalar(p + 2 * i, dst + i, count - i, bscale, bzero);
+}
+
+// toPhotoshop16() of four uint32.
+PHITS_TARGET("sse2")
+static inline __m128i toPhotoshop16SSE2(__m128i v)
+{
+    const __m128i x = _mm_add_epi32(_mm_slli_epi32(v, 15), _mm_set1_epi32(32767));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 16)), _mm_set1_epi32(1)), 16);
+}
+
+PHITS_TARGET("sse2")
+static void decodeShort16SSE2(const void* src, uint16_t* dst, size_t count)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i v = _mm_xor_si128(swap16SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * i))), bias);
+        const __m128i lo = toPhotoshop16SSE2(_mm_unpacklo_epi16(v, zero));
+        const __m128i hi = toPhotoshop16SSE2(_mm_unpackhi_epi16(v, zero));
+        // There's no unsigned pack before SSE4.1; sign-extend the words so that a signed pack keeps 32768.
+        const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16), _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    decodeShort16Scalar(p + 2 * i, dst + i, count - i);
+}
+
+PHITS_TARGET("sse2")
+static void decodeLongSSE2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m128d vScale = _mm_set1_pd(bscale);
+    const __m128d vZero = _mm_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i v = swap32SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4 * i)));
+        storeInt32SSE2(dst + i, v, isScaled, vScale, vZero);
+    }
+    decodeLongScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("sse2")
+static void decodeFloatSSE2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m128d vScale = _mm_set1_pd(bscale);
+    const __m128d vZero = _mm_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 f = _mm_castsi128_ps(swap32SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4 * i))));
+        if (!isScaled)
+        {
+            _mm_storeu_ps(dst + i, f);
+            continue;
+        }
+        const __m128d lo = _mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(f), vScale), vZero);
+        const __m128d hi = _mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(f, f)), vScale), vZero);
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+    }
+    decodeFloatScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("sse2")
+static void decodeDoubleSSE2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m128d vScale = _mm_set1_pd(bscale);
+    const __m128d vZero = _mm_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128d a = _mm_castsi128_pd(swap64SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8 * i))));
+        const __m128d b = _mm_castsi128_pd(swap64SSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8 * i + 16))));
+        const __m128 lo = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(a, vScale), vZero));
+        const __m128 hi = _mm_cvtpd_ps(_mm_add_pd(_mm_mul_pd(b, vScale), vZero));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(lo, hi));
+    }
+    decodeDoubleScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+// BLANK masks, for BITPIX 16 and 32. The comparison masks are widened to float lanes by interleaving.
+
+PHITS_TARGET("sse2")
+static void maskShortSSE2(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m128i vBlank = _mm_set1_epi16((short)getRaw16(blank));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i isBlank = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + 2 * i)), vBlank);
+        _mm_storeu_ps(dst + i, _mm_or_ps(_mm_loadu_ps(dst + i), _mm_castsi128_ps(_mm_unpacklo_epi16(isBlank, isBlank))));
+        _mm_storeu_ps(dst + i + 4, _mm_or_ps(_mm_loadu_ps(dst + i + 4), _mm_castsi128_ps(_mm_unpackhi_epi16(isBlank, isBlank))));
+    }
+    maskShortScalar(p + 2 * i, dst + i, count - i, blank);
+}
+
+PHITS_TARGET("sse2")
+static void maskLongSSE2(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m128i vBlank = _mm_set1_epi32((int)getRaw32(blank));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(p + 4 * i)), vBlank);
+        const __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(p + 4 * i + 16)), vBlank);
+        _mm_storeu_ps(dst + i, _mm_or_ps(_mm_loadu_ps(dst + i), _mm_castsi128_ps(a)));
+        _mm_storeu_ps(dst + i + 4, _mm_or_ps(_mm_loadu_ps(dst + i + 4), _mm_castsi128_ps(b)));
+    }
+    maskLongScalar(p + 4 * i, dst + i, count - i, blank);
+}
+
+// Scale, clamp and round four floats.
+PHITS_TARGET("sse2")
+static inline __m128i quantizeSSE2(const float* src, __m128 vScale, __m128 vOffset, __m128 lo, __m128 hi)
+{
+    const __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src), vScale), vOffset);
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, lo), hi));
+}
+
+PHITS_TARGET("sse2")
+static void encodeByteSSE2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m128 vScale = _mm_set1_ps((float)scale);
+    const __m128 vOffset = _mm_set1_ps((float)offset);
+    const __m128 lo = _mm_set1_ps(0.f);
+    const __m128 hi = _mm_set1_ps(255.f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i a = _mm_packs_epi32(quantizeSSE2(src + i, vScale, vOffset, lo, hi), quantizeSSE2(src + i + 4, vScale, vOffset, lo, hi));
+        const __m128i b = _mm_packs_epi32(quantizeSSE2(src + i + 8, vScale, vOffset, lo, hi), quantizeSSE2(src + i + 12, vScale, vOffset, lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
+    }
+    encodeByteScalar(src + i, dst + i, count - i, scale, offset);
+}
+
+PHITS_TARGET("sse2")
+static void encodeShortSSE2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m128 vScale = _mm_set1_ps((float)scale);
+    const __m128 vOffset = _mm_set1_ps((float)offset);
+    const __m128 lo = _mm_set1_ps(-32768.f);
+    const __m128 hi = _mm_set1_ps(32767.f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i v = _mm_packs_epi32(quantizeSSE2(src + i, vScale, vOffset, lo, hi), quantizeSSE2(src + i + 4, vScale, vOffset, lo, hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * i), swap16SSE2(v));
+    }
+    encodeShortScalar(src + i, dst + 2 * i, count - i, scale, offset);
+}
+
+PHITS_TARGET("sse2")
+static void encodeLongSSE2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m128d vScale = _mm_set1_pd(scale);
+    const __m128d vOffset = _mm_set1_pd(offset);
+    const __m128d lo = _mm_set1_pd(-2147483648.);
+    const __m128d hi = _mm_set1_pd(2147483647.);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 v = _mm_loadu_ps(src + i);
+        const __m128d a = _mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(v), vScale), vOffset);
+        const __m128d b = _mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), vScale), vOffset);
+        const __m128i ia = _mm_cvtpd_epi32(_mm_min_pd(_mm_max_pd(a, lo), hi));
+        const __m128i ib = _mm_cvtpd_epi32(_mm_min_pd(_mm_max_pd(b, lo), hi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), swap32SSE2(_mm_unpacklo_epi64(ia, ib)));
+    }
+    encodeLongScalar(src + i, dst + 4 * i, count - i, scale, offset);
+}
+
+// AVX2 decoders
+
+PHITS_TARGET("avx2")
+static inline void storeInt32AVX2(float* dst, __m256i v, bool isScaled, __m256d vScale, __m256d vZero)
+{
+    if (!isScaled)
+    {
+        _mm256_storeu_ps(dst, _mm256_cvtepi32_ps(v));
+        return;
+    }
+    const __m256d lo = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), vScale), vZero);
+    const __m256d hi = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), vScale), vZero);
+    _mm_storeu_ps(dst, _mm256_cvtpd_ps(lo));
+    _mm_storeu_ps(dst + 4, _mm256_cvtpd_ps(hi));
+}
+
+PHITS_TARGET("avx2")
+static void decodeByteAVX2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m256d vScale = _mm256_set1_pd(bscale);
+    const __m256d vZero = _mm256_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        storeInt32AVX2(dst + i, _mm256_cvtepu8_epi32(v), isScaled, vScale, vZero);
+        storeInt32AVX2(dst + i + 8, _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)), isScaled, vScale, vZero);
+    }
+    decodeByteScalar(p + i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("avx2")
+static void decodeShortAVX2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m256d vScale = _mm256_set1_pd(bscale);
+    const __m256d vZero = _mm256_set1_pd(bzero);
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2 * i)), swap);
+        storeInt32AVX2(dst + i, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)), isScaled, vScale, vZero);
+        storeInt32AVX2(dst + i + 8, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)), isScaled, vScale, vZero);
+    }
+    decodeShortScalar(p + 2 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("avx2")
+static inline __m256i toPhotoshop16AVX2(__m256i v)
+{
+    const __m256i x = _mm256_add_epi32(_mm256_slli_epi32(v, 15), _mm256_set1_epi32(32767));
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, _mm256_srli_epi32(x, 16)), _mm256_set1_epi32(1)), 16);
+}
+
+PHITS_TARGET("avx2")
+static void decodeShort16AVX2(const void* src, uint16_t* dst, size_t count)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i v = _mm256_xor_si256(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2 * i)), swap), bias);
+        const __m256i lo = toPhotoshop16AVX2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+        const __m256i hi = toPhotoshop16AVX2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+        // The pack works within 128-bit lanes; put the quadwords back in order.
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8));
+    }
+    decodeShort16Scalar(p + 2 * i, dst + i, count - i);
+}
+
+PHITS_TARGET("avx2")
+static void decodeLongAVX2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m256d vScale = _mm256_set1_pd(bscale);
+    const __m256d vZero = _mm256_set1_pd(bzero);
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 4 * i)), swap);
+        storeInt32AVX2(dst + i, v, isScaled, vScale, vZero);
+    }
+    decodeLongScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("avx2")
+static void decodeFloatAVX2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m256d vScale = _mm256_set1_pd(bscale);
+    const __m256d vZero = _mm256_set1_pd(bzero);
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 f = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 4 * i)), swap));
+        if (!isScaled)
+        {
+            _mm256_storeu_ps(dst + i, f);
+            continue;
+        }
+        const __m256d lo = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(f)), vScale), vZero);
+        const __m256d hi = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)), vScale), vZero);
+        _mm_storeu_ps(dst + i, _mm256_cvtpd_ps(lo));
+        _mm_storeu_ps(dst + i + 4, _mm256_cvtpd_ps(hi));
+    }
+    decodeFloatScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET("avx2")
+static void decodeDoubleAVX2(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m256d vScale = _mm256_set1_pd(bscale);
+    const __m256d vZero = _mm256_set1_pd(bzero);
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256d a = _mm256_castsi256_pd(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 8 * i)), swap));
+        const __m256d b = _mm256_castsi256_pd(_mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 8 * i + 32)), swap));
+        _mm_storeu_ps(dst + i, _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(a, vScale), vZero)));
+        _mm_storeu_ps(dst + i + 4, _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(b, vScale), vZero)));
+    }
+    decodeDoubleScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+// AVX2 BLANK masks
+
+PHITS_TARGET("avx2")
+static void maskShortAVX2(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m128i vBlank = _mm_set1_epi16((short)getRaw16(blank));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // Sign extension widens each all-ones 16-bit mask to 32 bits.
+        const __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + 2 * i)), vBlank);
+        const __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + 2 * i + 16)), vBlank);
+        _mm256_storeu_ps(dst + i, _mm256_or_ps(_mm256_loadu_ps(dst + i), _mm256_castsi256_ps(_mm256_cvtepi16_epi32(a))));
+        _mm256_storeu_ps(dst + i + 8, _mm256_or_ps(_mm256_loadu_ps(dst + i + 8), _mm256_castsi256_ps(_mm256_cvtepi16_epi32(b))));
+    }
+    maskShortScalar(p + 2 * i, dst + i, count - i, blank);
+}
+
+PHITS_TARGET("avx2")
+static void maskLongAVX2(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m256i vBlank = _mm256_set1_epi32((int)getRaw32(blank));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(p + 4 * i)), vBlank);
+        const __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(p + 4 * i + 32)), vBlank);
+        _mm256_storeu_ps(dst + i, _mm256_or_ps(_mm256_loadu_ps(dst + i), _mm256_castsi256_ps(a)));
+        _mm256_storeu_ps(dst + i + 8, _mm256_or_ps(_mm256_loadu_ps(dst + i + 8), _mm256_castsi256_ps(b)));
+    }
+    maskLongScalar(p + 4 * i, dst + i, count - i, blank);
+}
+
+// AVX2 encoders
+
+PHITS_TARGET("avx2")
+static inline __m256i quantizeAVX2(const float* src, __m256 vScale, __m256 vOffset, __m256 lo, __m256 hi)
+{
+    const __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src), vScale), vOffset);
+    return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(v, lo), hi));
+}
+
+PHITS_TARGET("avx2")
+static void encodeByteAVX2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m256 vScale = _mm256_set1_ps((float)scale);
+    const __m256 vOffset = _mm256_set1_ps((float)offset);
+    const __m256 lo = _mm256_set1_ps(0.f);
+    const __m256 hi = _mm256_set1_ps(255.f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // The pack works within 128-bit lanes; put the quadwords back in order before packing the halves.
+        const __m256i v = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(quantizeAVX2(src + i, vScale, vOffset, lo, hi), quantizeAVX2(src + i + 8, vScale, vOffset, lo, hi)), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+    encodeByteScalar(src + i, dst + i, count - i, scale, offset);
+}
+
+PHITS_TARGET("avx2")
+static void encodeShortAVX2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m256 vScale = _mm256_set1_ps((float)scale);
+    const __m256 vOffset = _mm256_set1_ps((float)offset);
+    const __m256 lo = _mm256_set1_ps(-32768.f);
+    const __m256 hi = _mm256_set1_ps(32767.f);
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i v = _mm256_permute4x64_epi64(
+            _mm256_packs_epi32(quantizeAVX2(src + i, vScale, vOffset, lo, hi), quantizeAVX2(src + i + 8, vScale, vOffset, lo, hi)), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 2 * i), _mm256_shuffle_epi8(v, swap));
+    }
+    encodeShortScalar(src + i, dst + 2 * i, count - i, scale, offset);
+}
+
+PHITS_TARGET("avx2")
+static void encodeLongAVX2(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const __m256d vScale = _mm256_set1_pd(scale);
+    const __m256d vOffset = _mm256_set1_pd(offset);
+    const __m256d lo = _mm256_set1_pd(-2147483648.);
+    const __m256d hi = _mm256_set1_pd(2147483647.);
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256d a = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(src + i)), vScale), vOffset);
+        const __m256d b = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(src + i + 4)), vScale), vOffset);
+        const __m128i ia = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(a, lo), hi));
+        const __m128i ib = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(b, lo), hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * i), _mm256_shuffle_epi8(_mm256_set_m128i(ib, ia), swap));
+    }
+    encodeLongScalar(src + i, dst + 4 * i, count - i, scale, offset);
+}
+
+// AVX-512 decoders
+
+PHITS_TARGET(PHITS_AVX512)
+static inline void storeInt32AVX512(float* dst, __m512i v, bool isScaled, __m512d vScale, __m512d vZero)
+{
+    if (!isScaled)
+    {
+        _mm512_storeu_ps(dst, _mm512_cvtepi32_ps(v));
+        return;
+    }
+    const __m512d lo = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(v)), vScale), vZero);
+    const __m512d hi = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(v, 1)), vScale), vZero);
+    _mm256_storeu_ps(dst, _mm512_cvtpd_ps(lo));
+    _mm256_storeu_ps(dst + 8, _mm512_cvtpd_ps(hi));
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeByteAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        storeInt32AVX512(dst + i, _mm512_cvtepu8_epi32(v), isScaled, vScale, vZero);
+    }
+    decodeByteScalar(p + i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeShortAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2 * i)), swap);
+        storeInt32AVX512(dst + i, _mm512_cvtepi16_epi32(v), isScaled, vScale, vZero);
+    }
+    decodeShortScalar(p + 2 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeLongAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m512i v = _mm512_shuffle_epi8(_mm512_loadu_si512(p + 4 * i), swap);
+        storeInt32AVX512(dst + i, v, isScaled, vScale, vZero);
+    }
+    decodeLongScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeLongLongAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m512d v = _mm512_cvtepi64_pd(_mm512_shuffle_epi8(_mm512_loadu_si512(p + 8 * i), swap));
+        _mm256_storeu_ps(dst + i, _mm512_cvtpd_ps(_mm512_add_pd(_mm512_mul_pd(v, vScale), vZero)));
+    }
+    decodeLongLongScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeFloatAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m512i v = _mm512_shuffle_epi8(_mm512_loadu_si512(p + 4 * i), swap);
+        if (!isScaled)
+        {
+            _mm512_storeu_si512(dst + i, v);
+            continue;
+        }
+        const __m512 f = _mm512_castsi512_ps(v);
+        const __m512d lo = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(f)), vScale), vZero);
+        const __m512d hi = _mm512_add_pd(_mm512_mul_pd(_mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(f), 1))), vScale), vZero);
+        _mm256_storeu_ps(dst + i, _mm512_cvtpd_ps(lo));
+        _mm256_storeu_ps(dst + i + 8, _mm512_cvtpd_ps(hi));
+    }
+    decodeFloatScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+PHITS_TARGET(PHITS_AVX512)
+static void decodeDoubleAVX512(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const __m512d vScale = _mm512_set1_pd(bscale);
+    const __m512d vZero = _mm512_set1_pd(bzero);
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m512d v = _mm512_castsi512_pd(_mm512_shuffle_epi8(_mm512_loadu_si512(p + 8 * i), swap));
+        _mm256_storeu_ps(dst + i, _mm512_cvtpd_ps(_mm512_add_pd(_mm512_mul_pd(v, vScale), vZero)));
+    }
+    decodeDoubleScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+static bool cpuSupports(const string& isa)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    if (isa == "sse2")
+    {
+        return (info[3] & (1 << 26)) != 0;
+    }
+    // AVX state must be enabled by the OS (OSXSAVE, and XCR0 bits 1 and 2).
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    const bool osAVX = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+    if (!avx || !osAVX || maxLeaf < 7)
+    {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    if (isa == "avx2")
+    {
+        return (info[1] & (1 << 5)) != 0;
+    }
+    if (isa == "avx512")
+    {
+        // F, DQ and BW; also requires the opmask and upper ZMM state (XCR0 bits 5-7).
+        const int bits = (1 << 16) | (1 << 17) | (1 << 30);
+        return (info[1] & bits) == bits && (_xgetbv(0) & 0xe0) == 0xe0;
+    }
+    return false;
+#else
+    __builtin_cpu_init();
+    if (isa == "sse2") return __builtin_cpu_supports("sse2");
+    if (isa == "avx2") return __builtin_cpu_supports("avx2");
+    if (isa == "avx512")
+    {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq");
+    }
+    return false;
+#endif
+}
+
+#endif // PHITS_X86
+
+#ifdef PHITS_NEON
+
+static void minMaxNEON(const float* src, size_t count, float& minVal, float& maxVal)
+{
+    float32x4_t lo0 = vdupq_n_f32(minVal), lo1 = lo0;
+    float32x4_t hi0 = vdupq_n_f32(maxVal), hi1 = hi0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        // Unlike vminq/vmaxq, vminnmq/vmaxnmq return the number when one operand is NaN.
+        float32x4_t a = vld1q_f32(src + i);
+        float32x4_t b = vld1q_f32(src + i + 4);
+        a = vaddq_f32(a, vsubq_f32(a, a));
+        b = vaddq_f32(b, vsubq_f32(b, b));
+        lo0 = vminnmq_f32(a, lo0);
+        hi0 = vmaxnmq_f32(a, hi0);
+        lo1 = vminnmq_f32(b, lo1);
+        hi1 = vmaxnmq_f32(b, hi1);
+    }
+    minVal = min(minVal, vminvq_f32(vminq_f32(lo0, lo1)));
+    maxVal = max(maxVal, vmaxvq_f32(vmaxq_f32(hi0, hi1)));
+    minMaxScalar(src + i, count - i, minVal, maxVal);
+}
+
+static inline float32x4_t blankOrNormalizeNEON(float32x4_t v, float32x4_t vOffset, float32x4_t vScale, float32x4_t vBlank)
+{
+    const uint32x4_t isFinite = vceqq_f32(vsubq_f32(v, v), vdupq_n_f32(0.f));
+    return vbslq_f32(isFinite, vmulq_f32(vaddq_f32(v, vOffset), vScale), vBlank);
+}
+
+static void normalizeNEON(const float* src, float* dst, size_t count, float offset, float scale, float blank)
+{
+    const float32x4_t vOffset = vdupq_n_f32(offset);
+    const float32x4_t vScale = vdupq_n_f32(scale);
+    const float32x4_t vBlank = vdupq_n_f32(blank);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const float32x4_t a = vld1q_f32(src + i);
+        const float32x4_t b = vld1q_f32(src + i + 4);
+        vst1q_f32(dst + i, blankOrNormalizeNEON(a, vOffset, vScale, vBlank));
+        vst1q_f32(dst + i + 4, blankOrNormalizeNEON(b, vOffset, vScale, vBlank));
+    }
+    normalizeScalar(src + i, dst + i, count - i, offset, scale, blank);
+}
+
+// Store four int32 as float, scaling in double precision if needed.
+static inline void storeInt32NEON(float* dst, int32x4_t v, bool isScaled, float64x2_t vScale, float64x2_t vZero)
+{
+    if (!isScaled)
+    {
+        vst1q_f32(dst, vcvtq_f32_s32(v));
+        return;
+    }
+    const float64x2_t lo = vaddq_f64(vmulq_f64(vcvtq_f64_s64(vmovl_s32(vget_low_s32(v))), vScale), vZero);
+    const float64x2_t hi = vaddq_f64(vmulq_f64(vcvtq_f64_s64(vmovl_high_s32(v)), vScale), vZero);
+    vst1q_f32(dst, vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+}
+
+static void decodeByteNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const uint16x8_t v = vmovl_u8(vld1_u8(p + i));
+        storeInt32NEON(dst + i, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(v))), isScaled, vScale, vZero);
+        storeInt32NEON(dst + i + 4, vreinterpretq_s32_u32(vmovl_high_u16(v)), isScaled, vScale, vZero);
+    }
+    decodeByteScalar(p + i, dst + i, count - i, bscale, bzero);
+}
+
+static void decodeShortNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const int16x8_t v = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(p + 2 * i)));
+        storeInt32NEON(dst + i, vmovl_s16(vget_low_s16(v)), isScaled, vScale, vZero);
+        storeInt32NEON(dst + i + 4, vmovl_high_s16(v), isScaled, vScale, vZero);
+    }
+    decodeShortScalar(p + 2 * i, dst + i, count - i, bscale, bzero);
+}
+
+static inline uint32x4_t toPhotoshop16NEON(uint32x4_t v)
+{
+    const uint32x4_t x = vaddq_u32(vshlq_n_u32(v, 15), vdupq_n_u32(32767));
+    return vshrq_n_u32(vaddq_u32(vaddq_u32(x, vshrq_n_u32(x, 16)), vdupq_n_u32(1)), 16);
+}
+
+static void decodeShort16NEON(const void* src, uint16_t* dst, size_t count)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint16x8_t bias = vdupq_n_u16(0x8000);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const uint16x8_t v = veorq_u16(vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(p + 2 * i))), bias);
+        const uint32x4_t lo = toPhotoshop16NEON(vmovl_u16(vget_low_u16(v)));
+        const uint32x4_t hi = toPhotoshop16NEON(vmovl_high_u16(v));
+        vst1q_u16(dst + i, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+    }
+    decodeShort16Scalar(p + 2 * i, dst + i, count - i);
+}
+
+static void decodeLongNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        storeInt32NEON(dst + i, vreinterpretq_s32_u8(vrev32q_u8(vld1q_u8(p + 4 * i))), isScaled, vScale, vZero);
+    }
+    decodeLongScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+static void decodeLongLongNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const float64x2_t a = vcvtq_f64_s64(vreinterpretq_s64_u8(vrev64q_u8(vld1q_u8(p + 8 * i))));
+        const float64x2_t b = vcvtq_f64_s64(vreinterpretq_s64_u8(vrev64q_u8(vld1q_u8(p + 8 * i + 16))));
+        const float32x2_t lo = vcvt_f32_f64(vaddq_f64(vmulq_f64(a, vScale), vZero));
+        vst1q_f32(dst + i, vcvt_high_f32_f64(lo, vaddq_f64(vmulq_f64(b, vScale), vZero)));
+    }
+    decodeLongLongScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+static void decodeFloatNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const bool isScaled = bscale != 1. || bzero != 0.;
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const float32x4_t f = vreinterpretq_f32_u8(vrev32q_u8(vld1q_u8(p + 4 * i)));
+        if (!isScaled)
+        {
+            vst1q_f32(dst + i, f);
+            continue;
+        }
+        const float64x2_t lo = vaddq_f64(vmulq_f64(vcvt_f64_f32(vget_low_f32(f)), vScale), vZero);
+        const float64x2_t hi = vaddq_f64(vmulq_f64(vcvt_high_f64_f32(f), vScale), vZero);
+        vst1q_f32(dst + i, vcvt_high_f32_f64(vcvt_f32_f64(lo), hi));
+    }
+    decodeFloatScalar(p + 4 * i, dst + i, count - i, bscale, bzero);
+}
+
+static void decodeDoubleNEON(const void* src, float* dst, size_t count, double bscale, double bzero)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const float64x2_t vScale = vdupq_n_f64(bscale);
+    const float64x2_t vZero = vdupq_n_f64(bzero);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const float64x2_t a = vreinterpretq_f64_u8(vrev64q_u8(vld1q_u8(p + 8 * i)));
+        const float64x2_t b = vreinterpretq_f64_u8(vrev64q_u8(vld1q_u8(p + 8 * i + 16)));
+        const float32x2_t lo = vcvt_f32_f64(vaddq_f64(vmulq_f64(a, vScale), vZero));
+        vst1q_f32(dst + i, vcvt_high_f32_f64(lo, vaddq_f64(vmulq_f64(b, vScale), vZero)));
+    }
+    decodeDoubleScalar(p + 8 * i, dst + i, count - i, bscale, bzero);
+}
+
+static void maskShortNEON(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint16x8_t vBlank = vdupq_n_u16(getRaw16(blank));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        // Sign extension widens each all-ones 16-bit mask to 32 bits.
+        const int16x8_t isBlank = vreinterpretq_s16_u16(vceqq_u16(vld1q_u16((const uint16_t*)(p + 2 * i)), vBlank));
+        const uint32x4_t a = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(isBlank)));
+        const uint32x4_t b = vreinterpretq_u32_s32(vmovl_high_s16(isBlank));
+        vst1q_f32(dst + i, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vld1q_f32(dst + i)), a)));
+        vst1q_f32(dst + i + 4, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vld1q_f32(dst + i + 4)), b)));
+    }
+    maskShortScalar(p + 2 * i, dst + i, count - i, blank);
+}
+
+static void maskLongNEON(const void* src, float* dst, size_t count, int64_t blank)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    const uint32x4_t vBlank = vdupq_n_u32(getRaw32(blank));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const uint32x4_t a = vceqq_u32(vld1q_u32((const uint32_t*)(p + 4 * i)), vBlank);
+        const uint32x4_t b = vceqq_u32(vld1q_u32((const uint32_t*)(p + 4 * i + 16)), vBlank);
+        vst1q_f32(dst + i, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vld1q_f32(dst + i)), a)));
+        vst1q_f32(dst + i + 4, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vld1q_f32(dst + i + 4)), b)));
+    }
+    maskLongScalar(p + 4 * i, dst + i, count - i, blank);
+}
+
+static inline int32x4_t quantizeNEON(const float* src, float32x4_t vScale, float32x4_t vOffset, float32x4_t lo, float32x4_t hi)
+{
+    const float32x4_t v = vaddq_f32(vmulq_f32(vld1q_f32(src), vScale), vOffset);
+    return vcvtnq_s32_f32(vminnmq_f32(vmaxnmq_f32(v, lo), hi));
+}
+
+static void encodeByteNEON(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const float32x4_t vScale = vdupq_n_f32((float)scale);
+    const float32x4_t vOffset = vdupq_n_f32((float)offset);
+    const float32x4_t lo = vdupq_n_f32(0.f);
+    const float32x4_t hi = vdupq_n_f32(255.f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const int16x8_t a = vcombine_s16(vqmovn_s32(quantizeNEON(src + i, vScale, vOffset, lo, hi)), vqmovn_s32(quantizeNEON(src + i + 4, vScale, vOffset, lo, hi)));
+        const int16x8_t b = vcombine_s16(vqmovn_s32(quantizeNEON(src + i + 8, vScale, vOffset, lo, hi)), vqmovn_s32(quantizeNEON(src + i + 12, vScale, vOffset, lo, hi)));
+        vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(a), vqmovun_s16(b)));
+    }
+    encodeByteScalar(src + i, dst + i, count - i, scale, offset);
+}
+
+static void encodeShortNEON(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const float32x4_t vScale = vdupq_n_f32((float)scale);
+    const float32x4_t vOffset = vdupq_n_f32((float)offset);
+    const float32x4_t lo = vdupq_n_f32(-32768.f);
+    const float32x4_t hi = vdupq_n_f32(32767.f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const int16x8_t v = vcombine_s16(vqmovn_s32(quantizeNEON(src + i, vScale, vOffset, lo, hi)), vqmovn_s32(quantizeNEON(src + i + 4, vScale, vOffset, lo, hi)));
+        vst1q_u8(dst + 2 * i, vrev16q_u8(vreinterpretq_u8_s16(v)));
+    }
+    encodeShortScalar(src + i, dst + 2 * i, count - i, scale, offset);
+}
+
+static void encodeLongNEON(const float* src, uint8_t* dst, size_t count, double scale, double offset)
+{
+    const float64x2_t vScale = vdupq_n_f64(scale);
+    const float64x2_t vOffset = vdupq_n_f64(offset);
+    const float64x2_t lo = vdupq_n_f64(-2147483648.);
+    const float64x2_t hi = vdupq_n_f64(2147483647.);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const float32x4_t v = vld1q_f32(src + i);
+        const float64x2_t a = vaddq_f64(vmulq_f64(vcvt_f64_f32(vget_low_f32(v)), vScale), vOffset);
+        const float64x2_t b = vaddq_f64(vmulq_f64(vcvt_high_f64_f32(v), vScale), vOffset);
+        const int32x2_t ia = vmovn_s64(vcvtnq_s64_f64(vminnmq_f64(vmaxnmq_f64(a, lo), hi)));
+        const int32x2_t ib = vmovn_s64(vcvtnq_s64_f64(vminnmq_f64(vmaxnmq_f64(b, lo), hi)));
+        vst1q_u8(dst + 4 * i, vrev32q_u8(vreinterpretq_u8_s32(vcombine_s32(ia, ib))));
+    }
+    encodeLongScalar(src + i, dst + 4 * i, count - i, scale, offset);
+}
+
+#endif // PHITS_NEON
+
+#define PHITS_SCALAR_DECODERS decodeByteScalar, decodeShortScalar, decodeLongScalar, decodeLongLongScalar, decodeFloatScalar, decodeDoubleScalar
+
+static const PhitsKernels kScalarKernels = { "scalar", minMaxScalar, normalizeScalar, PHITS_SCALAR_DECODERS, decodeShort16Scalar,
+    encodeByteScalar, encodeShortScalar, encodeLongScalar, maskByteScalar, maskShortScalar, maskLongScalar, maskLongLongScalar };
+#ifdef PHITS_X86
+// There's no packed int64 to double conversion before AVX-512DQ, so 64-bit integers use the scalar decoder.
+// AVX-512 has nothing to add to the AVX2 16-bit decoder, integer encoders and BLANK masks, which are bound by
+// memory anyway. BLANK is rare in byte and 64-bit images, which are left to the scalar masks.
+static const PhitsKernels kSSE2Kernels = { "sse2", minMaxSSE2, normalizeSSE2,
+    decodeByteSSE2, decodeShortSSE2, decodeLongSSE2, decodeLongLongScalar, decodeFloatSSE2, decodeDoubleSSE2, decodeShort16SSE2,
+    encodeByteSSE2, encodeShortSSE2, encodeLongSSE2, maskByteScalar, maskShortSSE2, maskLongSSE2, maskLongLongScalar };
+static const PhitsKernels kAVX2Kernels = { "avx2", minMaxAVX2, normalizeAVX2,
+    decodeByteAVX2, decodeShortAVX2, decodeLongAVX2, decodeLongLongScalar, decodeFloatAVX2, decodeDoubleAVX2, decodeShort16AVX2,
+    encodeByteAVX2, encodeShortAVX2, encodeLongAVX2, maskByteScalar, maskShortAVX2, maskLongAVX2, maskLongLongScalar };
+static const PhitsKernels kAVX512Kernels = { "avx512", minMaxAVX512, normalizeAVX512,
+    decodeByteAVX512, decodeShortAVX512, decodeLongAVX512, decodeLongLongAVX512, decodeFloatAVX512, decodeDoubleAVX512, decodeShort16AVX2,
+    encodeByteAVX2, encodeShortAVX2, encodeLongAVX2, maskByteScalar, maskShortAVX2, maskLongAVX2, maskLongLongScalar };
+#endif
+#ifdef PHITS_NEON
+static const PhitsKernels kNEONKernels = { "neon", minMaxNEON, normalizeNEON,
+    decodeByteNEON, decodeShortNEON, decodeLongNEON, decodeLongLongNEON, decodeFloatNEON, decodeDoubleNEON, decodeShort16NEON,
+    encodeByteNEON, encodeShortNEON, encodeLongNEON, maskByteScalar, maskShortNEON, maskLongNEON, maskLongLongScalar };
+#endif
+
+static const PhitsKernels& selectKernels()
+{
+    const string requested = PhitsSettings().kernels;
+    const bool any = requested.empty();
+#ifdef PHITS_X86
+    // Candidates from most to least capable; a request selects that set if the CPU supports it.
+    if ((any || requested == "avx512") && cpuSupports("avx512")) return kAVX512Kernels;
+    if ((any || requested == "avx512" || requested == "avx2") && cpuSupports("avx2")) return kAVX2Kernels;
+    if (requested != "scalar" && cpuSupports("sse2")) return kSSE2Kernels;
+#endif
+#ifdef PHITS_NEON
+    if (requested != "scalar") return kNEONKernels;
+#endif
+    return kScalarKernels;
+}
+
+const PhitsKernels& getPhitsKernels()
+{
+    static const PhitsKernels& kernels = selectKernels();
+    return kernels;
+}
+
+const PhitsKernels& getPhitsScalarKernels()
+{
+    return kScalarKernels;
+}
+
+vector<const PhitsKernels*> getPhitsSupportedKernels()
+{
+    vector<const PhitsKernels*> kernels = { &kScalarKernels };
+#ifdef PHITS_X86
+    if (cpuSupports("sse2")) kernels.push_back(&kSSE2Kernels);
+    if (cpuSupports("avx2")) kernels.push_back(&kAVX2Kernels);
+    if (cpuSupports("avx512")) kernels.push_back(&kAVX512Kernels);
+#endif
+#ifdef PHITS_NEON
+    kernels.push_back(&kNEONKernels);
+#endif
+    return kernels;
+}
+
+PhitsDecodeKernel getDecodeKernel(const PhitsKernels& kernels, int bitpix)
+{
+    switch (bitpix)
+    {
+        case 8:
+            return kernels.decodeByte;
+        case 16:
+            return kernels.decodeShort;
+        case 32:
+            return kernels.decodeLong;
+        case 64:
+            return kernels.decodeLongLong;
+        case -32:
+            return kernels.decodeFloat;
+        case -64:
+            return kernels.decodeDouble;
+        default:
+            return nullptr;
+    }
+}
+
+PhitsEncodeKernel getEncodeKernel(const PhitsKernels& kernels, int bitpix)
+{
+    switch (bitpix)
+    {
+        case 8:
+            return kernels.encodeByte;
+        case 16:
+            return kernels.encodeShort;
+        case 32:
+            return kernels.encodeLong;
+        default:
+            return nullptr;
+    }
+}
+
+PhitsMaskKernel getMaskKernel(const PhitsKernels& kernels, int bitpix)
+{
+    switch (bitpix)
+    {
+        case 8:
+            return kernels.maskByte;
+        case 16:
+            return kernels.maskShort;
+        case 32:
+            return kernels.maskLong;
+        case 64:
+            return kernels.maskLongLong;
+        default:
+            return nullptr;
+    }
+}
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSKERNELS_H_
+#define _PHITSKERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Convert count big-endian FITS samples at src to float, as (float)(value * bscale + bzero).
+typedef void (*PhitsDecodeKernel)(const void* src, float* dst, size_t count, double bscale, double bzero);
+
+// Convert count floats at src to big-endian FITS integers at dst, as round(src[i] * scale + offset), clamped
+// to the range of the type. Rounding is to nearest, ties to even; NaN is stored as the bottom of the range.
+// 8- and 16-bit values are computed in single precision, and 32-bit values in double precision.
+typedef void (*PhitsEncodeKernel)(const float* src, uint8_t* dst, size_t count, double scale, double offset);
+
+// Make dst[i] a NaN wherever the big-endian integer sample at src[i] equals blank, which must be within the
+// range of the type (see PhitsFitsHeader::getBlank()). dst holds the samples already decoded.
+typedef void (*PhitsMaskKernel)(const void* src, float* dst, size_t count, int64_t blank);
+
+// Map an unsigned 16-bit value to Photoshop's 16-bit range, 0..32768, as round(value * 32768 / 65535). The
+// division by 65535 is done with shifts, which is exact for all 16-bit values, so that vector kernels can
+// do the same.
+static inline uint16_t toPhotoshop16(uint32_t value)
+{
+    const uint32_t x = (value << 15) + 32767;
+    return (uint16_t)((x + (x >> 16) + 1) >> 16);
+}
+
+// The inverse of toPhotoshop16(), exact for every value in 0..32768.
+static inline uint16_t fromPhotoshop16(uint32_t value)
+{
+    return (uint16_t)((value * 65535 + 16384) >> 15);
+}
+
+// Inner loops for pixel statistics and conversion. Each kernel has a scalar reference version and, where
+// the platform allows, SSE2/AVX2/AVX-512 (x86) or NEON (ARM) versions. The fastest set supported by the
+// running CPU is chosen once, at first use.
+struct PhitsKernels
+{
+    const char* name;
+
+    // Widen [minVal, maxVal] to include the finite values among the count values at src. NaNs and
+    // infinities are ignored.
+    void (*minMax)(const float* src, size_t count, float& minVal, float& maxVal);
+
+    // dst[i] = (src[i] + offset) * scale, or blank where src[i] is NaN or infinite. src and dst may be the
+    // same buffer.
+    void (*normalize)(const float* src, float* dst, size_t count, float offset, float scale, float blank);
+
+    // Decoders for each supported BITPIX.
+    PhitsDecodeKernel decodeByte;
+    PhitsDecodeKernel decodeShort;
+    PhitsDecodeKernel decodeLong;
+    PhitsDecodeKernel decodeLongLong;
+    PhitsDecodeKernel decodeFloat;
+    PhitsDecodeKernel decodeDouble;
+
+    // Convert count big-endian BITPIX 16 samples at src to Photoshop 16-bit values, as
+    // toPhotoshop16(sample + 32768). BZERO and BSCALE don't enter into it: only the offset is changed.
+    void (*decodeShort16)(const void* src, uint16_t* dst, size_t count);
+
+    // Encoders for integer BITPIX 8, 16 and 32.
+    PhitsEncodeKernel encodeByte;
+    PhitsEncodeKernel encodeShort;
+    PhitsEncodeKernel encodeLong;
+
+    // BLANK masks for integer BITPIX 8, 16, 32 and 64.
+    PhitsMaskKernel maskByte;
+    PhitsMaskKernel maskShort;
+    PhitsMaskKernel maskLong;
+    PhitsMaskKernel maskLongLong;
+};
+
+// Decoder for the given BITPIX, or nullptr if it is not supported.
+PhitsDecodeKernel getDecodeKernel(const PhitsKernels& kernels, int bitpix);
+
+// Encoder for the given integer BITPIX, or nullptr if it is not supported.
+PhitsEncodeKernel getEncodeKernel(const PhitsKernels& kernels, int bitpix);
+
+// BLANK mask for the given integer BITPIX, or nullptr if it is not supported.
+PhitsMaskKernel getMaskKernel(const PhitsKernels& kernels, int bitpix);
+
+// Kernels selected for this CPU. The PHITS_KERNELS environment variable (scalar, sse2, avx2, avx512, neon)
+// can be used to force a less capable set, e.g. to verify results against the scalar reference.
+const PhitsKernels& getPhitsKernels();
+
+// Scalar reference kernels.
+const PhitsKernels& getPhitsScalarKernels();
+
+// Every set the running CPU supports, the scalar reference first, whatever PHITS_KERNELS says; for tests.
+std::vector<const PhitsKernels*> getPhitsSupportedKernels();
+
+#endif // _PHITSKERNELS_H_
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsMappedFile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+PhitsMappedFile::~PhitsMappedFile()
+{
+    unmap();
+}
+
+#ifdef _WIN32
+
+bool PhitsMappedFile::map(int fd)
+{
+    unmap();
+    HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+    LARGE_INTEGER size;
+    if (hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+    {
+        return false;
+    }
+    m_hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_hMapping == nullptr)
+    {
+        return false;
+    }
+    m_pData = static_cast<const uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_pData == nullptr)
+    {
+        unmap();
+        return false;
+    }
+    m_size = (uint64_t)size.QuadPart;
+    return true;
+}
+
+void PhitsMappedFile::prefetch(uint64_t offset, uint64_t size) const
+{
+    if (m_pData == nullptr || offset >= m_size)
+    {
+        return;
+    }
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = const_cast<uint8_t*>(m_pData + offset);
+    range.NumberOfBytes = (SIZE_T)(size < m_size - offset ? size : m_size - offset);
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+void PhitsMappedFile::unmap()
+{
+    if (m_pData != nullptr)
+    {
+        UnmapViewOfFile(m_pData);
+    }
+    if (m_hMapping != nullptr)
+    {
+        CloseHandle(m_hMapping);
+    }
+    m_pData = nullptr;
+    m_hMapping = nullptr;
+    m_size = 0;
+}
+
+#else
+
+bool PhitsMappedFile::map(int fd)
+{
+    unmap();
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        return false;
+    }
+    void* pData = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pData == MAP_FAILED)
+    {
+        return false;
+    }
+    m_pData = static_cast<const uint8_t*>(pData);
+    m_size = (uint64_t)st.st_size;
+    return true;
+}
+
+void PhitsMappedFile::prefetch(uint64_t offset, uint64_t size) const
+{
+    if (m_pData == nullptr || offset >= m_size)
+    {
+        return;
+    }
+    // madvise() wants a page-aligned start address.
+    static const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t begin = offset / pageSize * pageSize;
+    const uint64_t end = offset + size < m_size ? offset + size : m_size;
+    madvise(const_cast<uint8_t*>(m_pData + begin), (size_t)(end - begin), MADV_WILLNEED);
+}
+
+void PhitsMappedFile::unmap()
+{
+    if (m_pData != nullptr)
+    {
+        munmap(const_cast<uint8_t*>(m_pData), (size_t)m_size);
+    }
+    m_pData = nullptr;
+    m_size = 0;
+}
+
+#endif
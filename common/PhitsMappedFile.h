@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSMAPPEDFILE_H_
+#define _PHITSMAPPEDFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only memory mapping of an entire file, given a file descriptor owned by the caller (on Windows,
+// a CRT descriptor as returned by _open_osfhandle()). The descriptor is not closed by the mapping.
+class PhitsMappedFile
+{
+public:
+    PhitsMappedFile() {}
+    ~PhitsMappedFile();
+    PhitsMappedFile(const PhitsMappedFile&) = delete;
+    PhitsMappedFile& operator=(const PhitsMappedFile&) = delete;
+
+    // Map the file; returns false if the file is empty or cannot be mapped.
+    bool map(int fd);
+    void unmap();
+
+    // Hint that [offset, offset + size) will be read soon, so that the OS can start paging it in.
+    void prefetch(uint64_t offset, uint64_t size) const;
+
+    const uint8_t* getData() const { return m_pData; }
+    uint64_t getSize() const { return m_size; }
+
+private:
+    const uint8_t* m_pData = nullptr;
+    uint64_t m_size = 0;
+#ifdef _WIN32
+    void* m_hMapping = nullptr;
+#endif
+};
+
+#endif // _PHITSMAPPEDFILE_H_
@@ -6,21 +6,23 @@
 #ifndef _PHITSMETADATA_H_
 #define _PHITSMETADATA_H_
 
-#include <map>
 #include <string>
+#include <vector>
 #include <stdint.h>
-#include <CCfits/CCfits>
+#include "PhitsStretch.h"
 
 struct PhitsMetadata
 {
-    std::map<CCfits::String, CCfits::Keyword*> keywordMap;
+    std::vector<std::string> cards;     // Header cards of the image HDU, in file order, up to but not including END
     int32_t bitpix = 0;
     std::vector<std::string> extensionNames;
-    float bzero = 0.f;
-    float bscale = 1.f;
+    double bzero = 0.;
+    double bscale = 1.;
     uint32_t inputDepth = 0;
     bool isNormalized = false;
+    PhitsStretch stretch;           // Normalization applied to float pixels when they were read, if isNormalized
     bool isConverted = false;
+    bool isGzipped = false;         // Input was a gzipped (.fits.gz) file
 };
 
 #endif // _PHITSMETADATA_H_
@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsMetadataStore.h"
+#include "PhitsEndian.h"
+#include "PhitsSettings.h"
+#include <string.h>
+
+using namespace std;
+
+// Resource layout, all big-endian: magic, version, id, the scalar fields, then the cards and the extension
+// names, each as a count followed by length-prefixed strings.
+static const uint32_t kMagic = 0x50484d44;  // 'PHMD'
+static const uint32_t kVersion = 3;
+
+static const uint32_t kNormalizedFlag = 1;
+static const uint32_t kConvertedFlag = 2;
+static const uint32_t kGzippedFlag = 4;
+static const uint32_t kClippedFlag = 8;
+
+// Approximate heap footprint of metadata.
+static uint64_t getMetadataBytes(const PhitsMetadata& meta)
+{
+    uint64_t bytes = sizeof(PhitsMetadata);
+    for (const string& card : meta.cards)
+    {
+        bytes += sizeof(string) + card.capacity();
+    }
+    for (const string& name : meta.extensionNames)
+    {
+        bytes += sizeof(string) + name.capacity();
+    }
+    return bytes;
+}
+
+static void putUInt32(vector<uint8_t>& data, uint32_t value)
+{
+    data.resize(data.size() + 4);
+    storeBE32(data.data() + data.size() - 4, value);
+}
+
+static void putDouble(vector<uint8_t>& data, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    data.resize(data.size() + 8);
+    storeBE64(data.data() + data.size() - 8, bits);
+}
+
+static void putStrings(vector<uint8_t>& data, const vector<string>& strings)
+{
+    putUInt32(data, (uint32_t)strings.size());
+    for (const string& str : strings)
+    {
+        putUInt32(data, (uint32_t)str.size());
+        data.insert(data.end(), str.begin(), str.end());
+    }
+}
+
+// Reads from serialized data, failing (rather than overrunning) if the data is short.
+class MetadataParser
+{
+public:
+    MetadataParser(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+    bool getUInt32(uint32_t& value)
+    {
+        if (m_size - m_pos < 4)
+        {
+            return false;
+        }
+        value = loadBE32(m_data + m_pos);
+        m_pos += 4;
+        return true;
+    }
+
+    bool getUInt64(uint64_t& value)
+    {
+        if (m_size - m_pos < 8)
+        {
+            return false;
+        }
+        value = loadBE64(m_data + m_pos);
+        m_pos += 8;
+        return true;
+    }
+
+    bool getDouble(double& value)
+    {
+        uint64_t bits = 0;
+        if (!getUInt64(bits))
+        {
+            return false;
+        }
+        memcpy(&value, &bits, sizeof(value));
+        return true;
+    }
+
+    bool getStrings(vector<string>& strings)
+    {
+        uint32_t count = 0;
+        if (!getUInt32(count) || count > (m_size - m_pos) / 4)
+        {
+            return false;
+        }
+        strings.reserve(count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint32_t len = 0;
+            if (!getUInt32(len) || len > m_size - m_pos)
+            {
+                return false;
+            }
+            strings.emplace_back(reinterpret_cast<const char*>(m_data + m_pos), len);
+            m_pos += len;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_pos = 0;
+};
+
+PhitsMetadataStore& PhitsMetadataStore::get()
+{
+    // Never destroyed, for the same reason as the thread pool: nothing here needs to run at unload.
+    static PhitsMetadataStore* pStore = new PhitsMetadataStore;
+    return *pStore;
+}
+
+PhitsMetadataStore::PhitsMetadataStore()
+    : m_maxBytes((uint64_t)PhitsSettings().metadataCache << 20)
+    , m_random(random_device()())
+{
+}
+
+size_t PhitsMetadataStore::getCount() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+void PhitsMetadataStore::keep(uint64_t id, shared_ptr<const PhitsMetadata> pMeta)
+{
+    const uint64_t bytes = getMetadataBytes(*pMeta);
+    m_entries.push_front({ id, move(pMeta), bytes });
+    m_liveBytes += bytes;
+    // The newest entry is always kept, however large.
+    while (m_entries.size() > 1 && m_liveBytes > m_maxBytes)
+    {
+        m_liveBytes -= m_entries.back().bytes;
+        m_entries.pop_back();
+    }
+}
+
+vector<uint8_t> PhitsMetadataStore::add(shared_ptr<const PhitsMetadata> pMeta)
+{
+    const PhitsMetadata& meta = *pMeta;
+    vector<uint8_t> data;
+    data.reserve(96 + meta.cards.size() * (4 + 80));
+    putUInt32(data, kMagic);
+    putUInt32(data, kVersion);
+
+    lock_guard<mutex> lock(m_mutex);
+    const uint64_t id = m_random();
+    data.resize(data.size() + 8);
+    storeBE64(data.data() + data.size() - 8, id);
+
+    putUInt32(data, (uint32_t)meta.bitpix);
+    putDouble(data, meta.bzero);
+    putDouble(data, meta.bscale);
+    putUInt32(data, (uint32_t)meta.stretch.mode);
+    putDouble(data, meta.stretch.low);
+    putDouble(data, meta.stretch.high);
+    putDouble(data, meta.stretch.param);
+    putUInt32(data, meta.inputDepth);
+    putUInt32(data, (meta.isNormalized ? kNormalizedFlag : 0) | (meta.isConverted ? kConvertedFlag : 0) | (meta.isGzipped ? kGzippedFlag : 0) |
+                    (meta.stretch.isClipped ? kClippedFlag : 0));
+    putStrings(data, meta.cards);
+    putStrings(data, meta.extensionNames);
+
+    keep(id, move(pMeta));
+    return data;
+}
+
+shared_ptr<const PhitsMetadata> PhitsMetadataStore::find(const uint8_t* data, size_t size)
+{
+    MetadataParser parser(data, size);
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t id = 0;
+    if (!parser.getUInt32(magic) || magic != kMagic || !parser.getUInt32(version) || version != kVersion ||
+        !parser.getUInt64(id))
+    {
+        return nullptr;
+    }
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if (it->id == id)
+            {
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                return m_entries.front().pMeta;
+            }
+        }
+    }
+
+    shared_ptr<PhitsMetadata> pMeta = make_shared<PhitsMetadata>();
+    uint32_t bitpix = 0;
+    uint32_t flags = 0;
+    PhitsStretch& stretch = pMeta->stretch;
+    uint32_t mode = 0;
+    const bool hasScalars = parser.getUInt32(bitpix) && parser.getDouble(pMeta->bzero) && parser.getDouble(pMeta->bscale) &&
+                            parser.getUInt32(mode) && parser.getDouble(stretch.low) && parser.getDouble(stretch.high) &&
+                            parser.getDouble(stretch.param) && mode <= (uint32_t)PhitsStretch::Mode::Mtf;
+    stretch.mode = (PhitsStretch::Mode)mode;
+    if (!hasScalars || !parser.getUInt32(pMeta->inputDepth) || !parser.getUInt32(flags) || !parser.getStrings(pMeta->cards) ||
+        !parser.getStrings(pMeta->extensionNames))
+    {
+        return nullptr;
+    }
+    pMeta->bitpix = (int32_t)bitpix;
+    pMeta->isNormalized = (flags & kNormalizedFlag) != 0;
+    pMeta->isConverted = (flags & kConvertedFlag) != 0;
+    pMeta->isGzipped = (flags & kGzippedFlag) != 0;
+    stretch.isClipped = (flags & kClippedFlag) != 0;
+
+    lock_guard<mutex> lock(m_mutex);
+    keep(id, pMeta);
+    return pMeta;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSMETADATASTORE_H_
+#define _PHITSMETADATASTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "PhitsMetadata.h"
+
+// Metadata of the documents we've read. Each document's metadata is serialized into the image resource
+// attached to it, which the host owns and disposes of along with the document, so nothing we allocate has
+// to outlive it. Parsed copies are kept here, most recently used first, so that saving doesn't have to
+// parse the resource again; the oldest are evicted once they hold more than a set number of bytes. Like
+// the header cache, the store outlives PhitsPlugin, which is deleted at the end of every phase.
+class PhitsMetadataStore
+{
+public:
+    static PhitsMetadataStore& get();
+
+    // Serialize metadata for a document's resource, and keep it for find().
+    std::vector<uint8_t> add(std::shared_ptr<const PhitsMetadata> pMeta);
+
+    // Metadata serialized by add(): the copy kept here, if it hasn't been evicted, and otherwise one parsed
+    // from the data, which is kept in turn. Returns nullptr if the data isn't metadata we serialized.
+    std::shared_ptr<const PhitsMetadata> find(const uint8_t* data, size_t size);
+
+    // Bytes held by the metadata kept here, and the number of documents it belongs to.
+    uint64_t getLiveBytes() const { return m_liveBytes; }
+    size_t getCount() const;
+
+private:
+    struct Entry
+    {
+        uint64_t id;
+        std::shared_ptr<const PhitsMetadata> pMeta;
+        uint64_t bytes;
+    };
+
+    PhitsMetadataStore();
+
+    // Must be called with m_mutex held.
+    void keep(uint64_t id, std::shared_ptr<const PhitsMetadata> pMeta);
+
+    mutable std::mutex m_mutex;
+    std::list<Entry> m_entries;         // Most recently used first
+    std::atomic<uint64_t> m_liveBytes{ 0 };
+    uint64_t m_maxBytes;
+    // Ids are random, so that a resource saved with a document in one session (e.g. in a PSD) can't be
+    // taken for another document's in the next.
+    std::mt19937_64 m_random;
+};
+
+#endif // _PHITSMETADATASTORE_H_
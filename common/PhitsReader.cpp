@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsReader.h"
+#include "PhitsKernels.h"
+#include "PhitsThreadPool.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+using namespace CCfits;
+
+// Samples per parallel decode task.
+static const size_t kDecodeGrain = 64 * 1024;
+
+PhitsCCfitsReader::PhitsCCfitsReader(PHDU& hdu, uint32_t width, uint32_t height, uint32_t depth)
+    : m_hdu(hdu)
+    , m_width(width)
+    , m_height(height)
+    , m_depth(depth)
+{
+}
+
+void PhitsCCfitsReader::readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst)
+{
+    // PHDU::read() only reads into a valarray, so this costs an extra copy.
+    const long first = (long)plane * m_width * m_height + (long)row * m_width + 1;
+    const size_t count = (size_t)rows * m_width;
+    if (m_depth == 8)
+    {
+        m_hdu.read(m_byteBand, first, (long)count);
+        memcpy(dst, &m_byteBand[0], count);
+    }
+    else if (m_depth == 16)
+    {
+        // cfitsio has applied BZERO, and BSCALE is one; take BZERO off again to recover the stored values.
+        m_hdu.read(m_floatBand, first, (long)count);
+        const float bzero = (float)m_hdu.zero();
+        uint16_t* sp = static_cast<uint16_t*>(dst);
+        for (size_t i = 0; i < count; ++i)
+        {
+            sp[i] = toPhotoshop16((uint32_t)((int32_t)(m_floatBand[i] - bzero) + 32768));
+        }
+    }
+    else
+    {
+        // Have cfitsio check for BLANK, making those pixels NaN, as they are in float images.
+        float nullValue = NAN;
+        m_hdu.read(m_floatBand, first, (long)count, &nullValue);
+        memcpy(dst, &m_floatBand[0], count * sizeof(float));
+    }
+}
+
+unique_ptr<PhitsMappedReader> PhitsMappedReader::create(int fd, uint32_t depth, shared_ptr<const PhitsFitsHeader> pHeader,
+                                                       uint64_t headerOffset)
+{
+    if (!pHeader || pHeader->isPrimary() != (headerOffset == 0) || pHeader->getHeaderSize() == 0 ||
+        (pHeader->getNaxis() != 2 && pHeader->getNaxis() != 3))
+    {
+        return nullptr;
+    }
+    const PhitsFitsHeader& header = *pHeader;
+    // Leave random groups and anything with an unusual data layout to cfitsio.
+    bool isSimple = false;
+    string xtension;
+    const bool isImage = header.isPrimary() ? header.getBool("SIMPLE", isSimple) && isSimple
+                                            : header.getString("XTENSION", xtension) && xtension == "IMAGE";
+    if (!isImage || header.hasKey("GROUPS") || header.getIntValue("PCOUNT", 0) != 0 || header.getIntValue("GCOUNT", 1) != 1)
+    {
+        return nullptr;
+    }
+
+    unique_ptr<PhitsMappedReader> pReader(new PhitsMappedReader);
+    if (!pReader->m_file.map(fd))
+    {
+        return nullptr;
+    }
+    pReader->m_dataOffset = headerOffset + header.getHeaderSize();
+    if (pReader->m_dataOffset + header.getDataSize() > pReader->m_file.getSize())
+    {
+        return nullptr;
+    }
+
+    pReader->m_pHeader = pHeader;
+    pReader->m_width = (uint32_t)header.getAxis(0);
+    pReader->m_height = (uint32_t)header.getAxis(1);
+    pReader->m_depth = depth;
+    pReader->m_bscale = header.getDoubleValue("BSCALE", 1.);
+    pReader->m_bzero = header.getDoubleValue("BZERO", 0.);
+    if ((depth == 8 && (header.getBitpix() != 8 || pReader->m_bscale != 1. || pReader->m_bzero != 0.)) ||
+        (depth == 16 && (header.getBitpix() != 16 || pReader->m_bscale != 1.)))
+    {
+        return nullptr;
+    }
+    pReader->m_hasBlank = header.getBlank(pReader->m_blank);
+    return pReader;
+}
+
+void PhitsMappedReader::prefetchRows(uint32_t plane, uint32_t row, uint32_t rows)
+{
+    const size_t sampleBytes = abs(m_pHeader->getBitpix()) / 8;
+    const uint64_t firstSample = (uint64_t)plane * m_width * m_height + (uint64_t)row * m_width;
+    m_file.prefetch(m_dataOffset + firstSample * sampleBytes, (uint64_t)rows * m_width * sampleBytes);
+}
+
+void PhitsMappedReader::readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst)
+{
+    const int bitpix = m_pHeader->getBitpix();
+    const size_t sampleBytes = abs(bitpix) / 8;
+    const uint64_t firstSample = (uint64_t)plane * m_width * m_height + (uint64_t)row * m_width;
+    const uint8_t* src = m_file.getData() + m_dataOffset + firstSample * sampleBytes;
+    const size_t count = (size_t)rows * m_width;
+
+    if (m_depth == 8)
+    {
+        memcpy(dst, src, count);
+        return;
+    }
+    if (m_depth == 16)
+    {
+        const PhitsKernels& kernels = getPhitsKernels();
+        uint16_t* sp = static_cast<uint16_t*>(dst);
+        PhitsThreadPool::get().parallelFor(count, kDecodeGrain, [&](size_t begin, size_t end)
+        {
+            kernels.decodeShort16(src + begin * 2, sp + begin, end - begin);
+        });
+        return;
+    }
+
+    // BLANK samples are masked as each chunk is decoded, while it's still in cache.
+    const PhitsDecodeKernel decode = getDecodeKernel(getPhitsKernels(), bitpix);
+    const PhitsMaskKernel mask = m_hasBlank ? getMaskKernel(getPhitsKernels(), bitpix) : nullptr;
+    float* fp = static_cast<float*>(dst);
+    const double bscale = m_bscale;
+    const double bzero = m_bzero;
+    const int64_t blank = m_blank;
+    PhitsThreadPool::get().parallelFor(count, kDecodeGrain, [&](size_t begin, size_t end)
+    {
+        decode(src + begin * sampleBytes, fp + begin, end - begin, bscale, bzero);
+        if (mask != nullptr)
+        {
+            mask(src + begin * sampleBytes, fp + begin, end - begin, blank);
+        }
+    });
+}
+
+PhitsChannelReader::PhitsChannelReader(vector<unique_ptr<PhitsImageReader>> channels)
+    : m_channels(move(channels))
+{
+}
+
+void PhitsChannelReader::readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst)
+{
+    m_channels[plane]->readRows(0, row, rows, dst);
+}
+
+void PhitsChannelReader::prefetchRows(uint32_t plane, uint32_t row, uint32_t rows)
+{
+    m_channels[plane]->prefetchRows(0, row, rows);
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSREADER_H_
+#define _PHITSREADER_H_
+
+#include <stdint.h>
+#include <memory>
+#include <valarray>
+#include <vector>
+#include <CCfits/CCfits>
+#include "PhitsFitsHeader.h"
+#include "PhitsMappedFile.h"
+
+// Source of image rows for readContinue(). Rows are delivered at the editing depth: 8-bit samples for
+// unscaled byte images, 16-bit samples (see toPhotoshop16()) for 16-bit images read in 16-bit mode, and
+// floats (with BSCALE/BZERO applied, but not normalized) otherwise. Float rows have NaN for undefined
+// pixels, including integer samples equal to BLANK.
+class PhitsImageReader
+{
+public:
+    virtual ~PhitsImageReader() {}
+
+    // Read rows [row, row + rows) of the given plane into dst, which holds rows * width samples.
+    virtual void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) = 0;
+
+    // Hint that the given rows will be read soon. Readers that can't make use of the hint ignore it.
+    virtual void prefetchRows(uint32_t plane, uint32_t row, uint32_t rows) {}
+
+    // True if rows are only read efficiently in file order, i.e. one plane after another.
+    virtual bool isSequential() const { return false; }
+
+    // True if each plane comes from an independent source, so that the planes of a band are best read
+    // concurrently, each on its own thread.
+    virtual bool isPlaneParallel() const { return false; }
+
+    virtual const char* getName() const = 0;
+};
+
+// Reads through CCfits/cfitsio. Handles anything cfitsio can read.
+class PhitsCCfitsReader : public PhitsImageReader
+{
+public:
+    PhitsCCfitsReader(CCfits::PHDU& hdu, uint32_t width, uint32_t height, uint32_t depth);
+    void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) override;
+    const char* getName() const override { return "CCfits"; }
+
+private:
+    CCfits::PHDU& m_hdu;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_depth;
+    std::valarray<float> m_floatBand;
+    std::valarray<uint8_t> m_byteBand;
+};
+
+// Reads uncompressed images, in the primary HDU or an IMAGE extension, directly from a memory mapping of
+// the file, decoding straight into the destination buffer.
+class PhitsMappedReader : public PhitsImageReader
+{
+public:
+    // Returns nullptr if the file can't be mapped, or the HDU isn't a plain image we can decode. header is
+    // the HDU's header, already parsed, and headerOffset its position in the file.
+    static std::unique_ptr<PhitsMappedReader> create(int fd, uint32_t depth, std::shared_ptr<const PhitsFitsHeader> header,
+                                                     uint64_t headerOffset = 0);
+
+    void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) override;
+    void prefetchRows(uint32_t plane, uint32_t row, uint32_t rows) override;
+    const char* getName() const override { return "native"; }
+
+    const PhitsFitsHeader& getHeader() const { return *m_pHeader; }
+
+private:
+    PhitsMappedReader() {}
+
+    PhitsMappedFile m_file;
+    std::shared_ptr<const PhitsFitsHeader> m_pHeader;
+    uint64_t m_dataOffset = 0;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_depth = 0;
+    double m_bscale = 1.;
+    double m_bzero = 0.;
+    bool m_hasBlank = false;
+    int64_t m_blank = 0;
+};
+
+// Assembles a multi-plane image from single-plane readers, such as the R, G and B image extensions of a
+// file. The readers share nothing, so the planes of a band are read in parallel.
+class PhitsChannelReader : public PhitsImageReader
+{
+public:
+    explicit PhitsChannelReader(std::vector<std::unique_ptr<PhitsImageReader>> channels);
+
+    void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) override;
+    void prefetchRows(uint32_t plane, uint32_t row, uint32_t rows) override;
+    bool isPlaneParallel() const override { return true; }
+    const char* getName() const override { return "channels"; }
+
+private:
+    std::vector<std::unique_ptr<PhitsImageReader>> m_channels;
+};
+
+#endif // _PHITSREADER_H_
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsSettings.h"
+#include <algorithm>
+#include <ctype.h>
+#include <float.h>
+#include <stdlib.h>
+
+using namespace std;
+
+static uint32_t getEnvUInt(const char* name, uint32_t defaultValue)
+{
+    const char* str = getenv(name);
+    if (str == nullptr || *str == '\0')
+    {
+        return defaultValue;
+    }
+    char* end = nullptr;
+    const unsigned long val = strtoul(str, &end, 10);
+    return (end != nullptr && *end == '\0') ? (uint32_t)val : defaultValue;
+}
+
+// Values below minValue are ignored, as are unparseable ones. Settings that must be positive use FLT_MIN.
+static float getEnvFloat(const char* name, float defaultValue, float minValue)
+{
+    const char* str = getenv(name);
+    if (str == nullptr || *str == '\0')
+    {
+        return defaultValue;
+    }
+    char* end = nullptr;
+    const float val = strtof(str, &end);
+    return (end != nullptr && *end == '\0' && val >= minValue) ? val : defaultValue;
+}
+
+PhitsSettings::PhitsSettings()
+{
+    bandRows = getEnvUInt("PHITS_BAND_ROWS", 0);
+    allPlanes = getEnvUInt("PHITS_ALL_PLANES", 1) != 0;
+    const char* kernelStr = getenv("PHITS_KERNELS");
+    kernels = kernelStr != nullptr ? kernelStr : "";
+    threads = getEnvUInt("PHITS_THREADS", 0);
+    nativeRead = getEnvUInt("PHITS_NATIVE_READ", 1) != 0;
+    ioBuffers = max<uint32_t>(1, getEnvUInt("PHITS_IO_BUFFERS", 3));
+    const char* compressionStr = getenv("PHITS_COMPRESSION");
+    string compressionName = compressionStr != nullptr ? compressionStr : "";
+    transform(compressionName.begin(), compressionName.end(), compressionName.begin(), ::tolower);
+    if (compressionName == "rice" || compressionName == "rice_1")
+    {
+        compression = "RICE_1";
+    }
+    else if (compressionName == "gzip" || compressionName == "gzip_1")
+    {
+        compression = "GZIP_1";
+    }
+    quantizeLevel = getEnvFloat("PHITS_QUANTIZE_LEVEL", 4.f, FLT_MIN);
+    const char* gzipStr = getenv("PHITS_GZIP");
+    if (gzipStr != nullptr && *gzipStr != '\0')
+    {
+        gzip = getEnvUInt("PHITS_GZIP", 1) != 0 ? 1 : 0;
+    }
+    const char* hduStr = getenv("PHITS_HDU");
+    hdu = hduStr != nullptr ? hduStr : "";
+    const char* channelStr = getenv("PHITS_CHANNEL_HDUS");
+    channelHdus = channelStr != nullptr ? channelStr : "";
+    metadataCache = getEnvUInt("PHITS_METADATA_CACHE", 16);
+    native16 = getEnvUInt("PHITS_16BIT", 0) != 0;
+    restoreBitpix = getEnvUInt("PHITS_RESTORE_BITPIX", 1) != 0;
+    const char* normalizeStr = getenv("PHITS_NORMALIZE");
+    string normalizeName = normalizeStr != nullptr ? normalizeStr : "";
+    transform(normalizeName.begin(), normalizeName.end(), normalizeName.begin(), ::tolower);
+    if (normalizeName == "percentile" || normalizeName == "asinh" || normalizeName == "mtf")
+    {
+        normalization = normalizeName;
+    }
+    clipLow = min(getEnvFloat("PHITS_CLIP_LOW", .1f, 0.f), 100.f);
+    clipHigh = min(getEnvFloat("PHITS_CLIP_HIGH", 99.9f, 0.f), 100.f);
+    if (clipHigh <= clipLow)
+    {
+        clipLow = .1f;
+        clipHigh = 99.9f;
+    }
+    asinhStretch = getEnvFloat("PHITS_ASINH_STRETCH", 10.f, FLT_MIN);
+    mtfBackground = getEnvFloat("PHITS_MTF_BACKGROUND", .25f, FLT_MIN);
+    if (mtfBackground >= 1.f)
+    {
+        mtfBackground = .25f;
+    }
+    blankValue = min(getEnvFloat("PHITS_BLANK_VALUE", 0.f, 0.f), 1.f);
+    const char* rangeStr = getenv("PHITS_DATA_RANGE");
+    string rangeName = rangeStr != nullptr ? rangeStr : "";
+    transform(rangeName.begin(), rangeName.end(), rangeName.begin(), ::tolower);
+    if (rangeName == "any" || rangeName == "none")
+    {
+        dataRange = rangeName;
+    }
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSSETTINGS_H_
+#define _PHITSSETTINGS_H_
+
+#include <stdint.h>
+#include <string>
+
+// Tuning options, read from PHITS_* environment variables in the same manner as PHITS_LOG.
+struct PhitsSettings
+{
+    PhitsSettings();
+
+    // Number of rows transferred to or from the host per advanceState() call (PHITS_BAND_ROWS).
+    // Zero selects a value based on the image width and the buffer space offered by the host.
+    uint32_t bandRows = 0;
+
+    // Transfer all planes of a band in one advanceState() call, rather than making a separate pass over the
+    // image for each plane (PHITS_ALL_PLANES, default 1).
+    bool allPlanes = true;
+
+    // Restrict pixel kernels to the named instruction set (PHITS_KERNELS); empty selects the best available.
+    std::string kernels;
+
+    // Number of threads used for pixel processing, including the calling thread (PHITS_THREADS).
+    // Zero selects one per hardware thread; one disables multithreading.
+    uint32_t threads = 0;
+
+    // Read uncompressed images directly from a memory mapping of the file, and stream gzipped ones, rather than
+    // going through cfitsio (PHITS_NATIVE_READ, default 1).
+    bool nativeRead = true;
+
+    // Number of band buffers used to overlap host transfers with file I/O on a background thread
+    // (PHITS_IO_BUFFERS, default 3). One disables the background thread.
+    uint32_t ioBuffers = 3;
+
+    // Tile compression used when saving (PHITS_COMPRESSION): "RICE_1" for `rice`, "GZIP_1" for `gzip`, or empty
+    // (the default, or `none`) to save an uncompressed primary image.
+    std::string compression;
+
+    // When saving floating-point images with RICE compression, each tile is quantized with a step of its
+    // noise level divided by this (PHITS_QUANTIZE_LEVEL, default 4, as for fpack).
+    float quantizeLevel = 4.f;
+
+    // Gzip an uncompressed image when saving (PHITS_GZIP): 1 always, 0 never, or -1 (unset) when the image was
+    // read from a gzipped file.
+    int gzip = -1;
+
+    // HDU to read the image from (PHITS_HDU), by EXTNAME or by number (0 for the primary HDU). Empty selects
+    // the primary image, or the first image extension if the primary HDU is empty.
+    std::string hdu;
+
+    // Single-plane image HDUs to assemble into one RGB (or RGBA) image (PHITS_CHANNEL_HDUS): a comma-separated
+    // list of three or four HDUs, named or numbered as for hdu, or `auto` for the first three image extensions
+    // of the same shape. Empty (the default) reads a single HDU.
+    std::string channelHdus;
+
+    // Megabytes of parsed document metadata (header cards and the like) kept in memory across opens
+    // (PHITS_METADATA_CACHE, default 16). Metadata evicted beyond this is parsed again from the document when needed.
+    uint32_t metadataCache = 16;
+
+    // Open 16-bit integer images without BSCALE in Photoshop's 16-bit mode, mapping the stored values (offset by
+    // BZERO) to 0..32768, rather than converting them to 32-bit floats (PHITS_16BIT, default 0).
+    bool native16 = false;
+
+    // Save images that were converted to floats when read as they were stored, undoing the normalization and
+    // rounding back to integers with the original BITPIX, BZERO and BSCALE (PHITS_RESTORE_BITPIX, default 1).
+    // Only uncompressed images are restored.
+    bool restoreBitpix = true;
+
+    // How floating-point data outside [0,1] is mapped to [0,1] when read (PHITS_NORMALIZE): `minmax` (the
+    // default) maps the minimum to 0 and the maximum to 1; `percentile` maps the clipLow and clipHigh
+    // percentiles to 0 and 1, clipping the rest; `asinh` does the same and then applies an asinh stretch; `mtf`
+    // clips the shadows below the background and applies a midtones transfer function that puts the median
+    // at mtfBackground. All but `minmax` are applied even if the data is already within [0,1].
+    std::string normalization = "minmax";
+
+    // Percentiles clipped by the percentile and asinh normalizations (PHITS_CLIP_LOW, default 0.1, and
+    // PHITS_CLIP_HIGH, default 99.9).
+    float clipLow = .1f;
+    float clipHigh = 99.9f;
+
+    // Strength of the asinh stretch (PHITS_ASINH_STRETCH, default 10); larger values brighten faint detail more.
+    float asinhStretch = 10.f;
+
+    // Level of the median after the MTF stretch (PHITS_MTF_BACKGROUND, default 0.25).
+    float mtfBackground = .25f;
+
+    // Value, from 0 to 1, given to undefined pixels (NaN or infinite values, and integers equal to BLANK) when
+    // an image is read as floats (PHITS_BLANK_VALUE, default 0). They're left out of the normalization statistics.
+    float blankValue = 0.f;
+
+    // Which DATAMIN and DATAMAX header cards are trusted to give the range of float data, saving a pass over
+    // it when it's read (PHITS_DATA_RANGE): `phits` (the default) for those we wrote, which are exact, `any`
+    // for any, or `none`. Unless `none`, uncompressed images are saved with the exact range in these cards.
+    std::string dataRange = "phits";
+};
+
+#endif // _PHITSSETTINGS_H_
@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsStretch.h"
+#include "PhitsHistogram.h"
+#include "PhitsKernels.h"
+#include "PhitsSettings.h"
+#include "PhitsThreadPool.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+// Samples per parallel task.
+static const size_t kStretchGrain = 64 * 1024;
+
+// Shadows clipping point of the MTF stretch, in normalized MADs below the median, as for PixInsight's
+// automatic screen transfer function.
+static const double kShadowsClip = -2.8;
+
+// Scale of the MAD to the standard deviation of normally distributed values.
+static const double kMadToSigma = 1.4826;
+
+// Midtones transfer function: maps 0 to 0, m to 0.5 and 1 to 1. Its inverse is mtf(1 - m, x).
+template <typename T>
+static inline T mtf(T m, T x)
+{
+    return (m - 1) * x / ((2 * m - 1) * x - m);
+}
+
+static inline float clip01(float x)
+{
+    // Also takes NaN to zero.
+    x = x > 0.f ? x : 0.f;
+    return x < 1.f ? x : 1.f;
+}
+
+void PhitsStretch::apply(const PhitsKernels& kernels, const float* src, float* dst, size_t count, float blank) const
+{
+    const float offset = (float)-low;
+    const float scale = (float)(1. / (high - low));
+    // Undefined values are replaced as they're normalized, with the value that the curve takes to blank.
+    float uncurvedBlank = blank;
+    uncurve(&uncurvedBlank, &uncurvedBlank, 1);
+    const Mode curve = mode;
+    const bool clip = isClipped;
+    const float p = (float)param;
+    const float asinhNorm = curve == Mode::Asinh ? 1.f / asinhf(p) : 1.f;
+    PhitsThreadPool::get().parallelFor(count, kStretchGrain, [&](size_t begin, size_t end)
+    {
+        float* out = dst + begin;
+        const size_t n = end - begin;
+        kernels.normalize(src + begin, out, n, offset, scale, uncurvedBlank);
+        if (clip)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = clip01(out[i]);
+            }
+        }
+        if (curve == Mode::Asinh)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = asinhf(p * out[i]) * asinhNorm;
+            }
+        }
+        else if (curve == Mode::Mtf)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                out[i] = mtf(p, out[i]);
+            }
+        }
+    });
+}
+
+void PhitsStretch::uncurve(const float* src, float* dst, size_t count) const
+{
+    if (mode == Mode::Asinh)
+    {
+        const double scale = asinh(param);
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = (float)(sinh(src[i] * scale) / param);
+        }
+    }
+    else if (mode == Mode::Mtf)
+    {
+        const double m = 1. - param;
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[i] = (float)mtf(m, (double)src[i]);
+        }
+    }
+    else if (dst != src)
+    {
+        copy(src, src + count, dst);
+    }
+}
+
+PhitsStretch PhitsStretch::create(const string& normalization, const PhitsHistogram* pHistogram, float minVal, float maxVal,
+                                  const PhitsSettings& settings)
+{
+    PhitsStretch stretch;
+    stretch.low = minVal;
+    stretch.high = maxVal;
+    if (pHistogram == nullptr || pHistogram->getCount() == 0 || !needsHistogram(normalization))
+    {
+        // Min/max, which needs no clipping.
+    }
+    else if (normalization == "mtf")
+    {
+        // Clip the shadows a little below the background, and put the median at the target background level.
+        const double median = pHistogram->getMedian();
+        const double sigma = kMadToSigma * pHistogram->getMad(median);
+        stretch.low = max((double)minVal, median + kShadowsClip * sigma);
+        if (stretch.high > stretch.low && median > stretch.low)
+        {
+            stretch.mode = Mode::Mtf;
+            stretch.param = mtf((double)settings.mtfBackground, (median - stretch.low) / (stretch.high - stretch.low));
+        }
+        stretch.isClipped = true;
+    }
+    else
+    {
+        stretch.low = pHistogram->getQuantile(settings.clipLow / 100.);
+        stretch.high = pHistogram->getQuantile(settings.clipHigh / 100.);
+        if (normalization == "asinh")
+        {
+            stretch.mode = Mode::Asinh;
+            stretch.param = settings.asinhStretch;
+        }
+        stretch.isClipped = true;
+    }
+    if (!(stretch.high > stretch.low))
+    {
+        // A constant image; anything will do, as long as it doesn't divide by zero.
+        stretch.high = stretch.low + 1.;
+    }
+    return stretch;
+}
+
+const char* PhitsStretch::getModeName(Mode mode)
+{
+    switch (mode)
+    {
+        case Mode::Asinh:
+            return "asinh";
+        case Mode::Mtf:
+            return "MTF";
+        default:
+            return "linear";
+    }
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSSTRETCH_H_
+#define _PHITSSTRETCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+struct PhitsKernels;
+class PhitsHistogram;
+struct PhitsSettings;
+
+// Mapping of data values to the [0,1] range of Photoshop's float mode, applied to float images as they're
+// read, and undone when they're saved as integers. Values are mapped linearly, low to 0 and high to 1,
+// and then, unless the mode is Linear, bent by a curve that keeps 0 and 1 in place.
+struct PhitsStretch
+{
+    enum class Mode : uint32_t
+    {
+        Linear,
+        Asinh,      // asinh(param * x) / asinh(param)
+        Mtf         // Midtones transfer function, which maps param (the midtones balance) to 0.5
+    };
+
+    Mode mode = Mode::Linear;
+    double low = 0.;
+    double high = 1.;
+    double param = 0.;
+    bool isClipped = false;     // Values beyond low and high are clipped to 0 and 1
+
+    // Map count values at src to dst, spreading the work over the thread pool. Values that are NaN or
+    // infinite are given the value blank instead. src and dst may be the same buffer.
+    void apply(const PhitsKernels& kernels, const float* src, float* dst, size_t count, float blank) const;
+
+    // Undo the curve, but not the linear mapping, of count values. src and dst may be the same buffer.
+    void uncurve(const float* src, float* dst, size_t count) const;
+
+    // True if the named normalization (PhitsSettings::normalization) needs a histogram of the image.
+    static bool needsHistogram(const std::string& normalization) { return normalization != "minmax"; }
+
+    // Stretch for the named normalization, from the statistics of an image whose values lie in
+    // [minVal, maxVal]. pHistogram may be null if needsHistogram() is false.
+    static PhitsStretch create(const std::string& normalization, const PhitsHistogram* pHistogram, float minVal, float maxVal,
+                               const PhitsSettings& settings);
+
+    // Name of a mode, for logging.
+    static const char* getModeName(Mode mode);
+};
+
+#endif // _PHITSSTRETCH_H_
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsThreadPool.h"
+#include "PhitsSettings.h"
+#include <algorithm>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+using namespace std;
+
+// Keep the plug-in loaded until the process exits. The workers are parked in its code, and unloading it
+// under them would leave them running in freed memory.
+static void pinModule()
+{
+#ifdef _WIN32
+    HMODULE module = nullptr;
+    GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                       reinterpret_cast<LPCWSTR>(&pinModule), &module);
+#else
+    // Loading ourselves again with RTLD_NODELETE makes the library undeletable.
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(&pinModule), &info) != 0 && info.dli_fname != nullptr)
+    {
+        dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+    }
+#endif
+}
+
+PhitsThreadPool& PhitsThreadPool::get()
+{
+    // Deliberately never destroyed: joining threads while the host unloads the plug-in (e.g. from DllMain)
+    // can deadlock, and idle workers cost nothing but a parked thread. The module is pinned instead, so
+    // that it outlives them.
+    static PhitsThreadPool* pPool = nullptr;
+    static once_flag once;
+    call_once(once, []()
+    {
+        pinModule();
+        uint32_t threadCount = PhitsSettings().threads;
+        if (threadCount == 0)
+        {
+            threadCount = max(1u, thread::hardware_concurrency());
+        }
+        pPool = new PhitsThreadPool(threadCount - 1);
+    });
+    return *pPool;
+}
+
+PhitsThreadPool::PhitsThreadPool(uint32_t workerCount)
+    : m_workerCount(workerCount)
+{
+    for (uint32_t i = 0; i < workerCount; ++i)
+    {
+        thread(&PhitsThreadPool::workerMain, this).detach();
+    }
+}
+
+bool PhitsThreadPool::runChunk(Job& job)
+{
+    const size_t chunk = job.nextChunk.fetch_add(1);
+    if (chunk >= job.chunkCount)
+    {
+        return false;
+    }
+    const size_t begin = chunk * job.grain;
+    const size_t end = min(begin + job.grain, job.count);
+    try
+    {
+        (*job.func)(begin, end);
+    }
+    catch (...)
+    {
+        lock_guard<mutex> lock(job.errorMutex);
+        if (!job.error)
+        {
+            job.error = current_exception();
+        }
+    }
+    if (job.pendingChunks.fetch_sub(1) == 1)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_done.notify_all();
+    }
+    return true;
+}
+
+void PhitsThreadPool::workerMain()
+{
+    for (;;)
+    {
+        shared_ptr<Job> job;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]() { return !m_jobs.empty(); });
+            job = m_jobs.front();
+            if (job->nextChunk >= job->chunkCount)
+            {
+                // Every chunk has been claimed; the threads running them will finish the job.
+                m_jobs.pop_front();
+                continue;
+            }
+        }
+        while (runChunk(*job))
+        {
+        }
+    }
+}
+
+void PhitsThreadPool::parallelFor(size_t count, size_t grain, const function<void(size_t, size_t)>& func)
+{
+    grain = max<size_t>(1, grain);
+    const size_t chunkCount = (count + grain - 1) / grain;
+    if (chunkCount <= 1 || m_workerCount == 0)
+    {
+        for (size_t begin = 0; begin < count; begin += grain)
+        {
+            func(begin, min(begin + grain, count));
+        }
+        return;
+    }
+
+    shared_ptr<Job> job = make_shared<Job>();
+    job->func = &func;
+    job->count = count;
+    job->grain = grain;
+    job->chunkCount = chunkCount;
+    job->pendingChunks = chunkCount;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+    }
+    m_wake.notify_all();
+
+    // Work on our own job rather than waiting; this also makes nested calls from worker threads safe.
+    while (runChunk(*job))
+    {
+    }
+
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_done.wait(lock, [&job]() { return job->pendingChunks == 0; });
+        const auto it = find(m_jobs.begin(), m_jobs.end(), job);
+        if (it != m_jobs.end())
+        {
+            m_jobs.erase(it);
+        }
+    }
+
+    if (job->error)
+    {
+        rethrow_exception(job->error);
+    }
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSTHREADPOOL_H_
+#define _PHITSTHREADPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// Pool of worker threads shared by all selector calls. Unlike PhitsPlugin, which is deleted at the end of
+// every phase, the pool is created on first use and lives until the plug-in is unloaded, so threads are
+// not re-spawned for every read or write.
+class PhitsThreadPool
+{
+public:
+    static PhitsThreadPool& get();
+
+    // Number of threads that work on a parallelFor(), including the calling thread.
+    uint32_t getThreadCount() const { return m_workerCount + 1; }
+
+    // Call func(begin, end) for consecutive chunks [k * grain, min((k + 1) * grain, count)) of [0, count),
+    // spread over the pool and the calling thread, and return once all chunks are done. The first exception
+    // thrown by func is rethrown here. May be called from several threads at once, including from within func.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& func);
+
+private:
+    struct Job
+    {
+        const std::function<void(size_t, size_t)>* func = nullptr;
+        size_t count = 0;
+        size_t grain = 1;
+        size_t chunkCount = 0;
+        std::atomic<size_t> nextChunk{ 0 };
+        std::atomic<size_t> pendingChunks{ 0 };
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    explicit PhitsThreadPool(uint32_t workerCount);
+    void workerMain();
+    bool runChunk(Job& job);
+
+    uint32_t m_workerCount = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;     // Signalled when a job is queued
+    std::condition_variable m_done;     // Signalled when a job's last chunk completes
+    std::deque<std::shared_ptr<Job>> m_jobs;
+};
+
+#endif // _PHITSTHREADPOOL_H_
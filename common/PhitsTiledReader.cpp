@@ -0,0 +1,744 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsTiledReader.h"
+#include "PhitsEndian.h"
+#include "PhitsHeaderCache.h"
+#include "PhitsKernels.h"
+#include "PhitsThreadPool.h"
+#include <math.h>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <zlib.h>
+
+using namespace std;
+
+// The PLIO decoder is exported by cfitsio, but only declared in its private fitsio2.h.
+extern "C" int pl_l2pi(short* ll_src, int xs, int* px_dst, int npix);
+
+// Length of cfitsio's table of dither offsets.
+static const int kRandomCount = 10000;
+
+// cfitsio's HCOMPRESS decoder keeps its state in static variables.
+static mutex gHcompressMutex;
+
+const vector<float>& PhitsTiledReader::getDitherValues()
+{
+    static const vector<float> values = []()
+    {
+        vector<float> v(kRandomCount);
+        const double a = 16807.;
+        const double m = 2147483647.;
+        double seed = 1.;
+        for (int i = 0; i < kRandomCount; ++i)
+        {
+            const double temp = a * seed;
+            seed = temp - m * (int)(temp / m);
+            v[i] = (float)(seed / m);
+        }
+        return v;
+    }();
+    return values;
+}
+
+static size_t getTypeSize(char type)
+{
+    switch (type)
+    {
+        case 'L': case 'B': case 'A': case 'X': return 1;
+        case 'I': return 2;
+        case 'J': case 'E': return 4;
+        case 'K': case 'D': case 'C': case 'P': return 8;
+        case 'M': case 'Q': return 16;
+        default: return 0;
+    }
+}
+
+// BITPIX equivalent of a TFORM type code, or 0.
+static int getTypeBitpix(char type)
+{
+    switch (type)
+    {
+        case 'B': return 8;
+        case 'I': return 16;
+        case 'J': return 32;
+        case 'K': return 64;
+        case 'E': return -32;
+        case 'D': return -64;
+        default: return 0;
+    }
+}
+
+static void inflateTile(const uint8_t* src, uint64_t size, uint8_t* dst, size_t dstSize)
+{
+    z_stream stream = {};
+    // Accept either gzip or zlib framing.
+    if (inflateInit2(&stream, 15 + 32) != Z_OK)
+    {
+        throw runtime_error("Could not initialize zlib");
+    }
+    stream.next_in = const_cast<Bytef*>(src);
+    stream.avail_in = (uInt)size;
+    stream.next_out = dst;
+    stream.avail_out = (uInt)dstSize;
+    const int result = inflate(&stream, Z_FINISH);
+    const uLong produced = stream.total_out;
+    inflateEnd(&stream);
+    if (result != Z_STREAM_END || produced != dstSize)
+    {
+        throw runtime_error("Corrupt GZIP-compressed tile");
+    }
+}
+
+bool PhitsTiledReader::findCompressedImage(int fd, PhitsFitsHeader& header, uint64_t& headerOffset, int& hduIndex)
+{
+    const shared_ptr<const PhitsHduIndex> pIndex = PhitsHeaderCache::get().getHduIndex(fd);
+    const int index = pIndex ? pIndex->findCompressedImage() : -1;
+    if (index < 0 || !pIndex->readHeader(fd, index, header))
+    {
+        return false;
+    }
+    headerOffset = pIndex->getHdu(index).headerOffset;
+    hduIndex = index;
+    return true;
+}
+
+bool PhitsTiledReader::isCompressionKey(const string& key)
+{
+    static const char* const kKeys[] = { "XTENSION", "TFIELDS", "THEAP", "PCOUNT", "GCOUNT", "ZIMAGE", "ZCMPTYPE", "ZBITPIX", "ZQUANTIZ",
+                                         "ZDITHER0", "ZSIMPLE", "ZEXTEND", "ZBLOCKED", "ZTENSION", "ZPCOUNT", "ZGCOUNT", "ZHECKSUM",
+                                         "ZDATASUM", "ZBLANK", "ZSCALE", "ZZERO" };
+    for (const char* k : kKeys)
+    {
+        if (key == k)
+        {
+            return true;
+        }
+    }
+    // Indexed keywords: table columns, and image axes, tiles and codec parameters.
+    static const char* const kPrefixes[] = { "TTYPE", "TFORM", "TUNIT", "TDIM", "ZNAXIS", "ZTILE", "ZNAME", "ZVAL" };
+    for (const char* prefix : kPrefixes)
+    {
+        const size_t len = strlen(prefix);
+        if (key.compare(0, len, prefix) == 0 && key.size() > len && key.find_first_not_of("0123456789", len) == string::npos)
+        {
+            return true;
+        }
+    }
+    return key == "ZNAXIS";
+}
+
+unique_ptr<PhitsTiledReader> PhitsTiledReader::create(int fd, int hduIndex)
+{
+    unique_ptr<PhitsTiledReader> pReader(new PhitsTiledReader);
+    uint64_t headerOffset = 0;
+    if (hduIndex >= 0)
+    {
+        const shared_ptr<const PhitsHduIndex> pIndex = PhitsHeaderCache::get().getHduIndex(fd);
+        if (!pIndex || !pIndex->readHeader(fd, hduIndex, pReader->m_header) ||
+            pIndex->getHdu(hduIndex).type != PhitsHduIndex::Type::CompressedImage)
+        {
+            return nullptr;
+        }
+        headerOffset = pIndex->getHdu(hduIndex).headerOffset;
+        pReader->m_hduIndex = hduIndex;
+    }
+    else if (!findCompressedImage(fd, pReader->m_header, headerOffset, pReader->m_hduIndex))
+    {
+        return nullptr;
+    }
+    if (!pReader->m_file.map(fd))
+    {
+        return nullptr;
+    }
+
+    const PhitsFitsHeader& header = pReader->m_header;
+    const uint64_t dataOffset = headerOffset + header.getHeaderSize();
+    if (header.getNaxis() != 2 || header.getBitpix() != 8 || dataOffset + header.getDataSize() > pReader->m_file.getSize())
+    {
+        return nullptr;
+    }
+    pReader->m_pTable = pReader->m_file.getData() + dataOffset;
+    pReader->m_rowBytes = (uint64_t)header.getAxis(0);
+    pReader->m_rowCount = (uint64_t)header.getAxis(1);
+    const uint64_t heapOffset = (uint64_t)header.getIntValue("THEAP", (int64_t)(pReader->m_rowBytes * pReader->m_rowCount));
+    if (heapOffset > header.getDataSize())
+    {
+        return nullptr;
+    }
+    pReader->m_pHeap = pReader->m_pTable + heapOffset;
+    pReader->m_heapSize = header.getDataSize() - heapOffset;
+
+    if (!pReader->parseTable(header))
+    {
+        return nullptr;
+    }
+    return pReader;
+}
+
+bool PhitsTiledReader::parseTable(const PhitsFitsHeader& header)
+{
+    // Image geometry
+    m_bitpix = (int)header.getIntValue("ZBITPIX", 0);
+    m_naxis = (int)header.getIntValue("ZNAXIS", 0);
+    if ((m_bitpix != 8 && m_bitpix != 16 && m_bitpix != 32 && m_bitpix != -32 && m_bitpix != -64) || (m_naxis != 2 && m_naxis != 3))
+    {
+        return false;
+    }
+    m_width = (uint32_t)header.getIntValue("ZNAXIS1", 0);
+    m_height = (uint32_t)header.getIntValue("ZNAXIS2", 0);
+    m_planes = m_naxis > 2 ? (uint32_t)header.getIntValue("ZNAXIS3", 0) : 1;
+    m_tileWidth = (uint32_t)header.getIntValue("ZTILE1", m_width);
+    m_tileHeight = (uint32_t)header.getIntValue("ZTILE2", 1);
+    m_tileDepth = m_naxis > 2 ? (uint32_t)header.getIntValue("ZTILE3", 1) : 1;
+    if (m_width == 0 || m_height == 0 || m_planes == 0 || m_tileWidth == 0 || m_tileHeight == 0 || m_tileDepth == 0)
+    {
+        return false;
+    }
+    const uint64_t tileCount = (uint64_t)((m_width + m_tileWidth - 1) / m_tileWidth) * ((m_height + m_tileHeight - 1) / m_tileHeight) *
+                               ((m_planes + m_tileDepth - 1) / m_tileDepth);
+    if (tileCount != m_rowCount)
+    {
+        return false;
+    }
+    m_bscale = header.getDoubleValue("BSCALE", 1.);
+    m_bzero = header.getDoubleValue("BZERO", 0.);
+
+    // Codec parameters
+    if (!header.getString("ZCMPTYPE", m_compressionType))
+    {
+        return false;
+    }
+    for (int i = 1; ; ++i)
+    {
+        string name;
+        if (!header.getString("ZNAME" + to_string(i), name))
+        {
+            break;
+        }
+        const int64_t value = header.getIntValue("ZVAL" + to_string(i), 0);
+        if (name == "BLOCKSIZE")
+        {
+            m_blockSize = (int)value;
+        }
+        else if (name == "BYTEPIX")
+        {
+            m_bytePix = (int)value;
+        }
+        else if (name == "SMOOTH")
+        {
+            m_smooth = (int)value;
+        }
+    }
+    string quantize;
+    if (header.getString("ZQUANTIZ", quantize))
+    {
+        m_ditherMethod = quantize == "SUBTRACTIVE_DITHER_1" ? 1 : quantize == "SUBTRACTIVE_DITHER_2" ? 2 : 0;
+    }
+    m_ditherSeed = header.getIntValue("ZDITHER0", 1);
+    // Quantized images mark their null values with ZBLANK; integer images carry theirs over as BLANK, or ZBLANK.
+    int64_t blank = 0;
+    if (header.getInt("ZBLANK", blank) || (m_bitpix > 0 && header.getInt("BLANK", blank)))
+    {
+        m_hasBlank = true;
+        m_blank = blank;
+    }
+    m_zscaleKey = header.getDoubleValue("ZSCALE", 1.);
+    m_zzeroKey = header.getDoubleValue("ZZERO", 0.);
+    m_isQuantized = m_bitpix < 0 && header.hasKey("ZSCALE");
+
+    // Table columns
+    const int64_t fieldCount = header.getIntValue("TFIELDS", 0);
+    int64_t offset = 0;
+    for (int64_t i = 1; i <= fieldCount; ++i)
+    {
+        string name, form;
+        if (!header.getString("TFORM" + to_string(i), form))
+        {
+            return false;
+        }
+        header.getString("TTYPE" + to_string(i), name);
+
+        // rTa, e.g. 1PB(1234) or 1D
+        size_t pos = 0;
+        int64_t repeat = 0;
+        while (pos < form.size() && isdigit((unsigned char)form[pos]))
+        {
+            repeat = repeat * 10 + (form[pos++] - '0');
+        }
+        if (pos == 0)
+        {
+            repeat = 1;
+        }
+        if (pos >= form.size())
+        {
+            return false;
+        }
+        Column column;
+        column.offset = offset;
+        column.type = form[pos];
+        if (column.type == 'P' || column.type == 'Q')
+        {
+            column.isDescriptor = true;
+            column.isLongDescriptor = column.type == 'Q';
+            column.type = pos + 1 < form.size() ? form[pos + 1] : 0;
+            offset += repeat * (column.isLongDescriptor ? 16 : 8);
+        }
+        else if (column.type == 'X')
+        {
+            offset += (repeat + 7) / 8;
+        }
+        else
+        {
+            const size_t size = getTypeSize(column.type);
+            if (size == 0)
+            {
+                return false;
+            }
+            offset += repeat * size;
+        }
+
+        if (name == "COMPRESSED_DATA")
+        {
+            m_compressed = column;
+        }
+        else if (name == "GZIP_COMPRESSED_DATA")
+        {
+            m_gzipCompressed = column;
+        }
+        else if (name == "UNCOMPRESSED_DATA")
+        {
+            m_uncompressed = column;
+        }
+        else if (name == "ZSCALE")
+        {
+            m_zscale = column;
+            m_isQuantized = m_bitpix < 0;
+        }
+        else if (name == "ZZERO")
+        {
+            m_zzero = column;
+        }
+        else if (name == "ZBLANK")
+        {
+            m_zblank = column;
+        }
+    }
+    if ((uint64_t)offset != m_rowBytes || m_compressed.offset < 0 || !m_compressed.isDescriptor)
+    {
+        return false;
+    }
+
+    // Lossy codecs are only used on integers, so floating-point data has to have been quantized first.
+    const string& type = m_compressionType;
+    if (type == "RICE_1" || type == "RICE_ONE")
+    {
+        return (m_bytePix == 1 || m_bytePix == 2 || m_bytePix == 4) && (m_bitpix > 0 || m_isQuantized);
+    }
+    if (type == "HCOMPRESS_1" || type == "PLIO_1")
+    {
+        return m_bitpix > 0 || m_isQuantized;
+    }
+    return type == "GZIP_1" || type == "GZIP_2" || type == "NOCOMPRESS";
+}
+
+bool PhitsTiledReader::getArray(const Column& column, uint64_t tile, const uint8_t*& data, uint64_t& count) const
+{
+    if (column.offset < 0 || !column.isDescriptor)
+    {
+        return false;
+    }
+    const uint8_t* p = m_pTable + tile * m_rowBytes + column.offset;
+    uint64_t offset = 0;
+    if (column.isLongDescriptor)
+    {
+        count = loadBE64(p);
+        offset = loadBE64(p + 8);
+    }
+    else
+    {
+        count = loadBE32(p);
+        offset = loadBE32(p + 4);
+    }
+    if (count == 0)
+    {
+        return false;
+    }
+    const size_t elementSize = max<size_t>(1, getTypeSize(column.type));
+    if (offset > m_heapSize || count > (m_heapSize - offset) / elementSize)
+    {
+        throw runtime_error("Tile " + to_string(tile) + " lies outside the heap");
+    }
+    data = m_pHeap + offset;
+    return true;
+}
+
+double PhitsTiledReader::getDouble(const Column& column, uint64_t tile, double defaultValue) const
+{
+    if (column.offset < 0 || column.isDescriptor)
+    {
+        return defaultValue;
+    }
+    const uint8_t* p = m_pTable + tile * m_rowBytes + column.offset;
+    switch (column.type)
+    {
+        case 'D':
+        {
+            const uint64_t bits = loadBE64(p);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        case 'E':
+        {
+            const uint32_t bits = loadBE32(p);
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+        default:
+            return (double)getInt(column, tile, (int64_t)defaultValue);
+    }
+}
+
+int64_t PhitsTiledReader::getInt(const Column& column, uint64_t tile, int64_t defaultValue) const
+{
+    if (column.offset < 0 || column.isDescriptor)
+    {
+        return defaultValue;
+    }
+    const uint8_t* p = m_pTable + tile * m_rowBytes + column.offset;
+    switch (column.type)
+    {
+        case 'B': return *p;
+        case 'I': return (int16_t)loadBE16(p);
+        case 'J': return (int32_t)loadBE32(p);
+        case 'K': return (int64_t)loadBE64(p);
+        default: return defaultValue;
+    }
+}
+
+// Decode the compressed integers of one tile, which holds pixels values, to dst.
+void PhitsTiledReader::decodeInts(const uint8_t* src, uint64_t count, char type, size_t pixels, int32_t* dst) const
+{
+    const string& codec = m_compressionType;
+    // Bytes per value in the uncompressed stream: quantized floats are 32-bit integers.
+    const size_t valueBytes = m_bitpix < 0 ? 4 : abs(m_bitpix) / 8;
+    if (codec == "RICE_1" || codec == "RICE_ONE")
+    {
+        unsigned char* c = const_cast<unsigned char*>(src);
+        int status = 0;
+        if (m_bytePix == 1)
+        {
+            vector<unsigned char> values(pixels);
+            status = fits_rdecomp_byte(c, (int)count, values.data(), (int)pixels, m_blockSize);
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                dst[i] = values[i];
+            }
+        }
+        else if (m_bytePix == 2)
+        {
+            vector<unsigned short> values(pixels);
+            status = fits_rdecomp_short(c, (int)count, values.data(), (int)pixels, m_blockSize);
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                dst[i] = (int16_t)values[i];
+            }
+        }
+        else
+        {
+            status = fits_rdecomp(c, (int)count, reinterpret_cast<unsigned int*>(dst), (int)pixels, m_blockSize);
+        }
+        if (status != 0)
+        {
+            throw runtime_error("Corrupt RICE-compressed tile");
+        }
+        return;
+    }
+    if (codec == "HCOMPRESS_1")
+    {
+        int nx = 0;
+        int ny = 0;
+        int scale = 0;
+        int status = 0;
+        lock_guard<mutex> lock(gHcompressMutex);
+        fits_hdecompress(const_cast<unsigned char*>(src), m_smooth, dst, &nx, &ny, &scale, &status);
+        if (status != 0 || (size_t)nx * ny != pixels)
+        {
+            throw runtime_error("Corrupt HCOMPRESS-compressed tile");
+        }
+        return;
+    }
+    if (codec == "PLIO_1")
+    {
+        // The line list is stored as big-endian 16-bit values.
+        if (type != 'I')
+        {
+            throw runtime_error("Unexpected PLIO data type");
+        }
+        vector<short> lineList(count);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            lineList[i] = (short)loadBE16(src + 2 * i);
+        }
+        if (pl_l2pi(lineList.data(), 1, dst, (int)pixels) <= 0)
+        {
+            throw runtime_error("Corrupt PLIO-compressed tile");
+        }
+        return;
+    }
+
+    // GZIP_1, GZIP_2 and NOCOMPRESS store the big-endian values themselves.
+    vector<uint8_t> bytes(pixels * valueBytes);
+    if (codec == "NOCOMPRESS")
+    {
+        if (count * max<size_t>(1, getTypeSize(type)) < bytes.size())
+        {
+            throw runtime_error("Truncated tile");
+        }
+        memcpy(bytes.data(), src, bytes.size());
+    }
+    else
+    {
+        inflateTile(src, count, bytes.data(), bytes.size());
+    }
+    if (codec == "GZIP_2" && valueBytes > 1)
+    {
+        // Bytes were shuffled so that the most significant byte of every value comes first, then the next, ...
+        vector<uint8_t> shuffled(bytes);
+        for (size_t i = 0; i < pixels; ++i)
+        {
+            for (size_t b = 0; b < valueBytes; ++b)
+            {
+                bytes[i * valueBytes + b] = shuffled[b * pixels + i];
+            }
+        }
+    }
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        const uint8_t* p = bytes.data() + i * valueBytes;
+        dst[i] = valueBytes == 1 ? *p : valueBytes == 2 ? (int16_t)loadBE16(p) : (int32_t)loadBE32(p);
+    }
+}
+
+void PhitsTiledReader::decodeTile(uint64_t tile, uint32_t width, uint32_t height, uint32_t depth, float* dst) const
+{
+    const size_t pixels = (size_t)width * height * depth;
+    const uint8_t* src = nullptr;
+    uint64_t count = 0;
+
+    // Integer and quantized tiles
+    if (getArray(m_compressed, tile, src, count) && (m_bitpix > 0 || m_isQuantized))
+    {
+        vector<int32_t> values(pixels);
+        decodeInts(src, count, m_compressed.type, pixels, values.data());
+        // As with the other readers, only float documents mark BLANK pixels; 8- and 16-bit ones keep the values.
+        const bool hasBlank = m_depth == 32 && (m_hasBlank || m_zblank.offset >= 0);
+        const int64_t blank = getInt(m_zblank, tile, m_hasBlank ? m_blank : kNullValue);
+        if (!m_isQuantized)
+        {
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                dst[i] = hasBlank && values[i] == blank ? NAN : (float)(values[i] * m_bscale + m_bzero);
+            }
+            return;
+        }
+
+        const double scale = getDouble(m_zscale, tile, m_zscaleKey);
+        const double zero = getDouble(m_zzero, tile, m_zzeroKey);
+        if (m_ditherMethod == 0)
+        {
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                dst[i] = hasBlank && values[i] == blank ? NAN : (float)(values[i] * scale + zero);
+            }
+            return;
+        }
+
+        // Undo subtractive dithering, walking the random sequence exactly as cfitsio's quantizer did.
+        const vector<float>& randomValues = getDitherValues();
+        int seed = (int)((tile + m_ditherSeed - 1) % kRandomCount);
+        int next = (int)(randomValues[seed] * 500);
+        for (size_t i = 0; i < pixels; ++i)
+        {
+            if (hasBlank && values[i] == blank)
+            {
+                dst[i] = NAN;
+            }
+            else if (m_ditherMethod == 2 && values[i] == kZeroValue)
+            {
+                dst[i] = 0.f;
+            }
+            else
+            {
+                dst[i] = (float)(((double)values[i] - randomValues[next] + 0.5) * scale + zero);
+            }
+            if (++next == kRandomCount)
+            {
+                seed = (seed + 1) % kRandomCount;
+                next = (int)(randomValues[seed] * 500);
+            }
+        }
+        return;
+    }
+
+    // Raw values: lossless floating-point tiles, and tiles that couldn't be compressed (or quantized), which
+    // are stored gzipped or verbatim in separate columns.
+    int bitpix = m_bitpix;
+    vector<uint8_t> bytes(pixels * abs(bitpix) / 8);
+    if (src != nullptr && m_compressionType != "NOCOMPRESS")
+    {
+        inflateTile(src, count, bytes.data(), bytes.size());
+    }
+    else if (src != nullptr)
+    {
+        if (count < bytes.size())
+        {
+            throw runtime_error("Truncated tile");
+        }
+        memcpy(bytes.data(), src, bytes.size());
+    }
+    else if (getArray(m_gzipCompressed, tile, src, count))
+    {
+        inflateTile(src, count, bytes.data(), bytes.size());
+    }
+    else if (getArray(m_uncompressed, tile, src, count))
+    {
+        bitpix = getTypeBitpix(m_uncompressed.type);
+        if (bitpix == 0 || count < pixels)
+        {
+            throw runtime_error("Unsupported uncompressed tile");
+        }
+        bytes.assign(src, src + pixels * abs(bitpix) / 8);
+    }
+    else
+    {
+        throw runtime_error("Tile " + to_string(tile) + " has no data");
+    }
+    const PhitsDecodeKernel decode = getDecodeKernel(getPhitsKernels(), bitpix);
+    decode(bytes.data(), dst, pixels, m_bscale, m_bzero);
+    if (bitpix > 0 && m_hasBlank && m_depth == 32)
+    {
+        getMaskKernel(getPhitsKernels(), bitpix)(bytes.data(), dst, pixels, m_blank);
+    }
+}
+
+void PhitsTiledReader::readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst)
+{
+    const uint32_t tilesX = (m_width + m_tileWidth - 1) / m_tileWidth;
+    const uint32_t tilesY = (m_height + m_tileHeight - 1) / m_tileHeight;
+    const uint32_t slab = plane / m_tileDepth;
+    const uint32_t slabDepth = min(m_tileDepth, m_planes - slab * m_tileDepth);
+    const uint32_t firstTileRow = row / m_tileHeight;
+    const uint32_t lastTileRow = (row + rows - 1) / m_tileHeight;
+    const uint64_t slabTiles = (uint64_t)tilesX * tilesY;
+    auto tileWidth = [&](uint32_t tx) { return min(m_tileWidth, m_width - tx * m_tileWidth); };
+    auto tileHeight = [&](uint32_t ty) { return min(m_tileHeight, m_height - ty * m_tileHeight); };
+
+    // Forget tiles of this slab that the band doesn't touch; reads normally move forward through the image.
+    for (auto it = m_tileCache.begin(); it != m_tileCache.end();)
+    {
+        const uint32_t ty = (uint32_t)((it->first % slabTiles) / tilesX);
+        if (it->first / slabTiles == slab && (ty < firstTileRow || ty > lastTileRow))
+        {
+            it = m_tileCache.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    // Decode the tiles we don't have yet, in parallel.
+    vector<uint64_t> missing;
+    vector<float*> buffers;
+    for (uint32_t ty = firstTileRow; ty <= lastTileRow; ++ty)
+    {
+        for (uint32_t tx = 0; tx < tilesX; ++tx)
+        {
+            const uint64_t tile = slab * slabTiles + (uint64_t)ty * tilesX + tx;
+            if (m_tileCache.count(tile) == 0)
+            {
+                vector<float>& buffer = m_tileCache[tile];
+                buffer.resize((size_t)tileWidth(tx) * tileHeight(ty) * slabDepth);
+                missing.push_back(tile);
+                buffers.push_back(buffer.data());
+            }
+        }
+    }
+    try
+    {
+        PhitsThreadPool::get().parallelFor(missing.size(), 1, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const uint32_t tx = (uint32_t)(missing[i] % tilesX);
+                const uint32_t ty = (uint32_t)((missing[i] % slabTiles) / tilesX);
+                decodeTile(missing[i], tileWidth(tx), tileHeight(ty), slabDepth, buffers[i]);
+            }
+        });
+    }
+    catch (...)
+    {
+        for (uint64_t tile : missing)
+        {
+            m_tileCache.erase(tile);
+        }
+        throw;
+    }
+
+    // Copy the band out of the tiles.
+    const uint32_t planeInSlab = plane - slab * m_tileDepth;
+    for (uint32_t y = row; y < row + rows; ++y)
+    {
+        const uint32_t ty = y / m_tileHeight;
+        const uint32_t th = tileHeight(ty);
+        for (uint32_t tx = 0; tx < tilesX; ++tx)
+        {
+            const uint32_t tw = tileWidth(tx);
+            const float* src = m_tileCache[slab * slabTiles + (uint64_t)ty * tilesX + tx].data() +
+                               ((size_t)planeInSlab * th + (y - ty * m_tileHeight)) * tw;
+            const size_t dstOffset = (size_t)(y - row) * m_width + (size_t)tx * m_tileWidth;
+            if (m_depth == 8)
+            {
+                uint8_t* bp = static_cast<uint8_t*>(dst) + dstOffset;
+                for (uint32_t x = 0; x < tw; ++x)
+                {
+                    bp[x] = (uint8_t)src[x];
+                }
+            }
+            else if (m_depth == 16)
+            {
+                // The tiles hold src = stored value + BZERO, BSCALE being one.
+                uint16_t* sp = static_cast<uint16_t*>(dst) + dstOffset;
+                for (uint32_t x = 0; x < tw; ++x)
+                {
+                    sp[x] = toPhotoshop16((uint32_t)((int32_t)(src[x] - m_bzero) + 32768));
+                }
+            }
+            else
+            {
+                memcpy(static_cast<float*>(dst) + dstOffset, src, tw * sizeof(float));
+            }
+        }
+    }
+
+    // Tiles are done with once their last row and plane have been read.
+    if (planeInSlab + 1 == slabDepth)
+    {
+        for (uint32_t ty = firstTileRow; ty <= lastTileRow; ++ty)
+        {
+            if (ty * m_tileHeight + tileHeight(ty) <= row + rows)
+            {
+                for (uint32_t tx = 0; tx < tilesX; ++tx)
+                {
+                    m_tileCache.erase(slab * slabTiles + (uint64_t)ty * tilesX + tx);
+                }
+            }
+        }
+    }
+}
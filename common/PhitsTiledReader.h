@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSTILEDREADER_H_
+#define _PHITSTILEDREADER_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "PhitsReader.h"
+
+// Reads a tile-compressed image (as written by fpack, or cfitsio's fits_img_compress()) from a binary table
+// extension. Tiles are independent, so each band's tiles are decompressed in parallel on the thread pool.
+// RICE_1, GZIP_1, GZIP_2, HCOMPRESS_1, PLIO_1 and NOCOMPRESS tiles are supported, as are quantized
+// floating-point images, with or without subtractive dithering.
+class PhitsTiledReader : public PhitsImageReader
+{
+public:
+    // Find the first tile-compressed image extension in the file, using its HDU index. fd is as for
+    // PhitsMappedFile. hduIndex is 0 for the primary HDU, 1 for the first extension, and so on.
+    static bool findCompressedImage(int fd, PhitsFitsHeader& header, uint64_t& headerOffset, int& hduIndex);
+
+    // Returns nullptr if the file has no tile-compressed image, or the image uses a layout or codec we
+    // don't support. Reads the image in HDU hduIndex if given, rather than the first one.
+    static std::unique_ptr<PhitsTiledReader> create(int fd, int hduIndex = -1);
+
+    // True for keywords that describe the compressed table, rather than the image.
+    static bool isCompressionKey(const std::string& key);
+
+    // The sequence of dither offsets used by cfitsio's fits_init_randoms(). Quantized files depend on it
+    // being reproduced exactly, by both readers and writers.
+    static const std::vector<float>& getDitherValues();
+
+    // Quantized values with special meanings (see cfitsio's quantize.c).
+    static const int32_t kNullValue = -2147483647;
+    static const int32_t kZeroValue = -2147483646;
+
+    // Editing depth of the rows passed to readRows(), as for the other readers. Must be set before reading.
+    void setDepth(uint32_t depth) { m_depth = depth; }
+
+    void readRows(uint32_t plane, uint32_t row, uint32_t rows, void* dst) override;
+    const char* getName() const override { return "tiled"; }
+
+    // Image properties, from the Z keywords.
+    int getHduIndex() const { return m_hduIndex; }
+    int getBitpix() const { return m_bitpix; }
+    int getNaxis() const { return m_naxis; }
+    uint32_t getWidth() const { return m_width; }
+    uint32_t getHeight() const { return m_height; }
+    uint32_t getPlanes() const { return m_planes; }
+    const std::string& getCompressionType() const { return m_compressionType; }
+
+    // True if the decoded values aren't the stored integers, i.e. BSCALE/BZERO are set, or the image was
+    // quantized.
+    bool isScaled() const { return m_bscale != 1. || m_bzero != 0. || m_bitpix < 0; }
+    double getScale() const { return m_bscale; }
+    double getZero() const { return m_bzero; }
+
+private:
+    struct Column
+    {
+        int64_t offset = -1;    // Byte offset within a row, or -1 if the table doesn't have the column
+        char type = 0;          // TFORM type code; for descriptors, the type of the array elements
+        bool isDescriptor = false;
+        bool isLongDescriptor = false;  // Q rather than P
+    };
+
+    PhitsTiledReader() {}
+
+    bool parseTable(const PhitsFitsHeader& header);
+    bool getArray(const Column& column, uint64_t tile, const uint8_t*& data, uint64_t& count) const;
+    double getDouble(const Column& column, uint64_t tile, double defaultValue) const;
+    int64_t getInt(const Column& column, uint64_t tile, int64_t defaultValue) const;
+    void decodeTile(uint64_t tile, uint32_t width, uint32_t height, uint32_t depth, float* dst) const;
+    void decodeInts(const uint8_t* src, uint64_t count, char type, size_t pixels, int32_t* dst) const;
+
+    PhitsMappedFile m_file;
+    PhitsFitsHeader m_header;
+    int m_hduIndex = 0;
+    uint32_t m_depth = 0;
+
+    // Image
+    int m_bitpix = 0;
+    int m_naxis = 0;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_planes = 1;
+    uint32_t m_tileWidth = 0;
+    uint32_t m_tileHeight = 1;
+    uint32_t m_tileDepth = 1;
+    double m_bscale = 1.;
+    double m_bzero = 0.;
+
+    // Compression
+    std::string m_compressionType;
+    int m_blockSize = 32;
+    int m_bytePix = 4;
+    int m_smooth = 0;
+    bool m_isQuantized = false; // Floating-point values stored as scaled integers
+    int m_ditherMethod = 0;     // 0 none, 1 or 2 for SUBTRACTIVE_DITHER_1/2
+    int64_t m_ditherSeed = 1;
+    bool m_hasBlank = false;
+    int64_t m_blank = 0;
+
+    // Table
+    const uint8_t* m_pTable = nullptr;
+    const uint8_t* m_pHeap = nullptr;
+    uint64_t m_heapSize = 0;
+    uint64_t m_rowBytes = 0;
+    uint64_t m_rowCount = 0;
+    Column m_compressed;
+    Column m_gzipCompressed;
+    Column m_uncompressed;
+    Column m_zscale;
+    Column m_zzero;
+    Column m_zblank;
+    double m_zscaleKey = 1.;
+    double m_zzeroKey = 0.;
+
+    // Decoded tiles that extend past the last band read, so that they aren't decoded twice.
+    std::map<uint64_t, std::vector<float>> m_tileCache;
+};
+
+#endif // _PHITSTILEDREADER_H_
@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsTiledWriter.h"
+#include "PhitsEndian.h"
+#include "PhitsFitsHeader.h"
+#include "PhitsKernels.h"
+#include "PhitsThreadPool.h"
+#include "PhitsTiledReader.h"
+#include <algorithm>
+#include <math.h>
+#include <stdexcept>
+#include <string.h>
+#include <fitsio.h>
+#include <zlib.h>
+
+using namespace std;
+
+// RICE block size; the value fpack uses.
+static const int kRiceBlockSize = 32;
+
+// Quantized values are kept this far from the ends of the int32 range, leaving room for the reserved
+// null and zero values (as cfitsio does).
+static const double kReservedValues = 10.;
+
+// Images whose raw size could push heap offsets past 31 bits use 64-bit (Q) descriptors.
+static const uint64_t kLongHeapSize = 1ull << 30;
+
+static void deflateTile(const void* src, size_t size, vector<uint8_t>& dst)
+{
+    z_stream stream = {};
+    // gzip framing, as cfitsio writes.
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw runtime_error("Could not initialize zlib");
+    }
+    dst.resize(deflateBound(&stream, (uLong)size));
+    stream.next_in = static_cast<Bytef*>(const_cast<void*>(src));
+    stream.avail_in = (uInt)size;
+    stream.next_out = dst.data();
+    stream.avail_out = (uInt)dst.size();
+    const int result = deflate(&stream, Z_FINISH);
+    dst.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+    {
+        throw runtime_error("GZIP compression failed");
+    }
+}
+
+static double getMedian(vector<double>& values)
+{
+    const size_t mid = values.size() / 2;
+    nth_element(values.begin(), values.begin() + mid, values.end());
+    return values[mid];
+}
+
+// Noise estimate for a row of finite values, from the median absolute differences of neighbours (as in
+// cfitsio's FnNoise5_float()): the lower of the 2nd and 3rd order estimates, ignoring zeros.
+static double estimateNoise(const vector<float>& values)
+{
+    const size_t n = values.size();
+    double noise = 0.;
+    vector<double> diffs;
+    if (n >= 5)
+    {
+        diffs.reserve(n);
+        for (size_t i = 2; i + 2 < n; ++i)
+        {
+            diffs.push_back(fabs(2. * values[i] - values[i - 2] - values[i + 2]));
+        }
+        noise = 0.6052697 * getMedian(diffs);
+    }
+    if (n >= 2)
+    {
+        diffs.clear();
+        for (size_t i = 0; i + 1 < n; ++i)
+        {
+            diffs.push_back(fabs((double)values[i + 1] - values[i]));
+        }
+        const double noise2 = 1.0483579 * getMedian(diffs);
+        if (noise2 != 0. && (noise == 0. || noise2 < noise))
+        {
+            noise = noise2;
+        }
+    }
+    return noise;
+}
+
+PhitsTiledWriter::PhitsTiledWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth,
+                                   const string& compressionType, float quantizeLevel)
+    : PhitsImageWriter(fd)
+    , m_width(width)
+    , m_height(height)
+    , m_planes(planes)
+    , m_depth(depth)
+    , m_compressionType(compressionType)
+    , m_quantizeLevel(quantizeLevel)
+{
+    if (depth != 8 && depth != 16 && depth != 32)
+    {
+        throw runtime_error("Unsupported depth " + to_string(depth));
+    }
+    if (compressionType != "RICE_1" && compressionType != "GZIP_1")
+    {
+        throw runtime_error("Unsupported compression type " + compressionType);
+    }
+    if (quantizeLevel <= 0.f)
+    {
+        throw runtime_error("Quantize level must be positive");
+    }
+    m_isQuantized = depth == 32 && compressionType == "RICE_1";
+    m_isLongDescriptor = (uint64_t)width * height * planes * (depth / 8) >= kLongHeapSize;
+}
+
+void PhitsTiledWriter::addCards(const vector<string>& cards)
+{
+    m_cards.reserve(m_cards.size() + cards.size());
+    for (const string& card : cards)
+    {
+        const string key = PhitsFitsHeader::getCardKey(card);
+        if (!isLayoutKey(key) && !PhitsTiledReader::isCompressionKey(key))
+        {
+            m_cards.push_back(padCard(card));
+        }
+    }
+}
+
+// The primary header, followed by the table header. Only PCOUNT and TFORMn change once tiles have been
+// written, and they don't change the size of the header.
+vector<string> PhitsTiledWriter::makeHeader() const
+{
+    const uint64_t tileCount = (uint64_t)m_height * m_planes;
+    const string arrayForm = string(m_isLongDescriptor ? "1QB(" : "1PB(") + to_string(m_maxTileBytes) + ")";
+    vector<string> cards;
+    auto add = [&cards](const string& key, const string& value, const string& comment, bool isString = false)
+    {
+        cards.push_back(PhitsFitsHeader::makeCard(key, value, comment, isString));
+    };
+    auto pad = [&cards]()
+    {
+        string end = "END";
+        end.resize(PhitsFitsHeader::kCardSize, ' ');
+        cards.push_back(end);
+        while (cards.size() % (PhitsFitsHeader::kBlockSize / PhitsFitsHeader::kCardSize) != 0)
+        {
+            cards.push_back(string(PhitsFitsHeader::kCardSize, ' '));
+        }
+    };
+
+    add("SIMPLE", "T", "file does conform to FITS standard");
+    add("BITPIX", "8", "number of bits per data pixel");
+    add("NAXIS", "0", "number of data axes");
+    add("EXTEND", "T", "FITS dataset may contain extensions");
+    pad();
+
+    add("XTENSION", "BINTABLE", "binary table extension", true);
+    add("BITPIX", "8", "8-bit bytes");
+    add("NAXIS", "2", "2-dimensional binary table");
+    add("NAXIS1", to_string(m_tableRowBytes), "width of table in bytes");
+    add("NAXIS2", to_string(tileCount), "number of rows in table");
+    add("PCOUNT", to_string(m_heapSize), "size of special data area");
+    add("GCOUNT", "1", "one data group (required keyword)");
+    add("TFIELDS", m_isQuantized ? "4" : "1", "number of fields in each row");
+    add("TTYPE1", "COMPRESSED_DATA", "label for field   1", true);
+    add("TFORM1", arrayForm, "data format of field: variable length array", true);
+    if (m_isQuantized)
+    {
+        add("TTYPE2", "GZIP_COMPRESSED_DATA", "label for field   2", true);
+        add("TFORM2", arrayForm, "data format of field: variable length array", true);
+        add("TTYPE3", "ZSCALE", "label for field   3", true);
+        add("TFORM3", "1D", "data format of field: 8-byte DOUBLE", true);
+        add("TTYPE4", "ZZERO", "label for field   4", true);
+        add("TFORM4", "1D", "data format of field: 8-byte DOUBLE", true);
+    }
+    add("ZIMAGE", "T", "extension contains compressed image");
+    add("ZSIMPLE", "T", "file does conform to FITS standard");
+    add("ZBITPIX", m_depth == 32 ? "-32" : to_string(m_depth), "data type of original image");
+    add("ZNAXIS", m_planes > 1 ? "3" : "2", "dimension of original image");
+    add("ZNAXIS1", to_string(m_width), "length of original image axis");
+    add("ZNAXIS2", to_string(m_height), "length of original image axis");
+    if (m_planes > 1)
+    {
+        add("ZNAXIS3", to_string(m_planes), "length of original image axis");
+    }
+    add("ZTILE1", to_string(m_width), "size of tiles to be compressed");
+    add("ZTILE2", "1", "size of tiles to be compressed");
+    if (m_planes > 1)
+    {
+        add("ZTILE3", "1", "size of tiles to be compressed");
+    }
+    add("ZCMPTYPE", m_compressionType, "compression algorithm", true);
+    if (m_compressionType == "RICE_1")
+    {
+        add("ZNAME1", "BLOCKSIZE", "compression block size", true);
+        add("ZVAL1", to_string(kRiceBlockSize), "pixels per block");
+        add("ZNAME2", "BYTEPIX", "bytes per pixel (1, 2, 4, or 8)", true);
+        add("ZVAL2", m_depth == 8 ? "1" : m_depth == 16 ? "2" : "4", "bytes per pixel (1, 2, 4, or 8)");
+    }
+    if (m_depth == 32)
+    {
+        add("ZQUANTIZ", m_isQuantized ? "SUBTRACTIVE_DITHER_1" : "NONE", "Pixel Quantization Algorithm", true);
+    }
+    if (m_isQuantized)
+    {
+        add("ZDITHER0", "1", "dithering offset when quantizing floats");
+        add("ZBLANK", to_string(PhitsTiledReader::kNullValue), "null value in the compressed integer array");
+    }
+    add("EXTNAME", "COMPRESSED_IMAGE", "name of this binary table extension", true);
+    if (m_depth == 16 && m_bzero == 32768.)
+    {
+        add("BZERO", "32768", "offset data range to that of unsigned short");
+        add("BSCALE", "1", "default scaling factor");
+    }
+    else if (m_depth == 16 && m_bzero != 0.)
+    {
+        add("BZERO", PhitsFitsHeader::formatReal(m_bzero), "physical value = BZERO + BSCALE * array value");
+        add("BSCALE", "1", "scaling of array values");
+    }
+    cards.insert(cards.end(), m_cards.begin(), m_cards.end());
+    pad();
+    return cards;
+}
+
+void PhitsTiledWriter::writeHeader()
+{
+    // Descriptors, then ZSCALE and ZZERO when quantizing.
+    const uint64_t descriptorBytes = m_isLongDescriptor ? 16 : 8;
+    m_tableRowBytes = m_isQuantized ? 2 * descriptorBytes + 16 : descriptorBytes;
+    m_table.assign((size_t)(m_tableRowBytes * m_height * m_planes), 0);
+
+    string header;
+    for (const string& card : makeHeader())
+    {
+        header += card;
+    }
+    writeAt(0, header.data(), header.size());
+    m_headerSize = header.size();
+}
+
+// Quantize a row of floats to integers, with subtractive dithering. Returns false if the row can't be
+// quantized usefully (e.g. it's constant), in which case it's stored losslessly instead.
+bool PhitsTiledWriter::quantizeTile(uint64_t tile, const float* src, vector<int32_t>& dst, double& zscale, double& zzero) const
+{
+    vector<float> values;
+    values.reserve(m_width);
+    for (uint32_t i = 0; i < m_width; ++i)
+    {
+        if (isfinite(src[i]))
+        {
+            values.push_back(src[i]);
+        }
+    }
+
+    dst.resize(m_width);
+    if (values.empty())
+    {
+        zscale = 1.;
+        zzero = 0.;
+        fill(dst.begin(), dst.end(), PhitsTiledReader::kNullValue);
+        return true;
+    }
+
+    const double delta = estimateNoise(values) / m_quantizeLevel;
+    if (delta == 0.)
+    {
+        return false;
+    }
+    const auto range = minmax_element(values.begin(), values.end());
+    const double minValue = *range.first;
+    const double maxValue = *range.second;
+    if ((maxValue - minValue) / delta > 2. * 2147483647. - kReservedValues)
+    {
+        return false;
+    }
+    if ((maxValue - minValue) / delta < 2147483647. - kReservedValues)
+    {
+        // Make the zero point a multiple of delta, so that integral values stay integral.
+        zzero = floor(minValue / delta + .5) * delta;
+    }
+    else
+    {
+        zzero = (minValue + maxValue) / 2.;
+    }
+    zscale = delta;
+
+    // Walk the dither sequence exactly as PhitsTiledReader (and cfitsio) will when unquantizing.
+    const vector<float>& randomValues = PhitsTiledReader::getDitherValues();
+    const int randomCount = (int)randomValues.size();
+    int seed = (int)(tile % randomCount);
+    int next = (int)(randomValues[seed] * 500);
+    for (uint32_t i = 0; i < m_width; ++i)
+    {
+        if (isfinite(src[i]))
+        {
+            const double q = ((double)src[i] - zzero) / delta + randomValues[next] - 0.5;
+            dst[i] = (int32_t)(q >= 0. ? q + .5 : q - .5);
+        }
+        else
+        {
+            dst[i] = PhitsTiledReader::kNullValue;
+        }
+        if (++next == randomCount)
+        {
+            seed = (seed + 1) % randomCount;
+            next = (int)(randomValues[seed] * 500);
+        }
+    }
+    return true;
+}
+
+void PhitsTiledWriter::compressTile(uint64_t tile, const void* src, Tile& out) const
+{
+    const size_t pixels = m_width;
+    if (m_depth == 32)
+    {
+        vector<int32_t> values;
+        if (m_isQuantized && quantizeTile(tile, static_cast<const float*>(src), values, out.zscale, out.zzero))
+        {
+            out.data.resize(pixels * 4 * 2 + 64);
+            const int size = fits_rcomp(values.data(), (int)pixels, out.data.data(), (int)out.data.size(), kRiceBlockSize);
+            if (size < 0)
+            {
+                throw runtime_error("RICE compression failed");
+            }
+            out.data.resize(size);
+            return;
+        }
+        // Lossless: gzipped big-endian floats.
+        vector<uint8_t> bytes(pixels * 4);
+        const float* p = static_cast<const float*>(src);
+        for (size_t i = 0; i < pixels; ++i)
+        {
+            uint32_t v;
+            memcpy(&v, &p[i], sizeof(v));
+            storeBE32(&bytes[4 * i], v);
+        }
+        deflateTile(bytes.data(), bytes.size(), out.data);
+        out.isLossless = m_isQuantized;
+        return;
+    }
+
+    if (m_compressionType == "RICE_1")
+    {
+        out.data.resize(pixels * (m_depth / 8) * 2 + 64);
+        int size = 0;
+        if (m_depth == 8)
+        {
+            signed char* p = reinterpret_cast<signed char*>(const_cast<void*>(src));
+            size = fits_rcomp_byte(p, (int)pixels, out.data.data(), (int)out.data.size(), kRiceBlockSize);
+        }
+        else
+        {
+            // Photoshop's samples, stretched to the unsigned range and offset by BZERO.
+            vector<short> values(pixels);
+            const uint16_t* p = static_cast<const uint16_t*>(src);
+            for (size_t i = 0; i < pixels; ++i)
+            {
+                values[i] = (short)(fromPhotoshop16(p[i]) ^ 0x8000);
+            }
+            size = fits_rcomp_short(values.data(), (int)pixels, out.data.data(), (int)out.data.size(), kRiceBlockSize);
+        }
+        if (size < 0)
+        {
+            throw runtime_error("RICE compression failed");
+        }
+        out.data.resize(size);
+        return;
+    }
+
+    // GZIP_1 compresses the big-endian values.
+    if (m_depth == 8)
+    {
+        deflateTile(src, pixels, out.data);
+        return;
+    }
+    vector<uint8_t> bytes(pixels * 2);
+    const uint16_t* p = static_cast<const uint16_t*>(src);
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        storeBE16(&bytes[2 * i], fromPhotoshop16(p[i]) ^ 0x8000);
+    }
+    deflateTile(bytes.data(), bytes.size(), out.data);
+}
+
+void PhitsTiledWriter::writeRows(uint32_t plane, uint32_t row, uint32_t rows, const void* src)
+{
+    // Each row is a tile.
+    const size_t rowBytes = (size_t)m_width * (m_depth / 8);
+    vector<Tile> tiles(rows);
+    PhitsThreadPool::get().parallelFor(rows, 1, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const uint64_t tile = (uint64_t)plane * m_height + row + i;
+            compressTile(tile, static_cast<const uint8_t*>(src) + i * rowBytes, tiles[i]);
+        }
+    });
+
+    // Append the band's tiles to the heap in one write, and record where they went.
+    vector<uint8_t> heap;
+    for (uint32_t i = 0; i < rows; ++i)
+    {
+        const Tile& t = tiles[i];
+        const uint64_t tile = (uint64_t)plane * m_height + row + i;
+        uint8_t* p = &m_table[tile * m_tableRowBytes];
+        // Lossless fallback tiles leave COMPRESSED_DATA empty, and go in GZIP_COMPRESSED_DATA.
+        uint8_t* descriptor = t.isLossless ? p + (m_isLongDescriptor ? 16 : 8) : p;
+        if (m_isLongDescriptor)
+        {
+            storeBE64(descriptor, t.data.size());
+            storeBE64(descriptor + 8, m_heapSize + heap.size());
+        }
+        else
+        {
+            storeBE32(descriptor, (uint32_t)t.data.size());
+            storeBE32(descriptor + 4, (uint32_t)(m_heapSize + heap.size()));
+        }
+        if (m_isQuantized)
+        {
+            uint64_t bits;
+            memcpy(&bits, &t.zscale, sizeof(bits));
+            storeBE64(p + m_tableRowBytes - 16, bits);
+            memcpy(&bits, &t.zzero, sizeof(bits));
+            storeBE64(p + m_tableRowBytes - 8, bits);
+        }
+        heap.insert(heap.end(), t.data.begin(), t.data.end());
+        m_maxTileBytes = max<uint64_t>(m_maxTileBytes, t.data.size());
+    }
+    if (!m_isLongDescriptor && m_heapSize + heap.size() > 0x7fffffffu)
+    {
+        throw runtime_error("Compressed heap is too large");
+    }
+    writeAt(m_headerSize + m_table.size() + m_heapSize, heap.data(), heap.size());
+    m_heapSize += heap.size();
+}
+
+void PhitsTiledWriter::finish()
+{
+    writeAt(m_headerSize, m_table.data(), m_table.size());
+
+    // Now that the heap size is known, rewrite the headers.
+    string header;
+    for (const string& card : makeHeader())
+    {
+        header += card;
+    }
+    if (header.size() != m_headerSize)
+    {
+        throw runtime_error("Header size changed");
+    }
+    writeAt(0, header.data(), header.size());
+
+    const uint64_t dataSize = m_table.size() + m_heapSize;
+    const size_t padding = (size_t)((PhitsFitsHeader::kBlockSize - dataSize % PhitsFitsHeader::kBlockSize) % PhitsFitsHeader::kBlockSize);
+    if (padding != 0)
+    {
+        const vector<uint8_t> zeros(padding, 0);
+        writeAt(m_headerSize + dataSize, zeros.data(), padding);
+    }
+}
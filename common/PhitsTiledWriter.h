@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSTILEDWRITER_H_
+#define _PHITSTILEDWRITER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "PhitsWriter.h"
+
+// Writes a tile-compressed image, in the layout produced by fpack: an empty primary HDU followed by a
+// binary table extension with one tile per image row. The tiles of each band are compressed in parallel
+// on the thread pool, and appended to the heap as the bands arrive; the table and the final header are
+// written by finish().
+//
+// Integer images are compressed losslessly. Floating-point images are either quantized with subtractive
+// dithering and RICE-compressed, or, with GZIP, compressed losslessly.
+class PhitsTiledWriter : public PhitsImageWriter
+{
+public:
+    // depth is as for PhitsFitsWriter. compressionType is RICE_1 or GZIP_1. quantizeLevel sets the
+    // quantization step of floating-point RICE tiles to the tile's noise level divided by quantizeLevel.
+    PhitsTiledWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth, const std::string& compressionType,
+                     float quantizeLevel);
+
+    // BZERO of the stored values of a depth 16 image, in place of 32768 (the unsigned convention), e.g. for a
+    // signed image opened in 16-bit mode. Must be called before writeHeader().
+    void setZero(double bzero) { m_bzero = bzero; }
+
+    void addCards(const std::vector<std::string>& cards) override;
+    void writeHeader() override;
+    void writeRows(uint32_t plane, uint32_t row, uint32_t rows, const void* src) override;
+    void finish() override;
+
+private:
+    struct Tile
+    {
+        std::vector<uint8_t> data;
+        bool isLossless = false;    // Quantization failed; data holds gzipped floats
+        double zscale = 1.;
+        double zzero = 0.;
+    };
+
+    std::vector<std::string> makeHeader() const;
+    void compressTile(uint64_t tile, const void* src, Tile& out) const;
+    bool quantizeTile(uint64_t tile, const float* src, std::vector<int32_t>& dst, double& zscale, double& zzero) const;
+
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_planes;
+    uint32_t m_depth;
+    std::string m_compressionType;
+    float m_quantizeLevel;
+    bool m_isQuantized;
+    bool m_isLongDescriptor;            // Q rather than P descriptors, for heaps that may exceed 2 GB
+    double m_bzero = 32768.;            // Of depth 16 images
+    std::vector<std::string> m_cards;   // Caller's keywords
+    uint64_t m_headerSize = 0;          // Both headers
+    uint64_t m_tableRowBytes = 0;
+    uint64_t m_heapSize = 0;
+    uint64_t m_maxTileBytes = 0;
+    std::vector<uint8_t> m_table;       // Descriptors and scaling of each tile, written by finish()
+};
+
+#endif // _PHITSTILEDWRITER_H_
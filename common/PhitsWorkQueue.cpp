@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsWorkQueue.h"
+
+using namespace std;
+
+PhitsWorkQueue::PhitsWorkQueue(size_t maxPending)
+    : m_maxPending(maxPending)
+{
+    if (maxPending > 0)
+    {
+        m_thread = thread(&PhitsWorkQueue::threadMain, this);
+    }
+}
+
+PhitsWorkQueue::~PhitsWorkQueue()
+{
+    cancel();
+    if (m_thread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+    }
+}
+
+void PhitsWorkQueue::threadMain()
+{
+    for (;;)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]() { return m_quit || !m_tasks.empty(); });
+            if (m_tasks.empty())
+            {
+                return;
+            }
+            task = move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+
+        exception_ptr error;
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (error && !m_error)
+            {
+                m_error = error;
+                m_completed += m_tasks.size();
+                m_pending -= m_tasks.size();
+                m_tasks.clear();
+            }
+            --m_pending;
+            ++m_completed;
+        }
+        m_done.notify_all();
+    }
+}
+
+void PhitsWorkQueue::rethrowError()
+{
+    if (m_error)
+    {
+        exception_ptr error = m_error;
+        m_error = nullptr;
+        rethrow_exception(error);
+    }
+}
+
+uint64_t PhitsWorkQueue::submit(function<void()> task)
+{
+    if (m_maxPending == 0)
+    {
+        task();
+        m_completed = ++m_submitted;
+        return m_submitted;
+    }
+
+    uint64_t ticket = 0;
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_error || m_pending < m_maxPending; });
+        rethrowError();
+        m_tasks.push_back(move(task));
+        ++m_pending;
+        ticket = ++m_submitted;
+    }
+    m_wake.notify_one();
+    return ticket;
+}
+
+void PhitsWorkQueue::wait()
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_pending == 0; });
+    rethrowError();
+}
+
+void PhitsWorkQueue::waitFor(uint64_t ticket)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_done.wait(lock, [this, ticket]() { return m_error || m_completed >= ticket; });
+    rethrowError();
+}
+
+void PhitsWorkQueue::cancel()
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_completed += m_tasks.size();
+    m_pending -= m_tasks.size();
+    m_tasks.clear();
+    m_done.wait(lock, [this]() { return m_pending == 0; });
+    m_error = nullptr;
+}
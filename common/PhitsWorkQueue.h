@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSWORKQUEUE_H_
+#define _PHITSWORKQUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs tasks, in the order they were submitted, on a background thread, so that the submitting thread can
+// overlap its own work (typically advanceState()) with them. At most maxPending tasks may be queued or
+// running at once; submit() blocks until there is room, which bounds the number of buffers in flight.
+//
+// If a task throws, the remaining tasks are discarded, and the exception is rethrown by the next call to
+// submit(), wait() or waitFor(). With maxPending == 0, tasks run synchronously in submit().
+class PhitsWorkQueue
+{
+public:
+    explicit PhitsWorkQueue(size_t maxPending);
+    ~PhitsWorkQueue();
+    PhitsWorkQueue(const PhitsWorkQueue&) = delete;
+    PhitsWorkQueue& operator=(const PhitsWorkQueue&) = delete;
+
+    // Returns a ticket for the task, for use with waitFor(). Tickets increase by one with each task.
+    uint64_t submit(std::function<void()> task);
+
+    // Wait for all submitted tasks to finish.
+    void wait();
+
+    // Wait for the task with the given ticket, and hence all tasks submitted before it, to finish.
+    void waitFor(uint64_t ticket);
+
+    // Discard tasks that haven't started, and wait for the running one, if any. Doesn't throw.
+    void cancel();
+
+private:
+    void threadMain();
+    void rethrowError();
+
+    const size_t m_maxPending;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::deque<std::function<void()>> m_tasks;
+    size_t m_pending = 0;       // Queued plus running
+    uint64_t m_submitted = 0;
+    uint64_t m_completed = 0;
+    std::exception_ptr m_error;
+    bool m_quit = false;
+    std::thread m_thread;
+};
+
+#endif // _PHITSWORKQUEUE_H_
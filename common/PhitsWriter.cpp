@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#include "PhitsWriter.h"
+#include "PhitsEndian.h"
+#include "PhitsFitsHeader.h"
+#include "PhitsKernels.h"
+#include "PhitsThreadPool.h"
+#include <errno.h>
+#include <limits>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Samples per parallel encode task.
+static const size_t kEncodeGrain = 64 * 1024;
+
+// Keywords derived from the image itself, which are never copied from the caller. Checksums of the original
+// data would be wrong for ours, and so would its range, once the image has been edited. BLANK is not allowed
+// in a floating-point HDU, and would mark nothing in an integer one: undefined pixels are given a value when
+// the image is read. The name of the extension an image was read from doesn't belong in a primary header,
+// nor beside a tiled writer's own.
+static const char* const kLayoutKeys[] = { "SIMPLE", "XTENSION", "BITPIX", "NAXIS", "EXTEND", "PCOUNT", "GCOUNT", "GROUPS", "BSCALE", "BZERO",
+                                           "BLANK", "CHECKSUM", "DATASUM", "DATAMIN", "DATAMAX", "PHTRANGE", "EXTNAME", "EXTVER", "END" };
+
+// Cards that setDataRangeCards() adds: DATAMIN, DATAMAX and PHTRANGE.
+static const size_t kRangeCardCount = 3;
+
+// Photoshop's 16-bit samples run from 0 to 32768; they're stretched to the full unsigned range, which FITS
+// stores as signed 16-bit values offset by BZERO = 32768.
+static void encodeShort(const uint16_t* src, uint8_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        storeBE16(dst + 2 * i, fromPhotoshop16(src[i]) ^ 0x8000);
+    }
+}
+
+// Widen [lo, hi] to include the count integer samples at src.
+template <typename T>
+static void sampleRange(const T* src, size_t count, float& lo, float& hi)
+{
+    T minVal = numeric_limits<T>::max();
+    T maxVal = numeric_limits<T>::min();
+    for (size_t i = 0; i < count; ++i)
+    {
+        minVal = min(minVal, src[i]);
+        maxVal = max(maxVal, src[i]);
+    }
+    if (count != 0)
+    {
+        lo = min(lo, (float)minVal);
+        hi = max(hi, (float)maxVal);
+    }
+}
+
+static void encodeFloat(const float* src, uint8_t* dst, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t v;
+        memcpy(&v, &src[i], sizeof(v));
+        storeBE32(dst + 4 * i, v);
+    }
+}
+
+bool PhitsImageWriter::isLayoutKey(const string& key)
+{
+    for (const char* layoutKey : kLayoutKeys)
+    {
+        if (key == layoutKey)
+        {
+            return true;
+        }
+    }
+    return key.compare(0, 5, "NAXIS") == 0;
+}
+
+string PhitsImageWriter::padCard(const string& card)
+{
+    string padded = card.substr(0, PhitsFitsHeader::kCardSize);
+    padded.resize(PhitsFitsHeader::kCardSize, ' ');
+    return padded;
+}
+
+PhitsFitsWriter::PhitsFitsWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth)
+    : PhitsImageWriter(fd)
+    , m_width(width)
+    , m_height(height)
+    , m_planes(planes)
+    , m_depth(depth)
+    , m_bitpix(depth == 32 ? -32 : (int)depth)
+    , m_bzero(depth == 16 ? 32768. : 0.)
+    , m_bscale(1.)
+    , m_minSample(numeric_limits<float>::max())
+    , m_maxSample(numeric_limits<float>::lowest())
+{
+    if (depth != 8 && depth != 16 && depth != 32)
+    {
+        throw runtime_error("Unsupported depth " + to_string(depth));
+    }
+}
+
+void PhitsFitsWriter::setIntegerFormat(const PhitsIntegerFormat& format)
+{
+    const bool isSupported = m_depth == 32 ? format.bitpix == 8 || format.bitpix == 16 || format.bitpix == 32
+                                           : m_depth == 16 && format.bitpix == 16;
+    if (!isSupported || format.bscale == 0.)
+    {
+        throw runtime_error("Can't store depth " + to_string(m_depth) + " as BITPIX " + to_string(format.bitpix));
+    }
+    m_bitpix = format.bitpix;
+    m_bzero = format.bzero;
+    m_bscale = format.bscale;
+    m_encodeScale = (format.oneValue - format.zeroValue) / format.bscale;
+    m_encodeOffset = (format.zeroValue - format.bzero) / format.bscale;
+    m_transform = format.transform;
+}
+
+void PhitsFitsWriter::addCards(const vector<string>& cards)
+{
+    m_cards.reserve(m_cards.size() + cards.size());
+    for (const string& card : cards)
+    {
+        if (!isLayoutKey(PhitsFitsHeader::getCardKey(card)))
+        {
+            m_cards.push_back(padCard(card));
+        }
+    }
+}
+
+void PhitsFitsWriter::writeHeader()
+{
+    vector<string> cards;
+    cards.push_back(PhitsFitsHeader::makeCard("SIMPLE", "T", "file does conform to FITS standard", false));
+    cards.push_back(PhitsFitsHeader::makeCard("BITPIX", to_string(m_bitpix), "number of bits per data pixel", false));
+    cards.push_back(PhitsFitsHeader::makeCard("NAXIS", "3", "number of data axes", false));
+    cards.push_back(PhitsFitsHeader::makeCard("NAXIS1", to_string(m_width), "length of data axis 1", false));
+    cards.push_back(PhitsFitsHeader::makeCard("NAXIS2", to_string(m_height), "length of data axis 2", false));
+    cards.push_back(PhitsFitsHeader::makeCard("NAXIS3", to_string(m_planes), "length of data axis 3", false));
+    cards.push_back(PhitsFitsHeader::makeCard("EXTEND", "T", "FITS dataset may contain extensions", false));
+    if (m_bitpix == 16 && m_bzero == 32768. && m_bscale == 1.)
+    {
+        cards.push_back(PhitsFitsHeader::makeCard("BZERO", "32768", "offset data range to that of unsigned short", false));
+        cards.push_back(PhitsFitsHeader::makeCard("BSCALE", "1", "default scaling factor", false));
+    }
+    else if (m_bzero != 0. || m_bscale != 1.)
+    {
+        cards.push_back(PhitsFitsHeader::makeCard("BZERO", PhitsFitsHeader::formatReal(m_bzero), "physical value = BZERO + BSCALE * array value", false));
+        cards.push_back(PhitsFitsHeader::makeCard("BSCALE", PhitsFitsHeader::formatReal(m_bscale), "scaling of array values", false));
+    }
+    // The range cards are left blank until finish() knows their values.
+    m_hasRangeCards = m_hasRangeCards && !isSequential();
+    if (m_hasRangeCards)
+    {
+        m_rangeCardsOffset = cards.size() * PhitsFitsHeader::kCardSize;
+        cards.insert(cards.end(), kRangeCardCount, string(PhitsFitsHeader::kCardSize, ' '));
+    }
+    cards.insert(cards.end(), m_cards.begin(), m_cards.end());
+
+    // The header and data sizes are known before anything is written, so the whole file is laid out at once.
+    string header;
+    header.reserve((cards.size() + 1) * PhitsFitsHeader::kCardSize + PhitsFitsHeader::kBlockSize);
+    for (const string& card : cards)
+    {
+        header += card;
+    }
+    header += "END";
+    header.resize((header.size() + PhitsFitsHeader::kBlockSize - 1) / PhitsFitsHeader::kBlockSize * PhitsFitsHeader::kBlockSize, ' ');
+    m_headerSize = header.size();
+    const uint64_t dataSize = (uint64_t)m_width * m_height * m_planes * (abs(m_bitpix) / 8);
+    reserve(m_headerSize + (dataSize + PhitsFitsHeader::kBlockSize - 1) / PhitsFitsHeader::kBlockSize * PhitsFitsHeader::kBlockSize);
+    writeAt(0, header.data(), header.size());
+}
+
+void PhitsFitsWriter::writeRows(uint32_t plane, uint32_t row, uint32_t rows, const void* src)
+{
+    const size_t sampleBytes = abs(m_bitpix) / 8;
+    const size_t count = (size_t)rows * m_width;
+    const uint64_t offset = m_headerSize + ((uint64_t)plane * m_width * m_height + (uint64_t)row * m_width) * sampleBytes;
+    if (m_depth == 8)
+    {
+        if (m_hasRangeCards)
+        {
+            sampleRange(static_cast<const uint8_t*>(src), count, m_minSample, m_maxSample);
+        }
+        writeAt(offset, src, count);
+        return;
+    }
+
+    if (m_staging.size() < count * sampleBytes)
+    {
+        m_staging.resize(count * sampleBytes);
+    }
+    uint8_t* dst = m_staging.data();
+    const uint32_t depth = m_depth;
+    const PhitsEncodeKernel quantize = depth == 32 && m_bitpix > 0 ? getEncodeKernel(getPhitsKernels(), m_bitpix) : nullptr;
+    const double encodeScale = m_encodeScale;
+    const double encodeOffset = m_encodeOffset;
+    if (quantize && m_transform && m_transformed.size() < count)
+    {
+        m_transformed.resize(count);
+    }
+    float* transformed = m_transform ? m_transformed.data() : nullptr;
+    // Each chunk's range is taken while its samples are in cache for encoding, and the results combined.
+    const PhitsKernels& kernels = getPhitsKernels();
+    const bool hasRange = m_hasRangeCards;
+    const size_t chunkCount = hasRange ? (count + kEncodeGrain - 1) / kEncodeGrain : 0;
+    vector<float> mins(chunkCount, m_minSample);
+    vector<float> maxs(chunkCount, m_maxSample);
+    PhitsThreadPool::get().parallelFor(count, kEncodeGrain, [&](size_t begin, size_t end)
+    {
+        if (hasRange)
+        {
+            const size_t chunk = begin / kEncodeGrain;
+            if (depth == 16)
+            {
+                sampleRange(static_cast<const uint16_t*>(src) + begin, end - begin, mins[chunk], maxs[chunk]);
+            }
+            else
+            {
+                kernels.minMax(static_cast<const float*>(src) + begin, end - begin, mins[chunk], maxs[chunk]);
+            }
+        }
+        if (depth == 16)
+        {
+            encodeShort(static_cast<const uint16_t*>(src) + begin, dst + begin * 2, end - begin);
+        }
+        else if (quantize)
+        {
+            const float* fp = static_cast<const float*>(src) + begin;
+            if (transformed)
+            {
+                m_transform(fp, transformed + begin, end - begin);
+                fp = transformed + begin;
+            }
+            quantize(fp, dst + begin * sampleBytes, end - begin, encodeScale, encodeOffset);
+        }
+        else
+        {
+            encodeFloat(static_cast<const float*>(src) + begin, dst + begin * 4, end - begin);
+        }
+    });
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        m_minSample = min(m_minSample, mins[i]);
+        m_maxSample = max(m_maxSample, maxs[i]);
+    }
+    writeAt(offset, dst, count * sampleBytes);
+}
+
+double PhitsFitsWriter::getDataValue(float sample) const
+{
+    int64_t stored = 0;
+    if (m_depth == 8)
+    {
+        stored = (int64_t)sample;
+    }
+    else if (m_depth == 16)
+    {
+        stored = (int16_t)(fromPhotoshop16((uint32_t)sample) ^ 0x8000);
+    }
+    else if (m_bitpix < 0)
+    {
+        return sample;
+    }
+    else
+    {
+        // Encode the sample as writeRows() does, and read back the integer it stores.
+        if (m_transform)
+        {
+            m_transform(&sample, &sample, 1);
+        }
+        uint8_t bytes[4];
+        getEncodeKernel(getPhitsScalarKernels(), m_bitpix)(&sample, bytes, 1, m_encodeScale, m_encodeOffset);
+        stored = m_bitpix == 8 ? bytes[0] : m_bitpix == 16 ? (int16_t)loadBE16(bytes) : (int32_t)loadBE32(bytes);
+    }
+    return stored * m_bscale + m_bzero;
+}
+
+void PhitsFitsWriter::finish()
+{
+    const uint64_t dataSize = (uint64_t)m_width * m_height * m_planes * (abs(m_bitpix) / 8);
+    const size_t padding = (size_t)((PhitsFitsHeader::kBlockSize - dataSize % PhitsFitsHeader::kBlockSize) % PhitsFitsHeader::kBlockSize);
+    if (padding != 0)
+    {
+        const vector<uint8_t> zeros(padding, 0);
+        writeAt(m_headerSize + dataSize, zeros.data(), padding);
+    }
+
+    if (m_hasRangeCards && m_minSample <= m_maxSample)
+    {
+        // Values are stored in order of the samples, unless BSCALE is negative.
+        double minValue = getDataValue(m_minSample);
+        double maxValue = getDataValue(m_maxSample);
+        if (minValue > maxValue)
+        {
+            swap(minValue, maxValue);
+        }
+        string cards = PhitsFitsHeader::makeCard("DATAMIN", PhitsFitsHeader::formatReal(minValue), "minimum data value", false) +
+                       PhitsFitsHeader::makeCard("DATAMAX", PhitsFitsHeader::formatReal(maxValue), "maximum data value", false) +
+                       PhitsFitsHeader::makeCard("PHTRANGE", "T", "DATAMIN and DATAMAX are exact (Phits)", false);
+        writeAt(m_rangeCardsOffset, cards.data(), cards.size());
+    }
+}
+
+#ifdef _WIN32
+
+void PhitsImageWriter::writeAt(uint64_t offset, const void* data, size_t size)
+{
+    HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(m_fd));
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        const DWORD chunk = (DWORD)(size < (1u << 30) ? size : (1u << 30));
+        DWORD written = 0;
+        if (!WriteFile(hFile, p, chunk, &written, &overlapped) || written == 0)
+        {
+            throw runtime_error("Write failed, error " + to_string(GetLastError()));
+        }
+        p += written;
+        offset += written;
+        size -= written;
+    }
+}
+
+void PhitsImageWriter::reserve(uint64_t size)
+{
+    HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(m_fd));
+    FILE_ALLOCATION_INFO allocation = {};
+    allocation.AllocationSize.QuadPart = (LONGLONG)size;
+    SetFileInformationByHandle(hFile, FileAllocationInfo, &allocation, sizeof(allocation));
+    FILE_END_OF_FILE_INFO endOfFile = {};
+    endOfFile.EndOfFile.QuadPart = (LONGLONG)size;
+    SetFileInformationByHandle(hFile, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile));
+}
+
+#else
+
+void PhitsImageWriter::writeAt(uint64_t offset, const void* data, size_t size)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        const ssize_t written = pwrite(m_fd, p, size, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            throw runtime_error(string("Write failed: ") + strerror(errno));
+        }
+        p += written;
+        offset += written;
+        size -= written;
+    }
+}
+
+void PhitsImageWriter::reserve(uint64_t size)
+{
+#if defined(__APPLE__)
+    // Ask for contiguous space first, and settle for any.
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+    if (fcntl(m_fd, F_PREALLOCATE, &store) == -1)
+    {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(m_fd, F_PREALLOCATE, &store);
+    }
+#elif defined(__linux__)
+    posix_fallocate(m_fd, 0, (off_t)size);
+#endif
+    // Also trims whatever follows, if we're overwriting a larger file.
+    if (ftruncate(m_fd, (off_t)size) != 0)
+    {
+        // Not fatal: the writes extend the file themselves.
+    }
+}
+
+#endif
@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+#ifndef _PHITSWRITER_H_
+#define _PHITSWRITER_H_
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Writes an image straight to the output file, without going through CCfits. Errors are reported by
+// throwing std::runtime_error.
+class PhitsImageWriter
+{
+public:
+    virtual ~PhitsImageWriter() {}
+    PhitsImageWriter(const PhitsImageWriter&) = delete;
+    PhitsImageWriter& operator=(const PhitsImageWriter&) = delete;
+
+    // Add raw cards, as read from another header, to the header; must be called before writeHeader(). Cards
+    // that describe the data layout (SIMPLE, BITPIX, NAXISn, BSCALE, BZERO, BLANK, ...) are ours to write,
+    // and those that describe the original data (DATASUM, DATAMIN, ...) would be stale, as would the name of
+    // the HDU it was read from (EXTNAME, EXTVER); all are dropped. The rest are copied as they are, in order.
+    virtual void addCards(const std::vector<std::string>& cards) = 0;
+
+    virtual void writeHeader() = 0;
+
+    // Write rows [row, row + rows) of the given plane, from host samples at src. Calls are made from one
+    // thread at a time.
+    virtual void writeRows(uint32_t plane, uint32_t row, uint32_t rows, const void* src) = 0;
+
+    // Complete the file once all rows have been written.
+    virtual void finish() = 0;
+
+    // True if rows must be written in file order, i.e. one plane after another.
+    virtual bool isSequential() const { return false; }
+
+protected:
+    // fd is owned by the caller (on Windows, a CRT descriptor as returned by _open_osfhandle()).
+    explicit PhitsImageWriter(int fd) : m_fd(fd) {}
+
+    // True for keywords that addCards() should drop.
+    static bool isLayoutKey(const std::string& key);
+
+    // A card as read, blank-padded (or truncated) to PhitsFitsHeader::kCardSize.
+    static std::string padCard(const std::string& card);
+
+    virtual void writeAt(uint64_t offset, const void* data, size_t size);
+
+    // Set the file to its final size before any data is written, having the file system allocate it in
+    // one piece where it can, so that streaming the image doesn't grow the file a write at a time. Failure
+    // is harmless, and ignored.
+    virtual void reserve(uint64_t size);
+
+    int m_fd;
+};
+
+// Integer storage for the samples of a float (or 16-bit) image, in place of the default for its depth.
+struct PhitsIntegerFormat
+{
+    int bitpix = 16;            // 8, 16 or 32
+    double bzero = 0.;
+    double bscale = 1.;
+    // Float samples are mapped linearly to data values, zeroValue for 0 and oneValue for 1, which are stored
+    // as round((value - bzero) / bscale), clamped to the range of bitpix. For 16-bit samples, only BZERO
+    // and BSCALE change; the stored values are as for the default format.
+    double zeroValue = 0.;
+    double oneValue = 1.;
+    // If set, applied to float samples before they're mapped to data values, e.g. to undo a nonlinear stretch.
+    // Called on chunks of a band from several threads at once.
+    std::function<void(const float* src, float* dst, size_t count)> transform;
+};
+
+// Writes an uncompressed primary image. Host samples are encoded to big-endian FITS a band at a time, and
+// each plane's slice of a band goes out in one write.
+class PhitsFitsWriter : public PhitsImageWriter
+{
+public:
+    // depth is the host depth: by default, 8 is written as BITPIX 8, 16 as BITPIX 16 with BZERO 32768, and
+    // 32 as BITPIX -32.
+    PhitsFitsWriter(int fd, uint32_t width, uint32_t height, uint32_t planes, uint32_t depth);
+
+    // Store a depth 32 image as integers, or a depth 16 one (as BITPIX 16) with other BZERO and BSCALE
+    // values. Must be called before writeHeader(). Throws if the format doesn't suit the depth.
+    void setIntegerFormat(const PhitsIntegerFormat& format);
+
+    // Record the exact range of the data values written in DATAMIN and DATAMAX cards, marked as ours by
+    // PHTRANGE = T, so that the image can be normalized without a pass over it when it's read again. The
+    // range is gathered as the rows are encoded; writeHeader() leaves room for the cards, which finish()
+    // fills in. Must be called before writeHeader(). Ignored by sequential writers, which can't go back.
+    void setDataRangeCards(bool isEnabled) { m_hasRangeCards = isEnabled; }
+
+    void addCards(const std::vector<std::string>& cards) override;
+    void writeHeader() override;
+    void writeRows(uint32_t plane, uint32_t row, uint32_t rows, const void* src) override;
+
+    // Pad the data unit to a whole number of blocks, and fill in the data range cards, if any.
+    void finish() override;
+
+private:
+    // Data value stored for a host sample, as a reader would compute it.
+    double getDataValue(float sample) const;
+
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_planes;
+    uint32_t m_depth;
+    int m_bitpix;
+    double m_bzero;
+    double m_bscale;
+    double m_encodeScale = 1.;          // Float samples to stored integers
+    double m_encodeOffset = 0.;
+    std::function<void(const float*, float*, size_t)> m_transform;
+    std::vector<float> m_transformed;
+    std::vector<std::string> m_cards;   // Caller's cards
+    uint64_t m_headerSize = 0;
+    bool m_hasRangeCards = false;
+    uint64_t m_rangeCardsOffset = 0;    // File offset of the space left for the data range cards
+    float m_minSample;                  // Range of the host samples written so far
+    float m_maxSample;
+    std::vector<uint8_t> m_staging;
+};
+
+#endif // _PHITSWRITER_H_
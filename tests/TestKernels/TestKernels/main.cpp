@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright 2022, Craig Kolb
+ * Licensed under the Apache License, Version 2.0
+ */
+// Checks every kernel set the CPU supports against the scalar reference, for each BITPIX, scaled and
+// unscaled, with and without BLANK, and for lengths that leave every possible tail after the vector loops.
+// Built by TestKernels.xcodeproj, and by TestKernels.vcxproj in tests/Tests; exits nonzero on failure.
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "PhitsEndian.h"
+#include "PhitsKernels.h"
+
+using namespace std;
+
+static const int kBitpixes[] = { 8, 16, 32, 64, -32, -64 };
+
+// Scaling as (bscale, bzero): none, the usual unsigned offsets, and a general linear map.
+static const double kScalings[][2] = { { 1., 0. }, { 1., 128. }, { 1., 32768. }, { 0.25, -1000.5 } };
+
+// Empty, shorter than any vector, and one past, or one short of, several vector widths.
+static const size_t kCounts[] = { 0, 1, 2, 3, 5, 7, 9, 15, 17, 31, 33, 63, 65, 127, 129, 1001 };
+
+static mt19937 gRandom(1);
+
+// Bitwise equality, except that any NaN matches any other.
+static bool isSame(float a, float b)
+{
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+static bool checkFloats(const string& what, const vector<float>& expected, const vector<float>& actual)
+{
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        if (!isSame(expected[i], actual[i]))
+        {
+            cerr << what << ": sample " << i << " is " << actual[i] << ", expected " << expected[i] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool checkBytes(const string& what, const vector<uint8_t>& expected, const vector<uint8_t>& actual)
+{
+    if (expected != actual)
+    {
+        cerr << what << ": encoded bytes differ" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Range of the integer samples of a BITPIX, as stored.
+static int64_t getMin(int bitpix)
+{
+    return bitpix == 8 ? 0 : bitpix == 64 ? INT64_MIN : -((int64_t)1 << (bitpix - 1));
+}
+
+static void storeSample(int bitpix, int64_t value, uint8_t* p)
+{
+    switch (bitpix)
+    {
+        case 8:
+            *p = (uint8_t)value;
+            break;
+        case 16:
+            storeBE16(p, (uint16_t)value);
+            break;
+        case 32:
+            storeBE32(p, (uint32_t)value);
+            break;
+        default:
+            storeBE64(p, (uint64_t)value);
+            break;
+    }
+}
+
+// Random big-endian samples. Floating-point ones are finite, with a few NaNs and infinities mixed in.
+static vector<uint8_t> makeSamples(int bitpix, size_t count)
+{
+    const size_t bytes = abs(bitpix) / 8;
+    vector<uint8_t> data(count * bytes);
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t* p = data.data() + i * bytes;
+        const uint32_t r = gRandom();
+        if (bitpix == -32)
+        {
+            float value = i % 11 == 3 ? NAN : i % 13 == 5 ? -INFINITY : ((int32_t)r / 65536.f);
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            storeBE32(p, bits);
+        }
+        else if (bitpix == -64)
+        {
+            double value = i % 11 == 3 ? NAN : i % 13 == 5 ? INFINITY : ((int32_t)r / 4096.);
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            storeBE64(p, bits);
+        }
+        else
+        {
+            storeSample(bitpix, ((int64_t)r << 32) | gRandom(), p);
+        }
+    }
+    return data;
+}
+
+static bool testDecode(const PhitsKernels& kernels, const PhitsKernels& scalar)
+{
+    for (int bitpix : kBitpixes)
+    {
+        for (const auto& scaling : kScalings)
+        {
+            for (size_t count : kCounts)
+            {
+                const vector<uint8_t> src = makeSamples(bitpix, count);
+                vector<float> expected(count + 1, -1.f);
+                vector<float> actual(count + 1, -1.f);
+                getDecodeKernel(scalar, bitpix)(src.data(), expected.data(), count, scaling[0], scaling[1]);
+                getDecodeKernel(kernels, bitpix)(src.data(), actual.data(), count, scaling[0], scaling[1]);
+                const string what = string(kernels.name) + " decode BITPIX " + to_string(bitpix) + " scale " +
+                                    to_string(scaling[0]) + " zero " + to_string(scaling[1]) + " count " + to_string(count);
+                if (!checkFloats(what, expected, actual))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    for (size_t count : kCounts)
+    {
+        const vector<uint8_t> src = makeSamples(16, count);
+        vector<uint16_t> expected(count + 1, 0xffff);
+        vector<uint16_t> actual(count + 1, 0xffff);
+        scalar.decodeShort16(src.data(), expected.data(), count);
+        kernels.decodeShort16(src.data(), actual.data(), count);
+        if (expected != actual)
+        {
+            cerr << kernels.name << " decodeShort16 count " << count << ": samples differ" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Integer samples are decoded, then masked where they equal BLANK. Without BLANK, the value chosen is one that
+// doesn't occur in the data, which must leave every sample alone.
+static bool testMask(const PhitsKernels& kernels, const PhitsKernels& scalar)
+{
+    for (int bitpix : { 8, 16, 32, 64 })
+    {
+        const size_t bytes = bitpix / 8;
+        for (bool hasBlank : { false, true })
+        {
+            for (size_t count : kCounts)
+            {
+                vector<uint8_t> src = makeSamples(bitpix, count);
+                const int64_t blank = getMin(bitpix) + 1;
+                uint8_t blankBytes[8];
+                storeSample(bitpix, blank, blankBytes);
+                for (size_t i = 0; i < count; ++i)
+                {
+                    uint8_t* p = src.data() + i * bytes;
+                    if (hasBlank && i % 3 == 1)
+                    {
+                        memcpy(p, blankBytes, bytes);
+                    }
+                    else if (!hasBlank && memcmp(p, blankBytes, bytes) == 0)
+                    {
+                        storeSample(bitpix, blank + 1, p);
+                    }
+                }
+                vector<float> expected(count + 1, -1.f);
+                getDecodeKernel(scalar, bitpix)(src.data(), expected.data(), count, 1., 0.);
+                vector<float> actual(expected);
+                vector<float> unmasked(expected);
+                getMaskKernel(scalar, bitpix)(src.data(), expected.data(), count, blank);
+                getMaskKernel(kernels, bitpix)(src.data(), actual.data(), count, blank);
+                const string what = string(kernels.name) + " mask BITPIX " + to_string(bitpix) +
+                                    (hasBlank ? " with" : " without") + " BLANK count " + to_string(count);
+                if (!checkFloats(what, expected, actual) || (!hasBlank && !checkFloats(what + " (scalar)", unmasked, expected)))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Floats spanning each integer range and beyond, with NaNs and exact ties for the rounding.
+static vector<float> makeFloats(size_t count, float scale)
+{
+    vector<float> values(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int32_t r = (int32_t)gRandom();
+        values[i] = i % 17 == 4 ? NAN : i % 5 == 2 ? (float)(r % 1000) + 0.5f : r / 2147483648.f * scale;
+    }
+    return values;
+}
+
+static bool testEncode(const PhitsKernels& kernels, const PhitsKernels& scalar)
+{
+    for (int bitpix : { 8, 16, 32 })
+    {
+        const double range = ldexp(1., bitpix);
+        // Unscaled, and a scaled map of 0..1 to the whole range, as the writers use.
+        const double scalings[][2] = { { 1., 0. }, { range - 1., (double)getMin(bitpix) } };
+        for (const auto& scaling : scalings)
+        {
+            for (size_t count : kCounts)
+            {
+                const vector<float> src = makeFloats(count, scaling[0] == 1. ? (float)range : 1.5f);
+                vector<uint8_t> expected(count * bitpix / 8 + 1, 0xa5);
+                vector<uint8_t> actual(expected);
+                getEncodeKernel(scalar, bitpix)(src.data(), expected.data(), count, scaling[0], scaling[1]);
+                getEncodeKernel(kernels, bitpix)(src.data(), actual.data(), count, scaling[0], scaling[1]);
+                const string what = string(kernels.name) + " encode BITPIX " + to_string(bitpix) +
+                                    (scaling[0] == 1. ? " unscaled" : " scaled") + " count " + to_string(count);
+                if (!checkBytes(what, expected, actual))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool testStatistics(const PhitsKernels& kernels, const PhitsKernels& scalar)
+{
+    for (size_t count : kCounts)
+    {
+        vector<float> src = makeFloats(count, 1000.f);
+        for (size_t i = 0; i < count; i += 7)
+        {
+            src[i] = i % 2 ? INFINITY : -INFINITY;
+        }
+
+        float expectedMin = 1.f, expectedMax = 0.f, actualMin = 1.f, actualMax = 0.f;
+        scalar.minMax(src.data(), count, expectedMin, expectedMax);
+        kernels.minMax(src.data(), count, actualMin, actualMax);
+        if (!isSame(expectedMin, actualMin) || !isSame(expectedMax, actualMax))
+        {
+            cerr << kernels.name << " minMax count " << count << ": [" << actualMin << ", " << actualMax << "], expected [" <<
+                    expectedMin << ", " << expectedMax << "]" << endl;
+            return false;
+        }
+
+        vector<float> expected(count + 1, -1.f);
+        vector<float> actual(count + 1, -1.f);
+        scalar.normalize(src.data(), expected.data(), count, 3.f, 0.001f, 0.5f);
+        kernels.normalize(src.data(), actual.data(), count, 3.f, 0.001f, 0.5f);
+        if (!checkFloats(string(kernels.name) + " normalize count " + to_string(count), expected, actual))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    const PhitsKernels& scalar = getPhitsScalarKernels();
+    bool isPassed = true;
+    for (const PhitsKernels* pKernels : getPhitsSupportedKernels())
+    {
+        const bool isKernelsPassed = testDecode(*pKernels, scalar) && testMask(*pKernels, scalar) &&
+                                     testEncode(*pKernels, scalar) && testStatistics(*pKernels, scalar);
+        cout << pKernels->name << ": " << (isKernelsPassed ? "passed" : "FAILED") << endl;
+        isPassed = isPassed && isKernelsPassed;
+    }
+    return isPassed ? 0 : 1;
+}